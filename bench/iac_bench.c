@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "../src/nvt.h"
+
+/* Times the telnet IAC scanners, and the escaping line_write() does with
+ * nvt_escape_iac() against the byte by byte copy it made before.  The
+ * data is binary, as in a file transfer, once with no IAC in it and once
+ * with one every 4 KB.  The escaped slices are first checked against the
+ * old copy.
+ */
+
+#define BUF_LEN 65536
+#define IAC_EVERY 4096
+#define BENCH_BYTES (1LL << 28)
+#define SLICES 64
+
+int scan_scalar(unsigned char *data, int len, unsigned char limit);
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#  define HAVE_SSE2_SCAN 1
+int scan_sse2(unsigned char *data, int len, unsigned char limit);
+int scan_avx2(unsigned char *data, int len, unsigned char limit);
+#endif
+
+typedef int (*scan_fn)(unsigned char *data, int len, unsigned char limit);
+
+unsigned char data[BUF_LEN];
+unsigned char copy[BUF_LEN * 2];
+int copy_len;
+long long sink;
+
+double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void send_text(unsigned char *text, int len) {
+  memcpy(copy + copy_len, text, len);
+  copy_len += len;
+}
+
+/*
+ * line_write() before the scanner: every byte through a 1 KB buffer.
+ */
+void copy_escape(unsigned char *data, int len) {
+  unsigned char text[1024];
+  int text_len = 0;
+  int double_iac = FALSE;
+  int i = 0;
+
+  copy_len = 0;
+  while(i < len) {
+    if(double_iac) {
+      text[text_len++] = NVT_IAC;
+      double_iac = FALSE;
+      i++;
+    } else if(NVT_IAC == data[i]) {
+      text[text_len++] = NVT_IAC;
+      double_iac = TRUE;
+    } else {
+      text[text_len++] = data[i++];
+    }
+    if(text_len == sizeof(text)) {
+      send_text(text, text_len);
+      text_len = 0;
+    }
+  }
+  if(text_len)
+    send_text(text, text_len);
+}
+
+/*
+ * line_write() now: slices of the caller's data, handed to writev.
+ */
+int slice_escape(unsigned char *data, int len, int is_checked) {
+  struct iovec iov[SLICES];
+  int used;
+  int cnt;
+  int pos = 0;
+  int out = 0;
+  int i;
+
+  while(pos < len) {
+    cnt = nvt_escape_iac(data + pos, len - pos, iov, SLICES, &used);
+    for(i = 0; i < cnt; i++) {
+      if(is_checked
+         && (out + (int)iov[i].iov_len > copy_len
+             || 0 != memcmp(copy + out, iov[i].iov_base, iov[i].iov_len)))
+        return -1;
+      out += iov[i].iov_len;
+    }
+    pos += used;
+  }
+  sink += out;
+  return (is_checked && out != copy_len ? -1 : 0);
+}
+
+double time_scan(scan_fn scan) {
+  double start = now();
+  long long done;
+  int pos;
+
+  for(done = 0; done < BENCH_BYTES; done += BUF_LEN) {
+    for(pos = 0; pos < BUF_LEN; pos++) {
+      pos += scan(data + pos, BUF_LEN - pos, NVT_IAC);
+      sink += pos;
+    }
+  }
+  return BENCH_BYTES / (now() - start) / 1e9;
+}
+
+double time_copy(void) {
+  double start = now();
+  long long done;
+
+  for(done = 0; done < BENCH_BYTES; done += BUF_LEN) {
+    copy_escape(data, BUF_LEN);
+    sink += copy_len;
+  }
+  return BENCH_BYTES / (now() - start) / 1e9;
+}
+
+double time_slices(void) {
+  double start = now();
+  long long done;
+
+  for(done = 0; done < BENCH_BYTES; done += BUF_LEN) {
+    slice_escape(data, BUF_LEN, 0);
+  }
+  return BENCH_BYTES / (now() - start) / 1e9;
+}
+
+void run(char *what) {
+  double base;
+  double rate;
+
+  base = time_scan(scan_scalar);
+  printf("iac_bench: %s, scan scalar  %6.2f GB/s\n", what, base);
+#ifdef HAVE_SSE2_SCAN
+  rate = time_scan(scan_sse2);
+  printf("iac_bench: %s, scan sse2    %6.2f GB/s, %.1fx\n", what, rate, rate / base);
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    rate = time_scan(scan_avx2);
+    printf("iac_bench: %s, scan avx2    %6.2f GB/s, %.1fx\n", what, rate, rate / base);
+  }
+#endif
+  base = time_copy();
+  printf("iac_bench: %s, escape copy  %6.2f GB/s\n", what, base);
+  rate = time_slices();
+  printf("iac_bench: %s, escape slice %6.2f GB/s, %.1fx\n", what, rate, rate / base);
+}
+
+int main(int argc, char *argv[]) {
+  int i;
+
+  nvt_init();
+  for(i = 0; i < BUF_LEN; i++) {
+    data[i] = (i * 131 + i / 256) % 255;    // anything but an IAC
+  }
+  run("no IAC  ");
+
+  for(i = IAC_EVERY - 1; i < BUF_LEN; i += IAC_EVERY) {
+    data[i] = NVT_IAC;
+  }
+  copy_escape(data, BUF_LEN);
+  if(0 != slice_escape(data, BUF_LEN, 1)) {
+    fprintf(stderr, "iac_bench: the slices do not match the old copy\n");
+    return 1;
+  }
+  run("IAC/4KB ");
+  return 0;
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/dce.h"
+#include "../src/parity.h"
+
+/* Times the parity kernels against the byte loop dce_write() used
+ * before, apply_parity() on each byte, and par_strip() against the old
+ * loop that masked each byte read.  Every kernel is first checked
+ * against apply_parity() for its parity.
+ */
+
+#define BUF_LEN 65536
+#define BENCH_BYTES (1LL << 28)
+
+void par_even(unsigned char *out, unsigned char *in, int len);
+void par_odd(unsigned char *out, unsigned char *in, int len);
+void par_mark(unsigned char *out, unsigned char *in, int len);
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#  define HAVE_SSE2_PARITY 1
+void par_even_ssse3(unsigned char *out, unsigned char *in, int len);
+void par_odd_ssse3(unsigned char *out, unsigned char *in, int len);
+void par_mark_sse2(unsigned char *out, unsigned char *in, int len);
+#endif
+
+typedef struct kernel {
+  char *name;
+  int parity;
+  par_func func;
+} kernel;
+
+unsigned char in[BUF_LEN];
+unsigned char out[BUF_LEN];
+unsigned char want[BUF_LEN];
+int byte_parity;
+
+void par_bytes(unsigned char *out, unsigned char *in, int len) {
+  int i;
+
+  for(i = 0; i < len; i++) {
+    out[i] = apply_parity(in[i], byte_parity);
+  }
+}
+
+void strip_bytes(unsigned char *out, unsigned char *in, int len) {
+  int i;
+
+  for(i = 0; i < len; i++) {
+    out[i] &= 0x7f;
+  }
+}
+
+void strip_kernel(unsigned char *out, unsigned char *in, int len) {
+  par_strip(out, len);
+}
+
+double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Returns GB/s.
+ */
+double time_kernel(par_func func) {
+  double start = now();
+  long long done;
+
+  for(done = 0; done < BENCH_BYTES; done += BUF_LEN) {
+    func(out, in, BUF_LEN);
+    // keep the compiler from dropping the work
+    __asm__ __volatile__("" : : "r"(out) : "memory");
+  }
+  return BENCH_BYTES / (now() - start) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  kernel kernels[] = {
+    { "odd table", PARITY_ODD, par_odd },
+    { "even table", PARITY_EVEN, par_even },
+    { "mark table", PARITY_MARK, par_mark },
+#ifdef HAVE_SSE2_PARITY
+    { "mark sse2", PARITY_MARK, par_mark_sse2 },
+    { "odd ssse3", PARITY_ODD, par_odd_ssse3 },
+    { "even ssse3", PARITY_EVEN, par_even_ssse3 },
+#endif
+    { NULL, 0, NULL }
+  };
+  char *names[] = { "space bytes", "odd bytes", "even bytes", "mark bytes" };
+  double base;
+  double rate;
+  kernel *k;
+  int p;
+  int i;
+
+  for(i = 0; i < BUF_LEN; i++) {
+    in[i] = (i * 7 + i / 256) & 0x7f;
+  }
+#ifdef HAVE_SSE2_PARITY
+  __builtin_cpu_init();
+  if(!__builtin_cpu_supports("ssse3"))
+    kernels[4].name = NULL;    // leave out the ssse3 kernels
+#endif
+
+  for(k = kernels; k->name != NULL; k++) {
+    byte_parity = k->parity;
+    par_bytes(want, in, BUF_LEN);
+    k->func(out, in, BUF_LEN);
+    if(0 != memcmp(want, out, BUF_LEN)) {
+      fprintf(stderr, "parity_bench: %s does not match apply_parity\n", k->name);
+      return 1;
+    }
+  }
+
+  for(p = PARITY_ODD; p <= PARITY_MARK; p++) {
+    byte_parity = p;
+    base = time_kernel(par_bytes);
+    printf("parity_bench: %-12s %6.2f GB/s\n", names[p], base);
+    for(k = kernels; k->name != NULL; k++) {
+      if(k->parity != p)
+        continue;
+      rate = time_kernel(k->func);
+      printf("parity_bench: %-12s %6.2f GB/s, %.1fx\n", k->name, rate, rate / base);
+    }
+  }
+  base = time_kernel(strip_bytes);
+  printf("parity_bench: %-12s %6.2f GB/s\n", "strip bytes", base);
+  rate = time_kernel(strip_kernel);
+  printf("parity_bench: %-12s %6.2f GB/s, %.1fx\n", "par_strip", rate, rate / base);
+  return 0;
+}
@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../test/harness.h"
+
+/* Measures data mode reads from the DTE.  An ip232 modem dials a port
+ * this program listens on, and the DTE sends as fast as tcpser takes
+ * it.  One run is timed with logging off.  A second, smaller run logs
+ * at debug level, where tcpser reports on hang up how many reads the
+ * call's serial data took.
+ */
+
+#define BENCH_BYTES (64LL * 1024 * 1024)
+#define COUNT_BYTES (8LL * 1024 * 1024)
+#define CHUNK 65536
+
+char chunk[CHUNK];
+char buf[CHUNK];
+
+/*
+ * Sends len bytes into from, and reads them back out of to.  Returns
+ * the ms it took, or -1.
+ */
+long long pump(int from, int to, long long len) {
+  struct pollfd pfd[2];
+  long long start = th_now();
+  long long sent = 0;
+  long long got = 0;
+  int n;
+
+  fcntl(from, F_SETFL, fcntl(from, F_GETFL) | O_NONBLOCK);
+  fcntl(to, F_SETFL, fcntl(to, F_GETFL) | O_NONBLOCK);
+  while(got < len) {
+    pfd[0].fd = (sent < len ? from : -1);
+    pfd[0].events = POLLOUT;
+    pfd[1].fd = to;
+    pfd[1].events = POLLIN;
+    if(0 >= poll(pfd, 2, TH_WAIT))
+      return -1;
+    if(pfd[0].revents & POLLOUT) {
+      n = write(from, chunk, (len - sent < CHUNK ? len - sent : CHUNK));
+      if(n > 0)
+        sent += n;
+    }
+    if(pfd[1].revents) {
+      n = read(to, buf, CHUNK);
+      if(n == 0 || (n < 0 && errno != EAGAIN))
+        return -1;
+      if(n > 0)
+        got += n;
+    }
+  }
+  return th_now() - start;
+}
+
+/*
+ * Runs one call that carries len bytes from the DTE.  Returns the ms it
+ * took, and sets *reads from the log if there is one.
+ */
+long long run_call(char *tcpser, long long len, char *log, long *reads) {
+  char port[16];
+  char vport[16];
+  char dial[64];
+  char line[512];
+  char *argv[] = { tcpser, "-p", port, "-v", vport, "-l", "5", "-L", log, NULL };
+  unsigned long bytes;
+  unsigned long count;
+  long long ms = -1;
+  char *p;
+  FILE *f;
+  pid_t pid;
+  int sink;
+  int dte;
+  int far = -1;
+
+  snprintf(port, sizeof(port), "%d", TH_PORT + 1);
+  snprintf(vport, sizeof(vport), "%d", TH_PORT + 2);
+  snprintf(dial, sizeof(dial), "ATDT127.0.0.1:%d\r", TH_PORT);
+  if(log == NULL)
+    argv[5] = NULL;
+  sink = th_listen(TH_PORT);
+  if(sink < 0)
+    return -1;
+  pid = th_start(argv);
+  dte = th_dte_open(TH_PORT + 2);
+  if(dte > -1
+     && 0 < th_send(dte, dial, strlen(dial))
+     && -1 < (far = th_accept(sink, TH_WAIT))
+     && 0 == th_expect(dte, "CONNECT", TH_WAIT)
+     && 0 == th_expect(dte, "\n", TH_WAIT)) {
+    ms = pump(dte, far, len);
+    close(far);
+    far = -1;
+    th_expect(dte, "NO CARRIER", TH_WAIT);
+  }
+  if(far > -1)
+    close(far);
+  if(dte > -1)
+    close(dte);
+  close(sink);
+  th_stop(pid);
+
+  *reads = 0;
+  f = (log != NULL ? fopen(log, "r") : NULL);
+  while(f != NULL && fgets(line, sizeof(line), f) != NULL) {
+    p = strstr(line, "Serial data: ");
+    if(p != NULL && 2 == sscanf(p, "Serial data: %lu bytes in %lu reads", &bytes, &count))
+      *reads = count;
+  }
+  if(f != NULL) {
+    fclose(f);
+    unlink(log);
+  }
+  return ms;
+}
+
+int main(int argc, char *argv[]) {
+  char log[64];
+  long long ms;
+  long reads;
+  int i;
+
+  if(argc != 2) {
+    fprintf(stderr, "Usage: %s path/to/tcpser\n", argv[0]);
+    return 2;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  for(i = 0; i < CHUNK; i++) {
+    chunk[i] = 'a' + i % 26;
+  }
+
+  ms = run_call(argv[1], BENCH_BYTES, NULL, &reads);
+  if(ms < 0) {
+    fprintf(stderr, "read_bench: the timed call failed\n");
+    return 1;
+  }
+  printf("read_bench: %lld MB from the DTE in %lld ms, %.1f MB/s\n",
+         BENCH_BYTES >> 20, ms, (double)BENCH_BYTES / 1048576 * 1000 / (ms ? ms : 1));
+
+  snprintf(log, sizeof(log), "/tmp/tcpser_read_%d.log", (int)getpid());
+  ms = run_call(argv[1], COUNT_BYTES, log, &reads);
+  if(ms < 0 || reads == 0) {
+    fprintf(stderr, "read_bench: the counted call failed\n");
+    return 1;
+  }
+  printf("read_bench: %lld MB from the DTE in %ld reads, %lld bytes per read\n",
+         COUNT_BYTES >> 20, reads, COUNT_BYTES / reads);
+  return 0;
+}
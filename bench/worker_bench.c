@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../test/harness.h"
+
+/* Measures how throughput grows with worker threads.  For each -W from
+ * 1 up to the CPU count, doubling, tcpser is started with MODEMS ip232
+ * modems.  Each dials a port this program listens on, and every DTE then
+ * sends at once, with the sending spread over this program's own
+ * threads.
+ */
+
+#define MODEMS 64
+#define BENCH_BYTES (8LL * 1024 * 1024)   // per modem
+#define CHUNK 16384
+
+typedef struct pair {
+  int dte;
+  int far;
+  long long sent;
+  long long got;
+} pair;
+
+typedef struct slice {
+  pair *pairs;
+  int count;
+  int rc;
+} slice;
+
+char chunk[CHUNK];
+
+/*
+ * Sends BENCH_BYTES from each DTE in the slice, and reads it at the far
+ * end.
+ */
+void *pump_slice(void *arg) {
+  slice *s = (slice *)arg;
+  struct pollfd *pfd = calloc(s->count * 2, sizeof(struct pollfd));
+  char buf[CHUNK];
+  pair *p;
+  int left = s->count;
+  int i;
+  int n;
+
+  s->rc = -1;
+  if(pfd == NULL)
+    return NULL;
+  while(left > 0) {
+    for(i = 0; i < s->count; i++) {
+      p = &s->pairs[i];
+      pfd[i * 2].fd = (p->sent < BENCH_BYTES ? p->dte : -1);
+      pfd[i * 2].events = POLLOUT;
+      pfd[i * 2 + 1].fd = (p->got < BENCH_BYTES ? p->far : -1);
+      pfd[i * 2 + 1].events = POLLIN;
+    }
+    if(0 >= poll(pfd, s->count * 2, TH_WAIT)) {
+      free(pfd);
+      return NULL;
+    }
+    for(i = 0; i < s->count; i++) {
+      p = &s->pairs[i];
+      if(pfd[i * 2].revents & POLLOUT) {
+        n = write(p->dte, chunk, (BENCH_BYTES - p->sent < CHUNK ? BENCH_BYTES - p->sent : CHUNK));
+        if(n > 0)
+          p->sent += n;
+      }
+      if(pfd[i * 2 + 1].revents) {
+        n = read(p->far, buf, CHUNK);
+        if(n == 0 || (n < 0 && errno != EAGAIN)) {
+          free(pfd);
+          return NULL;
+        }
+        if(n > 0) {
+          p->got += n;
+          if(p->got >= BENCH_BYTES)
+            left--;
+        }
+      }
+    }
+  }
+  free(pfd);
+  s->rc = 0;
+  return NULL;
+}
+
+/*
+ * Returns the MB/s all the modems moved together with the given number
+ * of workers, or -1.
+ */
+double run_workers(char *tcpser, int workers, int threads) {
+  char *argv[MODEMS * 2 + 6];
+  char ports[MODEMS + 1][16];
+  char wcount[16];
+  char dial[64];
+  pair pairs[MODEMS];
+  slice slices[MODEMS];
+  pthread_t tids[MODEMS];
+  long long start;
+  long long ms = -1;
+  pid_t pid;
+  int sink;
+  int rc = 0;
+  int n = 0;
+  int i;
+
+  snprintf(wcount, sizeof(wcount), "%d", workers);
+  snprintf(ports[MODEMS], 16, "%d", TH_PORT + 1);
+  argv[n++] = tcpser;
+  argv[n++] = "-W";
+  argv[n++] = wcount;
+  argv[n++] = "-p";
+  argv[n++] = ports[MODEMS];
+  for(i = 0; i < MODEMS; i++) {
+    snprintf(ports[i], 16, "%d", TH_PORT + 2 + i);
+    argv[n++] = "-v";
+    argv[n++] = ports[i];
+  }
+  argv[n] = NULL;
+  snprintf(dial, sizeof(dial), "ATDT127.0.0.1:%d\r", TH_PORT);
+
+  sink = th_listen(TH_PORT);
+  if(sink < 0)
+    return -1;
+  pid = th_start(argv);
+  for(i = 0; i < MODEMS; i++) {
+    pairs[i].dte = -1;
+    pairs[i].far = -1;
+    pairs[i].sent = 0;
+    pairs[i].got = 0;
+  }
+  for(i = 0; rc == 0 && i < MODEMS; i++) {
+    pairs[i].dte = th_dte_open(TH_PORT + 2 + i);
+    if(pairs[i].dte < 0
+       || 0 > th_send(pairs[i].dte, dial, strlen(dial))
+       || 0 > (pairs[i].far = th_accept(sink, TH_WAIT))
+       || 0 != th_expect(pairs[i].dte, "CONNECT", TH_WAIT)
+       || 0 != th_expect(pairs[i].dte, "\n", TH_WAIT)) {
+      fprintf(stderr, "worker_bench: modem %d could not place its call\n", i);
+      rc = -1;
+    } else {
+      fcntl(pairs[i].dte, F_SETFL, fcntl(pairs[i].dte, F_GETFL) | O_NONBLOCK);
+      fcntl(pairs[i].far, F_SETFL, fcntl(pairs[i].far, F_GETFL) | O_NONBLOCK);
+    }
+  }
+
+  if(rc == 0) {
+    start = th_now();
+    for(i = 0; i < threads; i++) {
+      slices[i].pairs = pairs + MODEMS * i / threads;
+      slices[i].count = MODEMS * (i + 1) / threads - MODEMS * i / threads;
+      pthread_create(&tids[i], NULL, pump_slice, &slices[i]);
+    }
+    for(i = 0; i < threads; i++) {
+      pthread_join(tids[i], NULL);
+      if(slices[i].rc != 0)
+        rc = -1;
+    }
+    ms = th_now() - start;
+  }
+
+  for(i = 0; i < MODEMS; i++) {
+    if(pairs[i].far > -1)
+      close(pairs[i].far);
+    if(pairs[i].dte > -1)
+      close(pairs[i].dte);
+  }
+  close(sink);
+  th_stop(pid);
+  if(rc != 0)
+    return -1;
+  return (double)BENCH_BYTES * MODEMS / 1048576 * 1000 / (ms ? ms : 1);
+}
+
+int main(int argc, char *argv[]) {
+  int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int most;
+  int workers;
+  double rate;
+  double base = 0;
+  int i;
+
+  if(argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s path/to/tcpser [most workers]\n", argv[0]);
+    return 2;
+  }
+  if(cpus < 1)
+    cpus = 1;
+  most = (argc == 3 ? atoi(argv[2]) : cpus);
+  signal(SIGPIPE, SIG_IGN);
+  th_raise_fd_limit();
+  for(i = 0; i < CHUNK; i++) {
+    chunk[i] = 'a' + i % 26;
+  }
+
+  printf("worker_bench: %d modems, %lld MB each, %d CPUs\n", MODEMS, BENCH_BYTES >> 20, cpus);
+  for(workers = 1; workers <= most; workers *= 2) {
+    rate = run_workers(argv[1], workers, (cpus < MODEMS ? cpus : MODEMS));
+    if(rate < 0)
+      return 1;
+    if(workers == 1)
+      base = rate;
+    printf("worker_bench: -W %d, %.1f MB/s, %.2fx\n", workers, rate, rate / base);
+    // the next run reuses the ports
+    usleep(500000);
+  }
+  return 0;
+}
@@ -0,0 +1,155 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "banner.h"
+
+banner *bnr_list = NULL;    // only grows before bnr_start
+evt_timer bnr_timer;
+// taken to find a copy and count who is sending it, and to swap copies
+pthread_mutex_t bnr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void bnr_timer_handler(evt_loop *loop, void *arg, int events);
+
+/*
+ * Notes a file to keep in memory.  Names given more than once, as they
+ * are when an option carries over to the next modem, are kept once.
+ */
+int bnr_add(char *name) {
+  banner *b;
+
+  if(name == NULL || name[0] == 0)
+    return 0;
+  for(b = bnr_list; b != NULL; b = b->next) {
+    if(0 == strcmp(b->name, name))
+      return 0;
+  }
+  b = calloc(1, sizeof(banner));
+  if(b == NULL)
+    return -1;
+  b->name = name;
+  b->mtime = -1;
+  b->next = bnr_list;
+  bnr_list = b;
+  return 0;
+}
+
+bnr_text *load_text(char *name) {
+  struct stat st;
+  bnr_text *t;
+  int fd;
+  int rc;
+  int len = 0;
+
+  fd = open(name, O_RDONLY);
+  if(fd < 0)
+    return NULL;
+  t = NULL;
+  if(0 == fstat(fd, &st))
+    t = malloc(sizeof(bnr_text) + st.st_size);
+  if(t == NULL) {
+    close(fd);
+    return NULL;
+  }
+  // the file may be cut short while we read it, take what is there
+  while(len < st.st_size && (rc = read(fd, t->data + len, st.st_size - len)) > 0) {
+    len += rc;
+  }
+  close(fd);
+  t->refs = 1;
+  t->len = len;
+  return t;
+}
+
+void bnr_put(bnr_text *t) {
+  int is_done;
+
+  if(t == NULL)
+    return;
+  pthread_mutex_lock(&bnr_lock);
+  is_done = (--t->refs == 0);
+  pthread_mutex_unlock(&bnr_lock);
+  if(is_done)
+    free(t);
+}
+
+/*
+ * Returns the text of name, which the caller gives back with bnr_put,
+ * or NULL if there is none.  Never looks at the file itself.
+ */
+bnr_text *bnr_get(char *name) {
+  banner *b;
+  bnr_text *t = NULL;
+
+  if(name == NULL || name[0] == 0)
+    return NULL;
+  pthread_mutex_lock(&bnr_lock);
+  for(b = bnr_list; b != NULL; b = b->next) {
+    if(0 == strcmp(b->name, name)) {
+      t = b->text;
+      if(t != NULL)
+        t->refs++;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&bnr_lock);
+  return t;
+}
+
+void set_text(banner *b, bnr_text *t) {
+  bnr_text *old;
+
+  pthread_mutex_lock(&bnr_lock);
+  old = b->text;
+  b->text = t;
+  pthread_mutex_unlock(&bnr_lock);
+  bnr_put(old);
+}
+
+/*
+ * Reads the files that are new, changed, or gone since last time.
+ */
+void check_banners(void) {
+  struct stat st;
+  bnr_text *t;
+  banner *b;
+
+  for(b = bnr_list; b != NULL; b = b->next) {
+    if(0 != stat(b->name, &st)) {
+      if(b->mtime != 0) {
+        ELOG(LOG_WARN, "Could not read banner %s", b->name);
+        b->mtime = 0;
+        set_text(b, NULL);
+      }
+    } else if(st.st_mtime != b->mtime || st.st_size != b->size || st.st_ino != b->ino) {
+      b->mtime = st.st_mtime;
+      b->size = st.st_size;
+      b->ino = st.st_ino;
+      t = load_text(b->name);
+      if(t == NULL) {
+        ELOG(LOG_WARN, "Could not read banner %s", b->name);
+      } else {
+        LOG(LOG_INFO, "Loaded banner %s, %d bytes", b->name, t->len);
+      }
+      set_text(b, t);
+    }
+  }
+}
+
+void bnr_timer_handler(evt_loop *loop, void *arg, int events) {
+  check_banners();
+  evt_timer_set(loop, &bnr_timer, BNR_CHECK_INTERVAL, bnr_timer_handler, NULL);
+}
+
+/*
+ * Reads every banner, and has loop look for changes from then on.
+ */
+int bnr_start(evt_loop *loop) {
+  check_banners();
+  evt_init_timer(&bnr_timer);
+  return evt_timer_set(loop, &bnr_timer, BNR_CHECK_INTERVAL, bnr_timer_handler, NULL);
+}
@@ -0,0 +1,36 @@
+#ifndef BANNER_H
+#define BANNER_H 1
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "evt.h"
+
+#define BNR_CHECK_INTERVAL 2000   // ms between looks for changed banner files
+
+/* The files sent on connect, answer, no answer and busy are read once
+ * and kept in memory.  The main loop looks at them now and then, and
+ * reads any that changed into a new copy, so calls never wait on the
+ * file system.  A copy stays while anyone is still sending it.
+ */
+typedef struct bnr_text {
+  int refs;
+  int len;
+  unsigned char data[];
+} bnr_text;
+
+typedef struct banner {
+  char *name;
+  time_t mtime;
+  off_t size;
+  ino_t ino;
+  bnr_text *text;       // NULL if the file could not be read
+  struct banner *next;
+} banner;
+
+int bnr_add(char *name);
+int bnr_start(evt_loop *loop);
+bnr_text *bnr_get(char *name);
+void bnr_put(bnr_text *t);
+
+#endif
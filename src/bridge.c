@@ -5,7 +5,6 @@
 #include <stdlib.h>       // for exit...
 #include <sys/param.h>
 #include <sys/time.h>
-#include <pthread.h>
 
 #include "util.h"
 #include "debug.h"
@@ -13,15 +12,40 @@
 #include "modem_core.h"
 #include "ip.h"
 #include "getcmd.h"
+#include "ip232.h"
+#include "pool.h"
 
 #include "bridge.h"
 
 const char MDM_NO_ANSWER[] = "NO ANSWER\n";
 
-int accept_connection(modem_config *cfg) {
+void ip_handler(evt_loop *loop, void *arg, int events);
+void dial_handler(evt_loop *loop, void *arg, int events);
+void race_handler(evt_loop *loop, void *arg, int events);
+void target_handler(evt_loop *loop, void *arg, int events);
+void serial_handler(evt_loop *loop, void *arg, int events);
+void timer_handler(evt_loop *loop, void *arg, int events);
+void hangup_handler(evt_loop *loop, void *arg, int events);
+void ip232_timer_handler(evt_loop *loop, void *arg, int events);
+void check_control_lines(modem_config *cfg);
+int is_call_up(modem_config *cfg);
+
+int accept_connection(modem_config *cfg, int fd) {
+  int rc;
+
   LOG_ENTER();
 
-  if(-1 != line_accept(&cfg->line_data)) {
+  // the modem may have gone off hook since the call was handed over
+  if(cfg->is_off_hook == TRUE
+     || cfg->line_data.is_connected == TRUE
+     || cfg->is_hanging_up == TRUE) {
+    LOG(LOG_INFO, "Modem is busy now, hanging up on the call");
+    ip_disconnect(fd);
+    LOG_EXIT();
+    return -1;
+  }
+  rc = line_accept(&cfg->line_data, fd);
+  if(-1 != rc) {
     if(cfg->direct_conn == TRUE) {
       cfg->conn_type = MDM_CONN_INCOMING;
       mdm_off_hook(cfg);
@@ -30,20 +54,22 @@ int accept_connection(modem_config *cfg) {
       cfg->rings = 0;
       mdm_send_ring(cfg);
     }
-    // tell parent I got it.
-    LOG(LOG_DEBUG, "Informing parent task that I am busy");
-    writePipe(cfg->mp[0][1], MSG_BUSY);
   }
   LOG_EXIT();
-  return 0;
+  return rc;
 }
 
+/*
+ * Telnet commands are taken out of data in place, so the caller's buffer
+ * is overwritten.  Returns how much of data was used, anything after
+ * that is the start of a command still arriving.
+ */
 int parse_ip_data(modem_config *cfg, unsigned char *data, int len) {
   // I'm going to cheat and assume it comes in chunks.
   int i = 0;
   unsigned char ch;
-  unsigned char text[1025];
   int text_len = 0;
+  int n;
 
   if(cfg->line_data.is_data_received == FALSE) {
     cfg->line_data.is_data_received = TRUE;
@@ -59,7 +85,7 @@ int parse_ip_data(modem_config *cfg, unsigned char *data, int len) {
        * host is echoing as well...
        * - gwb
        */
-      send_nvt_command(cfg->line_data.fd, &cfg->line_data.nvt_data, NVT_WILL, NVT_OPT_ECHO);
+      send_nvt_command(&cfg->line_data, &cfg->line_data.nvt_data, NVT_WILL, NVT_OPT_ECHO);
     }
   }
 
@@ -69,23 +95,23 @@ int parse_ip_data(modem_config *cfg, unsigned char *data, int len) {
     if(cfg->is_binary_negotiated == FALSE) {
       if(dce_get_parity(&cfg->dce_data)) {
         // send explicit notice this connection is not 8 bit clean
-        send_nvt_command(cfg->line_data.fd,
+        send_nvt_command(&cfg->line_data,
                          &cfg->line_data.nvt_data,
                          NVT_WONT,
                          NVT_OPT_TRANSMIT_BINARY
                         );
-        send_nvt_command(cfg->line_data.fd,
+        send_nvt_command(&cfg->line_data,
                          &cfg->line_data.nvt_data,
                          NVT_DONT,
                          NVT_OPT_TRANSMIT_BINARY
                         );
       } else {
-        send_nvt_command(cfg->line_data.fd,
+        send_nvt_command(&cfg->line_data,
                          &cfg->line_data.nvt_data,
                          NVT_WILL,
                          NVT_OPT_TRANSMIT_BINARY
                         );
-        send_nvt_command(cfg->line_data.fd,
+        send_nvt_command(&cfg->line_data,
                          &cfg->line_data.nvt_data,
                          NVT_DO,
                          NVT_OPT_TRANSMIT_BINARY
@@ -94,9 +120,16 @@ int parse_ip_data(modem_config *cfg, unsigned char *data, int len) {
       cfg->is_binary_negotiated = TRUE;
     }
     while(i < len) {
-      ch = data[i];
-      if(NVT_IAC == ch) {
-        // what if we roll off the end?
+      n = nvt_scan(data + i, len - i, NVT_IAC);
+      if(n > 0) {
+        // plain text, only moved if a command came out ahead of it
+        if(text_len != i)
+          memmove(data + text_len, data + i, n);
+        text_len += n;
+        i += n;
+      } else if(!nvt_is_complete(data + i, len - i)) {
+        break;
+      } else {
         ch = data[i + 1];
         switch(ch) {
           case NVT_WILL:
@@ -106,7 +139,7 @@ int parse_ip_data(modem_config *cfg, unsigned char *data, int len) {
             /// again, overflow issues...
             LOG(LOG_INFO, "Parsing nvt command");
             parse_nvt_command(&cfg->dce_data,
-                              cfg->line_data.fd,
+                              &cfg->line_data,
                               &cfg->line_data.nvt_data,
                               ch,
                               data[i + 2]
@@ -116,7 +149,7 @@ int parse_ip_data(modem_config *cfg, unsigned char *data, int len) {
           case NVT_SB:      // sub negotiation
             // again, overflow...
             i += parse_nvt_subcommand(&cfg->dce_data, 
-                                      cfg->line_data.fd, 
+                                      &cfg->line_data, 
                                       &cfg->line_data.nvt_data, 
                                       data + i, 
                                       len - i
@@ -124,163 +157,664 @@ int parse_ip_data(modem_config *cfg, unsigned char *data, int len) {
             break;
           case NVT_IAC:
             if (cfg->line_data.nvt_data.binary_recv)
-              text[text_len++] = NVT_IAC;
+              data[text_len++] = NVT_IAC;
               // fall through to skip this sequence
           default:
             // ignore...
             i += 2;
         }
-      } else {
-        text[text_len++] = data[i++];
-      }
-      if(text_len == 1024) {
-        text[text_len] = 0;
-        // write to serial...
-        mdm_write(cfg, text, text_len);
-        text_len = 0;
       }
     }
     if(text_len) {
-      text[text_len] = 0;
       // write to serial...
-      mdm_write(cfg, text, text_len);
+      mdm_write(cfg, data, text_len);
     }
+    return i;
   } else {
     mdm_write(cfg, data, len);
   }
-  return 0;
+  return len;
 }
 
-void *ip_thread(void *arg) {
-  modem_config* cfg = (modem_config *)arg;
+int get_high_water(modem_config *cfg) {
+  int len = cfg->s[S_REG_HIGH_WATER] * 1024;
 
-  int action_pending = FALSE;
-  fd_set readfs;
-  int max_fd;
-  int res = 0;
-  unsigned char buf[256];
-  int rc;
+  // leave room for one more full read, even if it is escaped on the way
+  return (len > 0 && len <= RING_SIZE / 2 ? len : RING_SIZE / 2);
+}
 
+int get_low_water(modem_config *cfg) {
+  int len = cfg->s[S_REG_LOW_WATER] * 1024;
+  int high = get_high_water(cfg);
 
-  LOG_ENTER();
-  while(TRUE) {
-    FD_ZERO(&readfs);
-    FD_SET(cfg->cp[1][0], &readfs);
-    max_fd = cfg->cp[1][0];
-    if(action_pending == FALSE
-       && cfg->conn_type != MDM_CONN_NONE
-       && cfg->is_cmd_mode == FALSE
-       && cfg->line_data.fd > -1
-       && cfg->line_data.is_connected == TRUE
-      ) {
-      FD_SET(cfg->line_data.fd, &readfs); 
-      max_fd=MAX(max_fd, cfg->line_data.fd);
+  return (len >= 0 && len < high ? len : high / 2);
+}
+
+int is_backlogged(modem_config *cfg, int len, int was_backlogged) {
+  if(was_backlogged)
+    return (len > get_low_water(cfg));
+  return (len >= get_high_water(cfg));
+}
+
+/*
+ * How much one socket read may take and still fit in the serial queue,
+ * with 255 doubled for ip232.
+ */
+int get_dce_room(modem_config *cfg) {
+  int room = RING_SIZE - BRIDGE_RESERVE - ring_len(&cfg->dce_data.out) - cfg->dce_data.pipe.len;
+
+  if(cfg->dce_data.is_ip232)
+    room /= 2;
+  return MAX(room, 0);
+}
+
+/*
+ * How much one serial read may take and still fit in the socket queue,
+ * with IAC doubled for telnet.
+ */
+int get_line_room(modem_config *cfg) {
+  int room = RING_SIZE - BRIDGE_RESERVE - line_get_backlog(&cfg->line_data);
+
+  if(cfg->line_data.is_telnet)
+    room /= 2;
+  return MAX(room, 0);
+}
+
+/*
+ * Socket reads go to the serial port, and telnet commands among them are
+ * answered on the socket, sometimes at greater length.
+ */
+int get_line_read_len(modem_config *cfg) {
+  int len = get_dce_room(cfg);
+
+  if(cfg->line_data.is_telnet)
+    len = MIN(len, get_line_room(cfg) / 2);
+  return len;
+}
+
+/*
+ * Serial reads go to the socket, and commands among them are echoed.
+ */
+int get_serial_read_len(modem_config *cfg) {
+  int len = MIN(mdm_get_read_len(cfg), get_line_room(cfg));
+
+  if(cfg->is_cmd_mode == TRUE)
+    len = MIN(len, get_dce_room(cfg));
+  return len;
+}
+
+/*
+ * Once either output queue passes the high water mark, stop reading the
+ * side that feeds it until it drains to the low water mark.  The socket
+ * feels that as a closed TCP window, the DTE as CTS going low.
+ */
+void update_flow(modem_config *cfg) {
+  int backlogged;
+
+  backlogged = is_backlogged(cfg,
+                             ring_len(&cfg->dce_data.out) + cfg->dce_data.pipe.len,
+                             cfg->is_dce_backlogged
+                            );
+  if(backlogged != cfg->is_dce_backlogged) {
+    LOG(LOG_DEBUG, "Serial output %s", (backlogged ? "backlogged, pausing socket" : "drained"));
+    cfg->is_dce_backlogged = backlogged;
+  }
+  backlogged = is_backlogged(cfg,
+                             line_get_backlog(&cfg->line_data),
+                             cfg->is_line_backlogged
+                            );
+  if(backlogged != cfg->is_line_backlogged) {
+    LOG(LOG_DEBUG, "Socket output %s", (backlogged ? "backlogged, pausing serial port" : "drained"));
+    cfg->is_line_backlogged = backlogged;
+    mdm_set_control_lines(cfg);
+  }
+}
+
+/*
+ * The high water mark is at most half a queue, so reads stop long before
+ * a queue runs out of room, and are cut down to what is left so that the
+ * last one cannot overrun it either.
+ */
+int is_line_readable(modem_config *cfg) {
+  return (cfg->conn_type != MDM_CONN_NONE
+          && cfg->is_cmd_mode == FALSE
+          && cfg->line_data.is_connected == TRUE
+          && cfg->is_dce_backlogged == FALSE
+          && cfg->dce_data.pipe.len == 0
+          && get_line_read_len(cfg) > 0
+         );
+}
+
+int is_serial_readable(modem_config *cfg) {
+  // the DTE waits out the disconnect delay
+  if(cfg->is_hanging_up == TRUE)
+    return FALSE;
+  // commands are read whatever the socket is doing, so the DTE can still
+  // hang up, but not while the DTE is not taking their echo
+  if(cfg->is_cmd_mode == TRUE)
+    return (cfg->line_data.pipe.len == 0
+            && cfg->is_dce_backlogged == FALSE
+            && get_serial_read_len(cfg) > 0);
+  return (cfg->line_data.pipe.len == 0
+          && cfg->is_line_backlogged == FALSE
+          && get_serial_read_len(cfg) > 0);
+}
+
+/*
+ * A raw call can be spliced as long as nothing needs to see its bytes:
+ * no telnet or ip232 framing, no parity, and no tracing.  Reads only go
+ * through the pipe once it is empty, so it never holds more than one.
+ */
+int is_splice_ready(modem_config *cfg) {
+  return (cfg->use_splice
+          && is_call_up(cfg)
+          && cfg->is_cmd_mode == FALSE
+          && cfg->dce_data.is_ip232 == FALSE
+          && dce_get_parity(&cfg->dce_data) == 0
+          && cfg->line_data.is_telnet == FALSE
+          && log_get_trace_flags() == 0
+         );
+}
+
+int is_line_spliced(modem_config *cfg) {
+  // the first bytes still have to be checked for telnet, and an
+  // io_uring loop may already have read the next ones
+  return (is_splice_ready(cfg)
+          && cfg->line_data.is_data_received == TRUE
+          && !evt_is_async(&cfg->line_data.evt)
+          && ring_len(&cfg->dce_data.out) == 0
+         );
+}
+
+int is_serial_spliced(modem_config *cfg) {
+  // after a guard time pause the escape sequence has to be watched for
+  return (is_splice_ready(cfg)
+          && cfg->pre_break_delay == FALSE
+          && line_get_backlog(&cfg->line_data) == 0
+         );
+}
+
+void stop_splice(modem_config *cfg) {
+  ELOG(LOG_WARN, "Could not splice call data, copying it instead");
+  cfg->use_splice = FALSE;
+}
+
+void read_line(modem_config *cfg) {
+  unsigned char buf[4096];
+  nvt_vars *nvt = &cfg->line_data.nvt_data;
+  int is_spliced;
+  int want;
+  int res;
+  int used;
+
+  for(;;) {
+    update_flow(cfg);
+    if(!is_line_readable(cfg)) {
+      // leave it in the socket until we are back in data mode
+      cfg->is_line_pending = TRUE;
+      break;
     }
-    max_fd++;
-    rc = select(max_fd, &readfs, NULL, NULL, NULL);
-    if(rc == -1) {
-      ELOG(LOG_WARN, "Select returned error");
-      // handle error
+    // a telnet command split by the last read goes in front of this one
+    memcpy(buf, nvt->partial, nvt->partial_len);
+    want = MIN((int)sizeof(buf) - 1 - nvt->partial_len, get_line_read_len(cfg));
+    is_spliced = is_line_spliced(cfg);
+    if(is_spliced) {
+      want = get_high_water(cfg);
+      res = dce_splice(&cfg->dce_data, cfg->line_data.fd, want);
     } else {
-      // we got data
-      if (cfg->line_data.is_connected == TRUE && FD_ISSET(cfg->line_data.fd, &readfs)) {  // socket
-        LOG(LOG_DEBUG, "Data available on socket");
-        res = line_read(&cfg->line_data, buf, sizeof(buf));
-        //res = recv(cfg->line_data.fd, buf, sizeof(buf), 0);
-        if(0 >= res) {
-          LOG(LOG_INFO, "No socket data read, assume closed peer");
-          writePipe(cfg->cp[0][1], MSG_DISCONNECT);
-          action_pending = TRUE;
-        } else {
-          LOG(LOG_DEBUG, "Read %d bytes from socket", res);
-          buf[res] = 0;
-          parse_ip_data(cfg, buf, res);
-        }
+      res = line_read(&cfg->line_data, buf + nvt->partial_len, want);
+    }
+    if(res > 0) {
+      LOG(LOG_DEBUG, "Read %d bytes from socket", res);
+      cfg->traffic += res;
+      if(!is_spliced) {
+        used = parse_ip_data(cfg, buf, nvt->partial_len + res);
+        nvt->partial_len = nvt->partial_len + res - used;
+        memcpy(nvt->partial, buf + used, nvt->partial_len);
       }
-      if (FD_ISSET(cfg->cp[1][0], &readfs)) {  // pipe
+      if(res < want)
+        break;    // drained
+    } else if(res < 0 && is_spliced && errno == EINVAL) {
+      stop_splice(cfg);
+    } else if(res < 0 && errno == EINTR) {
+      continue;
+    } else if(res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      LOG(LOG_INFO, "No socket data read, assume closed peer");
+      if(cfg->direct_conn == TRUE) {
+        // what should we do here...
+        LOG(LOG_ERROR, "Direct Connection Link broken, disconnecting and awaiting new direct connection");
+        mdm_disconnect(cfg, TRUE);
+      } else {
+        mdm_disconnect(cfg, FALSE);
+      }
+      break;
+    }
+  }
+}
 
-        res = read(cfg->cp[1][0], buf, sizeof(buf) - 1);
-        LOG(LOG_DEBUG, "IP thread notified");
-        action_pending = FALSE;
+void read_serial(modem_config *cfg) {
+  int res;
+  int len;
+
+  do {
+    update_flow(cfg);
+    if(!is_serial_readable(cfg)) {
+      // leave it with the port until the socket catches up
+      cfg->is_dce_pending = TRUE;
+      break;
+    }
+    len = get_serial_read_len(cfg);
+    if(is_serial_spliced(cfg)) {
+      res = line_splice(&cfg->line_data, cfg->dce_data.fd, len);
+      cfg->dce_data.is_read_full = (res == len);
+      if(res > 0) {
+        LOG(LOG_DEBUG, "Spliced %d bytes from serial port", res);
+        cfg->dce_data.rx_bytes += res;
+        cfg->dce_data.rx_reads++;
+      } else if(res < 0 && errno == EINVAL) {
+        stop_splice(cfg);
+        cfg->dce_data.is_read_full = TRUE;    // read it the usual way
       }
+      continue;
+    }
+    res = mdm_read(cfg, cfg->data_buf, len);
+    if(cfg->dce_data.is_ip232) {
+      // DTR and link changes arrive with the data
+      check_control_lines(cfg);
+    }
+    if(res > 0) {
+      // a key pressed while dialing hangs up, see mdm_parse_data
+      mdm_parse_data(cfg, cfg->data_buf, res);
+    }
+    // a short read means the port has been drained
+  } while(cfg->dce_data.is_read_full && cfg->dce_data.is_connected);
+}
+
+void set_timer(modem_config *cfg) {
+  long msec = -1;
+
+  if(cfg->line_data.is_connecting == TRUE) {
+    if(cfg->s[S_REG_CARRIER_WAIT] != 0) {
+      LOG(LOG_ALL, "Setting timer for carrier wait");
+      msec = cfg->s[S_REG_CARRIER_WAIT] * 1000;
     }
+  } else if(cfg->is_cmd_mode == FALSE) {
+    if(cfg->pre_break_delay == FALSE || cfg->break_len == 3) {
+      LOG(LOG_ALL, "Setting timer for break delay");
+      msec = cfg->s[S_REG_GUARD_TIME] * 20;
+    } else if(cfg->pre_break_delay == TRUE && cfg->break_len > 0) {
+      LOG(LOG_ALL, "Setting timer for inter-break character delay");
+      msec = 1000;   // 1 second
+    } else if (cfg->s[S_REG_INACTIVITY_TIME] != 0) {
+      LOG(LOG_ALL, "Setting timer for inactivity delay");
+      msec = cfg->s[S_REG_INACTIVITY_TIME] * 10000;
+    }
+  } else if(cfg->is_cmd_mode == TRUE
+            && cfg->conn_type == MDM_CONN_NONE
+            && cfg->line_data.is_connected == TRUE
+           ) {
+    LOG(LOG_ALL, "Setting timer for rings");
+    msec = 4000;
+  }
+  if(msec < 0) {
+    evt_timer_clear(&cfg->timer);
+  } else {
+    evt_timer_set(cfg->loop, &cfg->timer, msec, timer_handler, cfg);
   }
-  LOG_EXIT();
 }
 
-void *ctrl_thread(void *arg) {
-  modem_config* cfg = (modem_config *)arg;
+/*
+ * Called after every event that touches a modem.  Flushes what the modem
+ * staged for the DTE, registers any descriptors opened while handling it,
+ * sends the connect/answer files, and restarts the modem timer if the DTE
+ * side saw activity.
+ */
+void bridge_update(modem_config *cfg, int is_dte_event) {
+  int state;
+  int fd;
+  int i;
+
+  // a call runs out of queues taken as it comes up, and never touches
+  // the heap
+  if(is_call_up(cfg)
+     && (0 > ring_alloc(&cfg->dce_data.out) || 0 > ring_alloc(&cfg->line_data.out))) {
+    LOG(LOG_ERROR, "Could not set aside buffers for the call, hanging up");
+    mdm_disconnect(cfg, FALSE);
+  }
+  update_flow(cfg);
+  if(cfg->is_dce_pending && is_serial_readable(cfg)) {
+    LOG(LOG_DEBUG, "Resuming serial port reads");
+    cfg->is_dce_pending = FALSE;
+    read_serial(cfg);
+  }
+  if(cfg->is_line_pending && is_line_readable(cfg)) {
+    LOG(LOG_DEBUG, "Resuming socket reads");
+    cfg->is_line_pending = FALSE;
+    read_line(cfg);
+  }
+  // everything the modem said during this pass goes in one write
+  dce_flush(&cfg->dce_data);
+
+  fd = (cfg->dce_data.is_connected ? cfg->dce_data.fd : -1);
+  if(fd > -1 && cfg->dce_data.evt.fd != fd) {
+    evt_add(cfg->loop, &cfg->dce_data.evt, fd,
+            EVT_READ | (ring_len(&cfg->dce_data.out) ? EVT_WRITE : 0),
+            serial_handler, cfg);
+  }
+  for(i = 0; cfg->line_data.is_connecting && i < LINE_ATTEMPTS; i++) {
+    fd = cfg->line_data.dial->dial_fd[i];
+    if(fd > -1 && cfg->line_data.dial->dial_evt[i].fd != fd) {
+      // a call being placed only has to say when it goes through
+      evt_add(cfg->loop, &cfg->line_data.dial->dial_evt[i], fd, EVT_WRITE, dial_handler, cfg);
+    }
+  }
+  if(cfg->line_data.is_connecting
+     && cfg->line_data.dial_timed != cfg->line_data.dial_count) {
+    // each new attempt gets its head start before the next one joins
+    cfg->line_data.dial_timed = cfg->line_data.dial_count;
+    if(line_is_racing(&cfg->line_data)) {
+      evt_timer_set(cfg->loop, &cfg->line_data.dial_timer, LINE_ATTEMPT_DELAY, race_handler, cfg);
+    } else {
+      evt_timer_clear(&cfg->line_data.dial_timer);
+    }
+  }
+  if(cfg->line_data.is_connecting
+     && cfg->line_data.target_timed != cfg->line_data.targets) {
+    // and each host its own time to answer
+    cfg->line_data.target_timed = cfg->line_data.targets;
+    evt_timer_set(cfg->loop, &cfg->line_data.target_timer,
+                  cfg->line_data.dial->call.timeout * 1000L, target_handler, cfg);
+  }
+  fd = (cfg->line_data.is_connected ? cfg->line_data.fd : -1);
+  if(fd > -1 && cfg->line_data.evt.fd != fd) {
+    cfg->is_line_pending = FALSE;
+    evt_add(cfg->loop, &cfg->line_data.evt, fd,
+            EVT_READ | (ring_len(&cfg->line_data.out) ? EVT_WRITE : 0),
+            ip_handler, cfg);
+  }
+
+  if(cfg->is_hanging_up == TRUE && cfg->hangup_timed != cfg->hangup_count) {
+    // each hang up waits the full delay
+    cfg->hangup_timed = cfg->hangup_count;
+    // a poll loop would keep waking for what the DTE typed meanwhile
+    evt_mod(&cfg->dce_data.evt, cfg->dce_data.evt.events & ~EVT_READ);
+    evt_timer_set(cfg->loop, &cfg->hangup_timer, cfg->disconnect_delay, hangup_handler, cfg);
+  }
+
+  if(cfg->last_conn_type != cfg->conn_type) {
+    LOG(LOG_ALL, "Connection status change, handling");
+    if(cfg->conn_type == MDM_CONN_OUTGOING) {
+      if(strlen(cfg->local_connect) > 0) {
+        line_write_file(&cfg->line_data, cfg->local_connect);
+      }
+      if(strlen(cfg->remote_connect) > 0) {
+        line_write_file(&cfg->line_data, cfg->remote_connect);
+      }
+    } else if(cfg->conn_type == MDM_CONN_INCOMING) {
+      if(strlen(cfg->local_answer) > 0) {
+        line_write_file(&cfg->line_data, cfg->local_answer);
+      }
+      if(strlen(cfg->remote_answer) > 0) {
+        line_write_file(&cfg->line_data, cfg->remote_answer);
+      }
+    }
+    cfg->last_conn_type = cfg->conn_type;
+    is_dte_event = TRUE;
+  }
+  if(cfg->last_cmd_mode != cfg->is_cmd_mode) {
+    cfg->last_cmd_mode = cfg->is_cmd_mode;
+    is_dte_event = TRUE;
+  }
+  if(is_dte_event) {
+    set_timer(cfg);
+  }
+  if(cfg->is_off_hook || cfg->line_data.is_connected || cfg->is_hanging_up) {
+    state = POOL_BUSY;
+  } else {
+    state = (cfg->s[0] != 0 ? POOL_AUTO : POOL_MANUAL);
+  }
+  if(state != cfg->pool_state)
+    pool_update(cfg, state);
+  if(!is_call_up(cfg)) {
+    // and an idle modem holds none
+    ring_release(&cfg->dce_data.out, &cfg->dce_data.evt);
+    ring_release(&cfg->line_data.out, &cfg->line_data.evt);
+  }
+  LOG(LOG_ALL, "CMD:%d, DCE:%d, LINE:%d, TYPE:%d, HOOK:%d", cfg->is_cmd_mode, cfg->dce_data.is_connected, cfg->line_data.is_connected, cfg->conn_type, cfg->is_off_hook);
+}
+
+int is_call_up(modem_config *cfg) {
+  return (cfg->conn_type != MDM_CONN_NONE && cfg->line_data.is_connected);
+}
+
+void ip_handler(evt_loop *loop, void *arg, int events) {
+  modem_config *cfg = (modem_config *)arg;
+
+  log_alloc_guard(is_call_up(cfg));
+  if(events & EVT_WRITE) {
+    line_drain(&cfg->line_data);
+  }
+  if(events & EVT_READ) {
+    LOG(LOG_DEBUG, "Data available on socket");
+    read_line(cfg);
+  }
+  bridge_update(cfg, FALSE);
+  log_alloc_guard(FALSE);
+}
+
+void dial_handler(evt_loop *loop, void *arg, int events) {
+  modem_config *cfg = (modem_config *)arg;
+
+  // bridge_update adds the winning socket back for the call itself
+  mdm_connect_done(cfg);
+  bridge_update(cfg, TRUE);
+}
+
+void race_handler(evt_loop *loop, void *arg, int events) {
+  modem_config *cfg = (modem_config *)arg;
+
+  if(0 > line_connect_next(&cfg->line_data)) {
+    mdm_disconnect(cfg, FALSE);
+  }
+  bridge_update(cfg, TRUE);
+}
+
+void target_handler(evt_loop *loop, void *arg, int events) {
+  modem_config *cfg = (modem_config *)arg;
+
+  if(0 > line_next_target(&cfg->line_data)) {
+    mdm_disconnect(cfg, FALSE);
+  }
+  bridge_update(cfg, TRUE);
+}
+
+void serial_handler(evt_loop *loop, void *arg, int events) {
+  modem_config *cfg = (modem_config *)arg;
+
+  log_alloc_guard(is_call_up(cfg));
+  if(events & EVT_WRITE) {
+    dce_drain(&cfg->dce_data);
+  }
+  if(events & EVT_READ) {
+    LOG(LOG_DEBUG, "Data available on serial port");
+    read_serial(cfg);
+  }
+  bridge_update(cfg, TRUE);
+  log_alloc_guard(FALSE);
+}
+
+void ip232_handler(evt_loop *loop, void *arg, int events) {
+  modem_config *cfg = (modem_config *)arg;
+
+  if(-1 == ip232_accept(&cfg->dce_data)) {
+    // connections are still waiting, and the listener may not say so again
+    evt_mod(&cfg->dce_data.listen_evt, 0);
+    evt_timer_set(loop, &cfg->dce_data.accept_timer, IP_ACCEPT_BACKOFF, ip232_timer_handler, cfg);
+  }
+  check_control_lines(cfg);
+  bridge_update(cfg, FALSE);
+}
+
+void ip232_timer_handler(evt_loop *loop, void *arg, int events) {
+  modem_config *cfg = (modem_config *)arg;
+
+  evt_mod(&cfg->dce_data.listen_evt, EVT_READ);
+  ip232_handler(loop, arg, EVT_READ);
+}
+
+void check_control_lines(modem_config *cfg) {
   int status;
-  int new_status;
 
-  LOG_ENTER();
   status = dce_get_control_lines(&cfg->dce_data);
-  while(status > -1) {
-    new_status = dce_check_control_lines(&cfg->dce_data);
-    if(new_status > -1 && status != new_status) {
-      LOG(LOG_DEBUG, "Control Line Change");
-      writePipe(cfg->wp[0][1], MSG_CONTROL_LINES);
-      if((new_status & DCE_CL_DTR) != (status & DCE_CL_DTR)) {
-        if((new_status & DCE_CL_DTR)) {
-          LOG(LOG_INFO, "DTR has gone high");
-        } else {
-          LOG(LOG_INFO, "DTR has gone low");
-        }
+  if(status < 0) {
+    // need to quit application, as status cannot be obtained.
+    LOG(LOG_FATAL, "Could not obtain control line status");
+    exit(-1);
+  }
+  if(status != cfg->ctrl_status) {
+    LOG(LOG_DEBUG, "Control Line Change");
+    if((status & DCE_CL_DTR) != (cfg->ctrl_status & DCE_CL_DTR)) {
+      if((status & DCE_CL_DTR)) {
+        LOG(LOG_INFO, "DTR has gone high");
+      } else {
+        LOG(LOG_INFO, "DTR has gone low");
       }
-      if((new_status & DCE_CL_LE) != (status & DCE_CL_LE)) {
-        if((new_status & DCE_CL_LE)) {
-          LOG(LOG_INFO, "Link has come up");
-        } else {
-          LOG(LOG_INFO, "Link has gone down");
-        }
+    }
+    if((status & DCE_CL_LE) != (cfg->ctrl_status & DCE_CL_LE)) {
+      if((status & DCE_CL_LE)) {
+        LOG(LOG_INFO, "Link has come up");
+      } else {
+        LOG(LOG_INFO, "Link has gone down");
       }
     }
-    status = new_status;
+    cfg->ctrl_status = status;
+    if(!(status & DCE_CL_DTR)) {
+      // DTR drop, close any active connection and put
+      // in cmd_mode
+      mdm_disconnect(cfg, FALSE);
+    }
   }
-  LOG_EXIT();
-  // need to quit application, as status cannot be obtained.
-  exit(-1);
 }
 
-void *bridge_task(void *arg) {
+void ctrl_handler(evt_loop *loop, void *arg, int events) {
+  modem_config *cfg = (modem_config *)arg;
+  unsigned char buf[16];
+
+  while(read(cfg->wp[0], buf, sizeof(buf)) == sizeof(buf))
+    ;
+  check_control_lines(cfg);
+  bridge_update(cfg, TRUE);
+}
+
+/*
+ * Real serial ports have no descriptor event for line changes, so a
+ * thread sleeps in the driver and pokes the modem's loop when one
+ * happens.  ip232 ports see theirs in the data stream instead.
+ */
+void *ctrl_thread(void *arg) {
   modem_config *cfg = (modem_config *)arg;
-  struct timeval timer;  
-  struct timeval *ptimer;  
-  int max_fd = 0;
-  fd_set readfs;
-  int res = 0;
-  unsigned char buf[256];
-  int rc = 0;
   int status;
 
-  int last_conn_type;
-  int last_cmd_mode = cfg->is_cmd_mode;
+  LOG_ENTER();
+  status = dce_get_control_lines(&cfg->dce_data);
+  while(status > -1) {
+    status = dce_check_control_lines(&cfg->dce_data, status);
+    // the loop reads the new state itself, and quits if it failed.
+    writePipe(cfg->wp[1], MSG_CONTROL_LINES);
+  }
+  LOG_EXIT();
+  return NULL;
+}
 
+void timer_handler(evt_loop *loop, void *arg, int events) {
+  modem_config *cfg = (modem_config *)arg;
+  char *name;
+
+  if(cfg->line_data.is_connecting == TRUE) {
+    LOG(LOG_INFO, "No carrier within %d seconds", cfg->s[S_REG_CARRIER_WAIT]);
+    mdm_disconnect(cfg, FALSE);
+  } else if(cfg->is_cmd_mode == TRUE
+            && cfg->conn_type == MDM_CONN_NONE
+            && cfg->line_data.is_connected == TRUE
+           ) {
+    if(cfg->s[0] == 0 && cfg->rings == 10) {
+      // not going to answer, send some data back to IP and disconnect.
+      name = pool_get_no_answer(cfg);
+      if(strlen(name) == 0) {
+        line_write(&cfg->line_data, (unsigned char *)MDM_NO_ANSWER, strlen(MDM_NO_ANSWER));
+      } else {
+        line_write_file(&cfg->line_data, name);
+      }
+      cfg->is_ringing = FALSE;
+      //mdm_disconnect(cfg, FALSE); // not sure need to do a disconnect here, no connection
+    } else
+      mdm_send_ring(cfg);
+  } else
+    mdm_handle_timeout(cfg);
+  bridge_update(cfg, TRUE);
+}
+
+void hangup_handler(evt_loop *loop, void *arg, int events) {
+  modem_config *cfg = (modem_config *)arg;
+
+  LOG(LOG_DEBUG, "Disconnect delay is over");
+  mdm_hangup_done(cfg);
+  evt_mod(&cfg->dce_data.evt, cfg->dce_data.evt.events | EVT_READ);
+  bridge_update(cfg, TRUE);
+}
 
+int bridge_init(evt_loop *loop, modem_config *cfg) {
   LOG_ENTER();
 
-  if(-1 == pipe(cfg->wp[0])) {
-    ELOG(LOG_FATAL, "Control line watch task incoming IPC pipe could not be created");
-    exit(-1);
-  }
-  if(-1 == pipe(cfg->cp[0])) {
-    ELOG(LOG_FATAL, "IP thread incoming IPC pipe could not be created");
+  cfg->loop = loop;
+  cfg->is_line_pending = FALSE;
+  cfg->is_dce_pending = FALSE;
+  evt_init_timer(&cfg->timer);
+  evt_init_timer(&cfg->hangup_timer);
+  evt_init_handler(&cfg->wp_evt);
+
+  // room in the loop for everything the modem will ever watch
+  if(0 > evt_reserve(loop, 3 + LINE_ATTEMPTS, 4)) {
+    LOG(LOG_FATAL, "Could not allocate buffers for %s", cfg->dce_data.tty);
     exit(-1);
   }
-  if(-1 == pipe(cfg->cp[1])) {
-    ELOG(LOG_FATAL, "IP thread outgoing IPC pipe could not be created");
-    exit(-1);
+
+  if(cfg->use_splice
+     && (0 > spl_init(&cfg->dce_data.pipe) || 0 > spl_init(&cfg->line_data.pipe))) {
+    LOG(LOG_WARN, "Splicing is not available for %s", cfg->dce_data.tty);
+    cfg->use_splice = FALSE;
   }
+
   if(dce_connect(&cfg->dce_data) < 0) {
     ELOG(LOG_FATAL, "Could not open serial port %s", cfg->dce_data.tty);
     exit(-1);
   }
-
-  spawn_thread((void *)ctrl_thread, (void *)cfg, "CTRL");
-  spawn_thread((void *)ip_thread, (void *)cfg, "IP");
+  if(cfg->dce_data.is_ip232) {
+    if(evt_add(loop, &cfg->dce_data.listen_evt, cfg->dce_data.sSocket, EVT_READ, ip232_handler, cfg) < 0) {
+      LOG(LOG_FATAL, "Could not watch ip232 port %s", cfg->dce_data.tty);
+      exit(-1);
+    }
+  } else {
+    if(-1 == pipe(cfg->wp)) {
+      ELOG(LOG_FATAL, "Control line watch task incoming IPC pipe could not be created");
+      exit(-1);
+    }
+    if(evt_add(loop, &cfg->wp_evt, cfg->wp[0], EVT_READ, ctrl_handler, cfg) < 0) {
+      LOG(LOG_FATAL, "Could not watch control lines on %s", cfg->dce_data.tty);
+      exit(-1);
+    }
+  }
 
   mdm_set_control_lines(cfg);
-  last_conn_type = cfg->conn_type;
+  cfg->ctrl_status = dce_get_control_lines(&cfg->dce_data);
+  if(!cfg->dce_data.is_ip232) {
+    spawn_thread((void *)ctrl_thread, (void *)cfg, "CTRL");
+  }
+  cfg->last_conn_type = cfg->conn_type;
+  cfg->last_cmd_mode = cfg->is_cmd_mode;
+  cfg->pool_state = POOL_BUSY;
   cfg->allow_transmit = FALSE;
   // call some functions behind the scenes
   if(cfg->cur_line_idx) {
@@ -290,8 +824,9 @@ void *bridge_task(void *arg) {
     if(strlen((char *)cfg->direct_conn_num) > 0 &&
        cfg->direct_conn_num[0] != ':') {
         // we have a direct number to connect to.
-      strncpy(cfg->dialno, cfg->direct_conn_num, sizeof(cfg->dialno));
-      if(0 != line_connect(&cfg->line_data, cfg->dialno)) {
+      snprintf(cfg->dialno, sizeof(cfg->dialno), "%s", cfg->direct_conn_num);
+      if(0 != line_connect(&cfg->line_data, cfg->dialno)
+         || 0 != line_connect_wait(&cfg->line_data)) {
         LOG(LOG_FATAL, "Cannot connect to Direct line address!");
         // probably should exit...
         exit(-1);
@@ -301,148 +836,7 @@ void *bridge_task(void *arg) {
     }
   }
   cfg->allow_transmit = TRUE;
-  for(;;) {
-    if(last_conn_type != cfg->conn_type) {
-      LOG(LOG_ALL, "Connection status change, handling");
-      writePipe(cfg->cp[1][1], MSG_NOTIFY);
-      if(cfg->conn_type == MDM_CONN_OUTGOING) {
-        if(strlen(cfg->local_connect) > 0) {
-          writeFile(cfg->local_connect, cfg->line_data.fd);
-        }
-        if(strlen(cfg->remote_connect) > 0) {
-          writeFile(cfg->remote_connect, cfg->line_data.fd);
-        }
-      } else if(cfg->conn_type == MDM_CONN_INCOMING) {
-        if(strlen(cfg->local_answer) > 0) {
-          writeFile(cfg->local_answer, cfg->line_data.fd);
-        }
-        if(strlen(cfg->remote_answer) > 0) {
-          writeFile(cfg->remote_answer, cfg->line_data.fd);
-        }
-      }
-      last_conn_type = cfg->conn_type;
-    }
-    if(last_cmd_mode != cfg->is_cmd_mode) {
-      writePipe(cfg->cp[1][1], MSG_NOTIFY);
-      last_cmd_mode = cfg->is_cmd_mode;
-    }
-    LOG(LOG_ALL, "Waiting for modem/control line/timer/socket activity");
-    LOG(LOG_ALL, "CMD:%d, DCE:%d, LINE:%d, TYPE:%d, HOOK:%d", cfg->is_cmd_mode, cfg->dce_data.is_connected, cfg->line_data.is_connected, cfg->conn_type, cfg->is_off_hook);
-    FD_ZERO(&readfs);
-    max_fd = cfg->mp[1][0];
-    FD_SET(cfg->mp[1][0], &readfs);
-    if(cfg->dce_data.is_connected) {
-      max_fd = MAX(max_fd, cfg->dce_data.fd);
-      FD_SET(cfg->dce_data.fd, &readfs);
-    }
-    max_fd = MAX(max_fd, cfg->wp[0][0]);
-    FD_SET(cfg->wp[0][0], &readfs);
-    max_fd = MAX(max_fd, cfg->cp[0][0]);
-    FD_SET(cfg->cp[0][0], &readfs);
-    ptimer = NULL;
-    if(cfg->is_cmd_mode == FALSE) {
-      if(cfg->pre_break_delay == FALSE || cfg->break_len == 3) {
-        LOG(LOG_ALL, "Setting timer for break delay");
-        long long usec;
-        usec = cfg->s[S_REG_GUARD_TIME] * 20000;
-        timer.tv_sec = usec / 1000000;
-        timer.tv_usec = usec % 1000000;
-        ptimer = &timer;
-      } else if(cfg->pre_break_delay == TRUE && cfg->break_len > 0) {
-        LOG(LOG_ALL, "Setting timer for inter-break character delay");
-        timer.tv_sec = 1;   // 1 second
-        timer.tv_usec = 0;
-        ptimer = &timer;
-      } else if (cfg->s[30] != 0) {
-        LOG(LOG_ALL, "Setting timer for inactivity delay");
-        timer.tv_sec = cfg->s[S_REG_INACTIVITY_TIME] * 10;
-        timer.tv_usec = 0;
-        ptimer = &timer;
-      }
-    } else if(cfg->is_cmd_mode == TRUE
-              && cfg->conn_type == MDM_CONN_NONE
-              && cfg->line_data.is_connected == TRUE
-             ) {
-        LOG(LOG_ALL, "Setting timer for rings");
-        timer.tv_sec = 4;
-        timer.tv_usec = 0;
-        ptimer = &timer;
-    }
-    max_fd++;
-    rc = select(max_fd, &readfs, NULL, NULL, ptimer);
-    if(rc == -1) {
-      ELOG(LOG_WARN, "Select returned error");
-      // handle error
-    } else if(rc == 0) {
-      // timer popped.
-      if(cfg->is_cmd_mode == TRUE
-         && cfg->conn_type == MDM_CONN_NONE
-         && cfg->line_data.is_connected == TRUE
-        ) {
-        if(cfg->s[0] == 0 && cfg->rings == 10) {
-          // not going to answer, send some data back to IP and disconnect.
-          if(strlen(cfg->no_answer) == 0) {
-            line_write(&cfg->line_data, (unsigned char *)MDM_NO_ANSWER, strlen(MDM_NO_ANSWER));
-          } else {
-            writeFile(cfg->no_answer, cfg->line_data.fd);
-          }
-          cfg->is_ringing = FALSE;
-          //mdm_disconnect(cfg, FALSE); // not sure need to do a disconnect here, no connection
-        } else
-          mdm_send_ring(cfg);
-      } else 
-        mdm_handle_timeout(cfg);
-    }
-    if (FD_ISSET(cfg->dce_data.fd, &readfs)) {  // serial port
-      LOG(LOG_DEBUG, "Data available on serial port");
-      res = mdm_read(cfg, buf, sizeof(buf));
-      if(res > 0) {
-        if(cfg->conn_type == MDM_CONN_NONE
-           && !cfg->is_cmd_mode
-           && cfg->is_off_hook) {
-          // this handles the case where atdt/ata goes off hook, but no
-          // connection
-          mdm_disconnect(cfg, FALSE);
-        } else {
-          mdm_parse_data(cfg, buf, res);
-        }
-      }
-    }
-    if (FD_ISSET(cfg->wp[0][0], &readfs)) {  // control pipe
-      res = readPipe(cfg->wp[0][0], buf, sizeof(buf) - 1);
-      buf[res] = 0;
-      LOG(LOG_DEBUG, "Received %s from control line watch task", buf);
-      status = dce_get_control_lines(&cfg->dce_data);
-      if(!(status & DCE_CL_DTR)) {
-        // DTR drop, close any active connection and put
-        // in cmd_mode
-        mdm_disconnect(cfg, FALSE);
-      }
-    }
-    if (FD_ISSET(cfg->cp[0][0], &readfs)) {  // ip thread pipe
-      res = read(cfg->cp[0][0], buf, sizeof(buf));
-      LOG(LOG_DEBUG, "Received %c from ip thread", buf[0]);
-      switch (buf[0]) {
-        case MSG_DISCONNECT:
-          if(cfg->direct_conn == TRUE) {
-            // what should we do here...
-            LOG(LOG_ERROR, "Direct Connection Link broken, disconnecting and awaiting new direct connection");
-            mdm_disconnect(cfg, TRUE);
-          } else {
-            mdm_disconnect(cfg, FALSE);
-          }
-          break;
-      }
-    }
-    if (FD_ISSET(cfg->mp[1][0], &readfs)) {  // parent pipe
-      LOG(LOG_DEBUG, "Data available on incoming IPC pipe");
-      res = read(cfg->mp[1][0], buf, sizeof(buf));
-      switch (buf[0]) {
-        case MSG_CALLING:       // accept connection.
-          accept_connection(cfg);
-          break;
-      }
-    }
-  }
+  bridge_update(cfg, TRUE);
   LOG_EXIT();
+  return 0;
 }
@@ -1,16 +1,15 @@
 #ifndef BRIDGE_H
 #define BRIDGE_H
 
+#include "evt.h"
 #include "modem_core.h"
 
-#define MSG_CALLING       'C'
-#define MSG_BUSY          'B'
 #define MSG_CONTROL_LINES 'D'
-#define MSG_DISCONNECT    'H'
-#define MSG_NOTIFY        'N'
+#define BRIDGE_RESERVE 4096   // queue room kept for responses and telnet replies
 
-int accept_connection(modem_config *);
+int accept_connection(modem_config *, int fd);
 int parse_ip_data(modem_config *cfg, unsigned char *data, int len);
-void *bridge_task(void *arg);
+void bridge_update(modem_config *cfg, int is_dte_event);
+int bridge_init(evt_loop *loop, modem_config *cfg);
 
 #endif
@@ -2,6 +2,8 @@
 #include <sys/ioctl.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/param.h>   // for MIN
+#include <errno.h>
 
 #include "debug.h"
 #include "serial.h"
@@ -11,6 +13,32 @@
 
 void dce_init_config(dce_config *cfg) {
   cfg->parity = -1;  // parity not yet checked.
+  cfg->add_parity = par_get_func(cfg->parity);
+  cfg->parity_buf = NULL;
+  cfg->fd = -1;
+  cfg->sSocket = -1;
+  cfg->is_connected = FALSE;
+  evt_init_handler(&cfg->evt);
+  ring_init(&cfg->out);
+  spl_init_config(&cfg->pipe);
+  evt_init_handler(&cfg->listen_evt);
+  evt_init_timer(&cfg->accept_timer);
+  cfg->read_len = DCE_MIN_READ_LEN;
+  cfg->is_read_full = FALSE;
+  cfg->is_line_wait = TRUE;
+  cfg->is_staged = FALSE;
+  cfg->rx_bytes = 0;
+  cfg->rx_reads = 0;
+}
+
+int get_speed_read_len(int speed) {
+  int len = DCE_MIN_READ_LEN;
+
+  // enough room for ~1/16 second of data at 10 bits per character
+  while(len < speed / 160 && len < DCE_MAX_READ_LEN) {
+    len <<= 1;
+  }
+  return len;
 }
 
 int detect_parity (int charA, int charT) {
@@ -32,6 +60,8 @@ int dce_connect(dce_config *cfg) {
   int rc;
 
   LOG_ENTER();
+  cfg->read_len = get_speed_read_len(cfg->port_speed);
+  LOG(LOG_DEBUG, "Sizing serial reads to %d bytes", cfg->read_len);
   if (cfg->is_ip232) {
     rc = ip232_init_conn(cfg);
   } else {
@@ -110,15 +140,26 @@ int dce_get_control_lines(dce_config *cfg) {
   return state;
 }
 
-int dce_check_control_lines(dce_config *cfg) {
-  int state = 0;
-  int new_state = 0;
+/*
+ * Blocks until the control lines differ from state, and returns the new
+ * state.  Serial ports sleep in TIOCMIWAIT; drivers that cannot do that
+ * are polled instead.
+ */
+int dce_check_control_lines(dce_config *cfg, int state) {
+  int new_state;
 
   LOG_ENTER();
-  state = dce_get_control_lines(cfg);
-  new_state = state;
+  new_state = dce_get_control_lines(cfg);
   while(new_state > -1 && state == new_state) {
-    usleep(100000);
+    if(cfg->is_line_wait
+       && 0 > ser_wait_control_lines(cfg->fd)
+       && errno != EINTR) {
+      ELOG(LOG_WARN, "Cannot wait for control line changes, polling %s", cfg->tty);
+      cfg->is_line_wait = FALSE;
+    }
+    if(!cfg->is_line_wait) {
+      usleep(100000);
+    }
     new_state = dce_get_control_lines(cfg);
   }
 
@@ -126,90 +167,181 @@ int dce_check_control_lines(dce_config *cfg) {
   return new_state;
 }
 
+int dce_get_read_len(dce_config *cfg) {
+  int pending;
+
+  // only ask for the backlog when the last read came back full
+  if(cfg->is_read_full && cfg->read_len < DCE_MAX_READ_LEN) {
+    if (cfg->is_ip232) {
+      pending = ip232_get_pending(cfg);
+    } else {
+      pending = ser_get_pending(cfg->fd);
+    }
+    while(cfg->read_len < pending && cfg->read_len < DCE_MAX_READ_LEN) {
+      cfg->read_len <<= 1;
+    }
+    LOG(LOG_DEBUG, "Serial backlog of %d bytes, reads now %d bytes", pending, cfg->read_len);
+    cfg->is_read_full = FALSE;
+  }
+  return cfg->read_len;
+}
+
+/*
+ * Sends bytes as they are, queueing what the port will not take now.
+ */
+int dce_send(dce_config *cfg, unsigned char *data, int len) {
+  if(spl_drain(&cfg->pipe, cfg->fd) > 0) {
+    return ring_queue(&cfg->out, &cfg->evt, cfg->fd, data, len);
+  }
+  if(cfg->is_staged && cfg->fd > -1) {
+    if(len <= RING_SIZE - ring_len(&cfg->out))
+      return (ring_put(&cfg->out, data, len) < len ? -1 : len);
+    // no room left to stage it, so the queue goes now, to make room
+  }
+  return ring_send(&cfg->out, &cfg->evt, cfg->fd, data, len);
+}
+
+int dce_sendv(dce_config *cfg, struct iovec *iov, int cnt) {
+  int len = 0;
+  int i;
+
+  if(cfg->is_staged) {
+    for(i = 0; i < cnt; i++) {
+      if(0 > dce_send(cfg, iov[i].iov_base, iov[i].iov_len))
+        return -1;
+      len += iov[i].iov_len;
+    }
+    return len;
+  }
+  // only ip232 sends slices, and its data is never spliced
+  return ring_sendv(&cfg->out, &cfg->evt, cfg->fd, iov, cnt);
+}
+
+/*
+ * Output sent between dce_stage and dce_flush is only queued, and the
+ * flush hands all of it to the port in one write.
+ */
+void dce_stage(dce_config *cfg) {
+  cfg->is_staged = TRUE;
+}
+
+int dce_flush(dce_config *cfg) {
+  if(!cfg->is_staged)
+    return 0;
+  cfg->is_staged = FALSE;
+  if(cfg->fd < 0 || ring_len(&cfg->out) == 0 || cfg->pipe.len > 0)
+    return 0;   // a spliced backlog already has a write event waiting
+  return ring_push(&cfg->out, &cfg->evt, cfg->fd);
+}
+
+/*
+ * Moves up to len bytes from fd to the port without copying them, see
+ * spl_fill for the return value.
+ */
+int dce_splice(dce_config *cfg, int fd, int len) {
+  int res;
+
+  res = spl_fill(&cfg->pipe, fd, len);
+  if(res > 0 && spl_drain(&cfg->pipe, cfg->fd) > 0) {
+    evt_mod(&cfg->evt, cfg->evt.events | EVT_WRITE);
+  }
+  return res;
+}
+
+int dce_drain(dce_config *cfg) {
+  // the pipe was filled before anything now in the queue
+  if(spl_drain(&cfg->pipe, cfg->fd) > 0)
+    return cfg->pipe.len + ring_len(&cfg->out);
+  return ring_drain(&cfg->out, &cfg->evt);
+}
+
 int dce_write(dce_config *cfg, unsigned char data[], int len) {
-  unsigned char *buf;
-  int rc;
+  int rc = len;
   int i;
+  int n;
 
   log_trace(TRACE_SERIAL_OUT, data, len);
   if (cfg->is_ip232) {
     return ip232_write(cfg, data, len);
   } else if(cfg->parity) {
-    buf = malloc(len);  // TODO what if malloc fails?
-    memcpy(buf, data, len);
-
-    if(0 < cfg->parity) {
-      for (i = 0; i < len; i++) {
-        buf[i] = apply_parity(data[i], cfg->parity);
-      }
+    // parity goes on in a buffer the worker's ports share, a block at a time
+    for(i = 0; i < len && rc > -1; i += n) {
+      n = MIN(len - i, DCE_PARITY_LEN);
+      cfg->add_parity(cfg->parity_buf, data + i, n);
+      log_trace(TRACE_MODEM_OUT, cfg->parity_buf, n);
+      if(0 > dce_send(cfg, cfg->parity_buf, n))
+        rc = -1;
     }
-  } else {
-    buf = data;
+    return rc;
   }
-  rc = ser_write(cfg->fd, buf, len);
-  if(cfg->parity)
-    free(buf);
-  return rc;
+  log_trace(TRACE_MODEM_OUT, data, len);
+  return dce_send(cfg, data, len);
 }
 
-int dce_write_char_raw(dce_config *cfg, unsigned char data) {
+int dce_write_raw(dce_config *cfg, unsigned char data[], int len) {
   int rc;
 
-  log_trace(TRACE_SERIAL_OUT, &data, 1);
+  log_trace(TRACE_SERIAL_OUT, data, len);
   if (cfg->is_ip232) {
-    rc = ip232_write(cfg, &data, 1);
+    rc = ip232_write(cfg, data, len);
   } else {
-    rc = ser_write(cfg->fd, &data, 1);
+    log_trace(TRACE_MODEM_OUT, data, len);
+    rc = dce_send(cfg, data, len);
   }
   return rc;
 }
 
 int dce_read(dce_config *cfg, unsigned char data[], int len) {
   int res;
-  int i;
 
   if (cfg->is_ip232) {
     res = ip232_read(cfg, data, len);
   } else {
     res = ser_read(cfg->fd, data, len);
+    cfg->is_read_full = (res == len);
   }
   if(0 < res) {
     LOG(LOG_DEBUG, "Read %d bytes from serial port", res);
+    cfg->rx_bytes += res;
+    cfg->rx_reads++;
     if(0 < cfg->parity) {
-      for (i = 0; i < res; i++) {
-        data[i] &= 0x7f;  // strip parity from returned data
-      }
+      par_strip(data, res);   // strip parity from returned data
     }
     log_trace(TRACE_SERIAL_IN, data, res);
   }
   return res;
 }
 
-int dce_read_char_raw(dce_config *cfg) {
+int dce_read_raw(dce_config *cfg, unsigned char data[], int len) {
   int res;
-  unsigned char data[1];
 
   if (cfg->is_ip232) {
-    res = ip232_read(cfg, data, 1);
+    res = ip232_read(cfg, data, len);
   } else {
-    res = ser_read(cfg->fd, data, 1);
+    res = ser_read(cfg->fd, data, len);
+    cfg->is_read_full = (res == len);
   }
   if(0 < res) {
-    res = data[0];
-    LOG(LOG_DEBUG, "Read 1 raw byte from serial port");
-    log_trace(TRACE_SERIAL_IN, data, 1);
+    LOG(LOG_DEBUG, "Read %d raw bytes from serial port", res);
+    log_trace(TRACE_SERIAL_IN, data, res);
   }
   return res;
 }
 
 void dce_detect_parity(dce_config *cfg, unsigned char a, unsigned char t) {
   cfg->parity = detect_parity(a, t);
+  cfg->add_parity = par_get_func(cfg->parity);
 }
 
 int dce_strip_parity(dce_config *cfg, unsigned char data) {
   return (cfg->parity ? data & 0x7f : data);
 }
 
+void dce_strip_parity_buf(dce_config *cfg, unsigned char *data, int len) {
+  if(cfg->parity)
+    par_strip(data, len);
+}
+
 int dce_get_parity(dce_config *cfg) {
   return cfg->parity;
 }
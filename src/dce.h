@@ -1,6 +1,11 @@
 #ifndef DCE_H
 #define DCE_H 1
 
+#include "evt.h"
+#include "ring.h"
+#include "parity.h"
+#include "splice.h"
+
 #define DCE_CL_DSR 1
 #define DCE_CL_DCD 2
 #define DCE_CL_CTS 4
@@ -23,6 +28,13 @@
 #  define apply_parity(v, p) ((unsigned char)((v & 0x7f) | (((p >> gen_parity(v & 0x7f))) & 1) << 7))
 #endif
 
+/* data mode reads start out sized to the DTE speed, and grow in powers of two
+ * up to DCE_MAX_READ_LEN whenever the input backlog outruns them.
+ */
+#define DCE_MIN_READ_LEN 256
+#define DCE_MAX_READ_LEN 16384
+#define DCE_PARITY_LEN 4096   // parity is put on a block this long at a time
+
 enum {
   PARITY_SPACE_NONE = 0,
   PARITY_ODD,
@@ -33,15 +45,27 @@ enum {
 typedef struct dce_config {
   int port_speed;
   int parity;
+  par_func add_parity;  // chosen when the parity is detected
+  unsigned char *parity_buf;    // DCE_PARITY_LEN bytes, see dce_write
   int is_ip232;
   char tty[256];
   int fd;
-  int dp[2][2];
+  evt_handler evt;
+  ring out;             // DTE output not yet taken by the port
+  spl_pipe pipe;        // spliced DTE output, goes ahead of out
   int sSocket;
+  evt_handler listen_evt;
+  evt_timer accept_timer;   // to accept again after running out of descriptors
   int is_connected;
   int ip232_dtr;
   int ip232_dcd;
   int ip232_iac;
+  int is_line_wait;
+  int read_len;
+  int is_read_full;
+  int is_staged;        // output waits in out until dce_flush
+  unsigned long rx_bytes;
+  unsigned long rx_reads;
 } dce_config;
 
 void dce_init_config(dce_config *cfg);
@@ -49,13 +73,21 @@ int dce_connect(dce_config *cfg);
 int dce_set_flow_control(dce_config *cfg, int opts);
 int dce_set_control_lines(dce_config *cfg, int state);
 int dce_get_control_lines(dce_config *cfg);
-int dce_check_control_lines(dce_config *cfg);
+int dce_check_control_lines(dce_config *cfg, int state);
+int dce_get_read_len(dce_config *cfg);
+int dce_send(dce_config *cfg, unsigned char *data, int len);
+int dce_sendv(dce_config *cfg, struct iovec *iov, int cnt);
+int dce_splice(dce_config *cfg, int fd, int len);
+int dce_drain(dce_config *cfg);
+void dce_stage(dce_config *cfg);
+int dce_flush(dce_config *cfg);
 int dce_write(dce_config *cfg, unsigned char *data, int len);
-int dce_write_char_raw(dce_config *cfg, unsigned char data);
+int dce_write_raw(dce_config *cfg, unsigned char *data, int len);
 int dce_read(dce_config *cfg, unsigned char *data, int len);
-int dce_read_char_raw(dce_config *cfg);
+int dce_read_raw(dce_config *cfg, unsigned char *data, int len);
 void dce_detect_parity(dce_config *cfg, unsigned char a, unsigned char t);
 int dce_strip_parity(dce_config *cfg, unsigned char data);
+void dce_strip_parity_buf(dce_config *cfg, unsigned char *data, int len);
 int dce_get_parity(dce_config *cfg);
 //int dce_check_for_break(dce_config *cfg, char ch, int chars_left);
 
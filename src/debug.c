@@ -113,6 +113,84 @@ void log_trace(int type, unsigned char *line, int len) {
   }
 }
 
+#ifdef ALLOC_DEBUG
+#undef malloc
+#undef calloc
+#undef realloc
+
+#define ALLOC_SITES 64
+
+typedef struct alloc_site {
+  const char *file;
+  int line;
+  unsigned long count;
+  unsigned long bytes;
+} alloc_site;
+
+alloc_site alloc_sites[ALLOC_SITES];
+int alloc_site_count = 0;
+__thread int alloc_guard = 0;
+
+void count_alloc(size_t size, const char *file, int line) {
+  int i;
+
+  pthread_mutex_lock(&log_mutex);
+  for(i = 0; i < alloc_site_count; i++) {
+    if(alloc_sites[i].line == line && 0 == strcmp(alloc_sites[i].file, file))
+      break;
+  }
+  if(i == alloc_site_count && i < ALLOC_SITES) {
+    alloc_sites[i].file = file;
+    alloc_sites[i].line = line;
+    alloc_sites[i].count = 0;
+    alloc_sites[i].bytes = 0;
+    alloc_site_count++;
+  }
+  if(i < alloc_site_count) {
+    alloc_sites[i].count++;
+    alloc_sites[i].bytes += size;
+  }
+  pthread_mutex_unlock(&log_mutex);
+  if(alloc_guard) {
+    LOG(LOG_FATAL, "%lu byte allocation at %s:%d during a connected session", (unsigned long)size, file, line);
+    abort();
+  }
+}
+
+void *log_malloc(size_t size, const char *file, int line) {
+  count_alloc(size, file, line);
+  return malloc(size);
+}
+
+void *log_calloc(size_t count, size_t size, const char *file, int line) {
+  count_alloc(count * size, file, line);
+  return calloc(count, size);
+}
+
+void *log_realloc(void *ptr, size_t size, const char *file, int line) {
+  count_alloc(size, file, line);
+  return realloc(ptr, size);
+}
+
+/*
+ * Raised by the bridge while it moves data for an established call,
+ * where nothing should touch the heap.
+ */
+void log_alloc_guard(int on) {
+  alloc_guard = on;
+}
+
+void log_alloc_report(void) {
+  int i;
+
+  for(i = 0; i < alloc_site_count; i++) {
+    LOG(LOG_INFO, "Allocations at %s:%d: %lu (%lu bytes)",
+        alloc_sites[i].file, alloc_sites[i].line,
+        alloc_sites[i].count, alloc_sites[i].bytes);
+  }
+}
+#endif
+
 void log_start(int level) {
   char t[23];
   time_t now;
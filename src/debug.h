@@ -58,6 +58,25 @@ void log_trace(int type, unsigned char *line, int len);
 void log_start(int level);
 void log_end();
 
+/* Building with -DALLOC_DEBUG counts every heap allocation by call site
+ * (see log_alloc_report), and aborts if one happens while a thread has
+ * raised the data path guard.
+ */
+#ifdef ALLOC_DEBUG
+#  include <stdlib.h>
+void *log_malloc(size_t size, const char *file, int line);
+void *log_calloc(size_t count, size_t size, const char *file, int line);
+void *log_realloc(void *ptr, size_t size, const char *file, int line);
+void log_alloc_guard(int on);
+void log_alloc_report(void);
+#  define malloc(s) log_malloc((s), __FILE__, __LINE__)
+#  define calloc(c, s) log_calloc((c), (s), __FILE__, __LINE__)
+#  define realloc(p, s) log_realloc((p), (s), __FILE__, __LINE__)
+#else
+#  define log_alloc_guard(on)
+#  define log_alloc_report()
+#endif
+
 #endif
 #ifndef DEBUG_VARS
 #define DEBUG_VARS 1
@@ -0,0 +1,344 @@
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>      // for strcasecmp
+#include <ctype.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "util.h"
+#include "debug.h"
+#include "evt.h"          // for evt_now
+#include "dns.h"
+
+enum {
+  DNS_IDLE = 0,
+  DNS_PENDING,
+  DNS_DONE
+};
+
+typedef struct dns_entry {
+  char host[DNS_HOST_LEN];
+  struct sockaddr_storage addr[DNS_ADDRS];
+  socklen_t addr_len[DNS_ADDRS];
+  int count;
+  int err;
+  long long expires;    // 0 if the slot was never used
+} dns_entry;
+
+pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dns_queued = PTHREAD_COND_INITIALIZER;
+pthread_cond_t dns_done = PTHREAD_COND_INITIALIZER;
+dns_query *dns_head = NULL;
+dns_query *dns_tail = NULL;
+dns_entry dns_cache[DNS_CACHE_SIZE];
+unsigned long dns_hits = 0;
+unsigned long dns_misses = 0;
+unsigned long dns_failures = 0;
+long long dns_total_ms = 0;
+long long dns_max_ms = 0;
+
+void dns_init_query(dns_query *q, dns_func func, void *arg) {
+  q->host[0] = 0;
+  q->count = 0;
+  q->err = 0;
+  q->state = DNS_IDLE;
+  q->seq = 0;
+  q->is_queued = FALSE;
+  q->func = func;
+  q->arg = arg;
+  q->next = NULL;
+}
+
+/*
+ * Hands a query on to a new owner.  seq carries on from the old one, so
+ * a lookup still running for it stays stale.
+ */
+void dns_set_func(dns_query *q, dns_func func, void *arg) {
+  pthread_mutex_lock(&dns_lock);
+  q->func = func;
+  q->arg = arg;
+  pthread_mutex_unlock(&dns_lock);
+}
+
+unsigned int get_hash(char *host) {
+  unsigned int hash = 2166136261u;
+
+  while(*host) {
+    hash = (hash ^ (unsigned char)tolower((unsigned char)*host++)) * 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * A name can only live in the DNS_CACHE_WAYS slots after its hash, so
+ * finding it, or a slot for it, never looks further than that.
+ */
+dns_entry *find_entry(char *host, long long now) {
+  unsigned int idx = get_hash(host);
+  dns_entry *e;
+  int i;
+
+  for(i = 0; i < DNS_CACHE_WAYS; i++) {
+    e = &dns_cache[(idx + i) & (DNS_CACHE_SIZE - 1)];
+    if(e->expires > now && 0 == strcasecmp(e->host, host))
+      return e;
+  }
+  return NULL;
+}
+
+dns_entry *get_entry(char *host) {
+  unsigned int idx = get_hash(host);
+  dns_entry *e;
+  dns_entry *oldest = NULL;
+  int i;
+
+  for(i = 0; i < DNS_CACHE_WAYS; i++) {
+    e = &dns_cache[(idx + i) & (DNS_CACHE_SIZE - 1)];
+    if(0 == strcasecmp(e->host, host))
+      return e;
+    if(oldest == NULL || e->expires < oldest->expires)
+      oldest = e;
+  }
+  strncpy(oldest->host, host, sizeof(oldest->host) - 1);
+  oldest->host[sizeof(oldest->host) - 1] = 0;
+  return oldest;
+}
+
+void copy_answer(dns_query *q, dns_entry *e) {
+  int i;
+
+  for(i = 0; i < e->count; i++) {
+    memcpy(&q->addr[i], &e->addr[i], e->addr_len[i]);
+    q->addr_len[i] = e->addr_len[i];
+  }
+  q->count = e->count;
+  q->err = e->err;
+  q->state = DNS_DONE;
+}
+
+/*
+ * Takes the first DNS_ADDRS answers, switching address family after each
+ * one, starting with the family getaddrinfo() put first.
+ */
+int get_addrs(struct addrinfo *res, struct sockaddr_storage *addr, socklen_t *addr_len) {
+  struct addrinfo *p[2];
+  int family[2];
+  int turn = 0;
+  int count = 0;
+
+  p[0] = res;
+  p[1] = res;
+  family[0] = res->ai_family;
+  family[1] = (family[0] == AF_INET6 ? AF_INET : AF_INET6);
+  while(count < DNS_ADDRS) {
+    while(p[turn] != NULL
+          && (p[turn]->ai_family != family[turn]
+              || p[turn]->ai_addrlen > sizeof(*addr))) {
+      p[turn] = p[turn]->ai_next;
+    }
+    if(p[turn] == NULL) {
+      if(p[!turn] == NULL)
+        break;
+      turn = !turn;
+      continue;
+    }
+    memcpy(&addr[count], p[turn]->ai_addr, p[turn]->ai_addrlen);
+    addr_len[count++] = p[turn]->ai_addrlen;
+    p[turn] = p[turn]->ai_next;
+    turn = !turn;
+  }
+  return count;
+}
+
+void *dns_thread(void *arg) {
+  char host[DNS_HOST_LEN];
+  struct addrinfo hints;
+  struct addrinfo *res;
+  dns_query *q;
+  dns_entry *e;
+  dns_func func;
+  void *func_arg = NULL;
+  unsigned int seq;
+  long long start;
+  long long now;
+  int err;
+
+  for(;;) {
+    pthread_mutex_lock(&dns_lock);
+    while(dns_head == NULL) {
+      pthread_cond_wait(&dns_queued, &dns_lock);
+    }
+    q = dns_head;
+    dns_head = q->next;
+    if(dns_head == NULL)
+      dns_tail = NULL;
+    q->is_queued = FALSE;
+    seq = q->seq;
+    start = q->start;
+    strcpy(host, q->host);
+    pthread_mutex_unlock(&dns_lock);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    res = NULL;
+    err = getaddrinfo(host, NULL, &hints, &res);
+    now = evt_now();
+
+    pthread_mutex_lock(&dns_lock);
+    e = get_entry(host);
+    e->count = 0;
+    if(err == 0) {
+      e->count = get_addrs(res, e->addr, e->addr_len);
+      if(e->count == 0)
+        err = EAI_FAMILY;
+    }
+    e->err = err;
+    if(err != 0) {
+      dns_failures++;
+    }
+    e->expires = now + (err == 0 ? DNS_TTL : DNS_NEG_TTL) * 1000LL;
+    dns_total_ms += now - start;
+    if(now - start > dns_max_ms)
+      dns_max_ms = now - start;
+    func = NULL;
+    // the query may have been given up, or reused, while we looked
+    if(q->seq == seq && q->state == DNS_PENDING) {
+      copy_answer(q, e);
+      func = q->func;
+      func_arg = q->arg;
+    }
+    pthread_cond_broadcast(&dns_done);
+    LOG(LOG_DEBUG,
+        "Looked up %s in %lld ms, %lu of %lu names found in cache, %lu not found, %lld ms average, %lld ms worst",
+        host,
+        now - start,
+        dns_hits,
+        dns_hits + dns_misses,
+        dns_failures,
+        dns_total_ms / (long long)dns_misses,
+        dns_max_ms
+       );
+    pthread_mutex_unlock(&dns_lock);
+
+    if(err != 0) {
+      LOG(LOG_INFO, "Could not look up %s: %s", host, gai_strerror(err));
+    }
+    if(res != NULL)
+      freeaddrinfo(res);
+    if(func != NULL)
+      func(func_arg);
+  }
+  return NULL;
+}
+
+int dns_init(int threads) {
+  int i;
+
+  for(i = 0; i < threads; i++) {
+    spawn_thread(dns_thread, NULL, "DNS");
+  }
+  return 0;
+}
+
+/*
+ * Returns 0 if the answer is already in q (for addresses, or names in
+ * the cache), or 1 if a resolver thread will call q->func once it is.
+ */
+int dns_lookup(dns_query *q, char *host) {
+  struct addrinfo hints;
+  struct addrinfo *res = NULL;
+  dns_entry *e;
+  long long now = evt_now();
+  int rc = 0;
+
+  // addresses are only parsed, which never waits on the network
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST;
+  if(0 != getaddrinfo(host, NULL, &hints, &res))
+    res = NULL;
+
+  pthread_mutex_lock(&dns_lock);
+  q->seq++;
+  strncpy(q->host, host, sizeof(q->host) - 1);
+  q->host[sizeof(q->host) - 1] = 0;
+  q->count = 0;
+  if(res != NULL) {
+    q->count = get_addrs(res, q->addr, q->addr_len);
+    q->err = (q->count > 0 ? 0 : EAI_FAMILY);
+    q->state = DNS_DONE;
+  } else if(NULL != (e = find_entry(host, now))) {
+    dns_hits++;
+    copy_answer(q, e);
+  } else {
+    dns_misses++;
+    q->state = DNS_PENDING;
+    q->start = now;
+    if(!q->is_queued) {
+      q->next = NULL;
+      if(dns_tail == NULL) {
+        dns_head = q;
+      } else {
+        dns_tail->next = q;
+      }
+      dns_tail = q;
+      q->is_queued = TRUE;
+      pthread_cond_signal(&dns_queued);
+    }
+    rc = 1;
+  }
+  pthread_mutex_unlock(&dns_lock);
+  if(res != NULL)
+    freeaddrinfo(res);
+  return rc;
+}
+
+/*
+ * Returns 0 if q holds an address, -1 if the name could not be found,
+ * or 1 if the lookup has not finished.
+ */
+int dns_result(dns_query *q) {
+  int rc;
+
+  pthread_mutex_lock(&dns_lock);
+  if(q->state == DNS_DONE) {
+    rc = (q->err == 0 ? 0 : -1);
+  } else {
+    rc = 1;
+  }
+  pthread_mutex_unlock(&dns_lock);
+  return rc;
+}
+
+int dns_wait(dns_query *q) {
+  pthread_mutex_lock(&dns_lock);
+  while(q->state == DNS_PENDING) {
+    pthread_cond_wait(&dns_done, &dns_lock);
+  }
+  pthread_mutex_unlock(&dns_lock);
+  return dns_result(q);
+}
+
+void dns_cancel(dns_query *q) {
+  dns_query *prev = NULL;
+  dns_query *p;
+
+  pthread_mutex_lock(&dns_lock);
+  q->seq++;
+  q->state = DNS_IDLE;
+  for(p = dns_head; q->is_queued && p != NULL; prev = p, p = p->next) {
+    if(p == q) {
+      if(prev == NULL) {
+        dns_head = q->next;
+      } else {
+        prev->next = q->next;
+      }
+      if(dns_tail == q)
+        dns_tail = prev;
+      q->is_queued = FALSE;
+    }
+  }
+  pthread_mutex_unlock(&dns_lock);
+}
@@ -0,0 +1,51 @@
+#ifndef DNS_H
+#define DNS_H 1
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+/* Names are looked up by a few resolver threads, so the modem loops
+ * never wait on DNS.  Answers, and failures, are cached for a while and
+ * shared by every modem.  getaddrinfo() does not say how long a record
+ * lives, so the cache uses fixed lifetimes.  Up to DNS_ADDRS addresses
+ * are kept for a name, alternating IPv6 and IPv4 as RFC 8305 asks.
+ */
+#define DNS_THREADS 2
+#define DNS_CACHE_SIZE 256    // must be a power of two
+#define DNS_CACHE_WAYS 8      // slots a name may live in
+#define DNS_TTL 300           // seconds an answer is kept
+#define DNS_NEG_TTL 30        // seconds a failure is kept
+#define DNS_HOST_LEN 256
+#define DNS_ADDRS 4
+
+typedef void (*dns_func)(void *arg);
+
+typedef struct dns_query {
+  char host[DNS_HOST_LEN];
+  struct sockaddr_storage addr[DNS_ADDRS];
+  socklen_t addr_len[DNS_ADDRS];
+  int count;
+  int err;              // 0, or the EAI_ code of a failed lookup
+  int state;
+  unsigned int seq;     // bumped by every lookup and cancel
+  int is_queued;
+  long long start;
+  dns_func func;        // called on a resolver thread when an answer is in
+  void *arg;
+  struct dns_query *next;
+} dns_query;
+
+void dns_init_query(dns_query *q, dns_func func, void *arg);
+void dns_set_func(dns_query *q, dns_func func, void *arg);
+int dns_init(int threads);
+int dns_lookup(dns_query *q, char *host);
+int dns_result(dns_query *q);
+int dns_wait(dns_query *q);
+void dns_cancel(dns_query *q);
+
+#endif
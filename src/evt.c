@@ -0,0 +1,502 @@
+#include <stdlib.h>       // for realloc...
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "debug.h"
+#include "evt.h"
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#define EVT_BATCH 64
+
+long long evt_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int evt_init(evt_loop *loop) {
+  LOG_ENTER();
+  loop->timers = NULL;
+  loop->timer_count = 0;
+  loop->timer_size = 0;
+  loop->timer_reserved = 0;
+#ifdef HAVE_IO_URING
+  if(0 == uring_init(loop)) {
+    LOG_EXIT();
+    return 0;
+  }
+#endif
+#ifdef HAVE_EPOLL
+  loop->fd = epoll_create(EVT_BATCH);
+  if(loop->fd < 0) {
+    ELOG(LOG_FATAL, "Could not create event loop");
+    return -1;
+  }
+#else
+  loop->fds = NULL;
+  loop->handlers = NULL;
+  loop->count = 0;
+  loop->size = 0;
+  loop->reserved = 0;
+  loop->is_dirty = FALSE;
+#endif
+  LOG_EXIT();
+  return 0;
+}
+
+void evt_init_handler(evt_handler *h) {
+  h->loop = NULL;
+  h->fd = -1;
+  h->events = 0;
+  h->func = NULL;
+  h->arg = NULL;
+  h->idx = -1;
+  h->gen = 0;
+#ifdef HAVE_IO_URING
+  uring_init_handler(h);
+#endif
+}
+
+void evt_init_timer(evt_timer *t) {
+  t->loop = NULL;
+  t->when = 0;
+  t->func = NULL;
+  t->arg = NULL;
+  t->idx = -1;
+}
+
+int grow_timers(evt_loop *loop, int need) {
+  evt_timer **timers;
+  int size = (loop->timer_size ? loop->timer_size : 16);
+
+  if(need <= loop->timer_size)
+    return 0;
+  while(size < need) {
+    size *= 2;
+  }
+  timers = realloc(loop->timers, size * sizeof(evt_timer *));
+  if(timers == NULL) {
+    ELOG(LOG_ERROR, "Could not grow event loop timers");
+    return -1;
+  }
+  loop->timers = timers;
+  loop->timer_size = size;
+  return 0;
+}
+
+#ifndef HAVE_EPOLL
+int grow_handlers(evt_loop *loop, int need) {
+  struct pollfd *fds;
+  evt_handler **handlers;
+  int size = (loop->size ? loop->size : 16);
+
+  if(need <= loop->size)
+    return 0;
+  while(size < need) {
+    size *= 2;
+  }
+  fds = realloc(loop->fds, size * sizeof(struct pollfd));
+  if(fds != NULL)
+    loop->fds = fds;
+  handlers = realloc(loop->handlers, size * sizeof(evt_handler *));
+  if(handlers != NULL)
+    loop->handlers = handlers;
+  if(fds == NULL || handlers == NULL) {
+    ELOG(LOG_ERROR, "Could not grow event loop");
+    return -1;
+  }
+  loop->size = size;
+  return 0;
+}
+#endif
+
+/*
+ * Sizes the loop up front for descriptors and timers that will come and
+ * go later, so adding them then does not allocate.
+ */
+int evt_reserve(evt_loop *loop, int handlers, int timers) {
+  loop->timer_reserved += timers;
+  if(grow_timers(loop, loop->timer_reserved) < 0)
+    return -1;
+#ifndef HAVE_EPOLL
+  loop->reserved += handlers;
+  if(grow_handlers(loop, loop->reserved) < 0)
+    return -1;
+#endif
+  return 0;
+}
+
+#ifdef HAVE_EPOLL
+int get_epoll_events(int events) {
+  // edge triggered, so handlers must read until the descriptor is drained
+  return EPOLLET
+         | ((events & EVT_READ) ? EPOLLIN | EPOLLRDHUP : 0)
+         | ((events & EVT_WRITE) ? EPOLLOUT : 0);
+}
+
+/*
+ * Events carry the handler's generation in the top bits of its pointer,
+ * which user space addresses leave clear.  A batch can then hold events
+ * for a descriptor the handler has since dropped, even if it was added
+ * again with another, and they are told apart from the new ones.
+ */
+#define EVT_GEN_SHIFT (sizeof(void *) == 8 ? 48 : 32)
+#define EVT_GEN_MASK 0xffffu
+
+uint64_t get_epoll_data(evt_handler *h) {
+  return (uint64_t)(uintptr_t)h | ((uint64_t)(h->gen & EVT_GEN_MASK) << EVT_GEN_SHIFT);
+}
+
+evt_handler *get_epoll_handler(uint64_t data) {
+  evt_handler *h = (evt_handler *)(uintptr_t)(data & (((uint64_t)1 << EVT_GEN_SHIFT) - 1));
+
+  if(h->fd < 0 || (h->gen & EVT_GEN_MASK) != (data >> EVT_GEN_SHIFT))
+    return NULL;    // deleted, or added again, by an earlier handler
+  return h;
+}
+#endif
+
+int evt_add(evt_loop *loop, evt_handler *h, int fd, int events, evt_func func, void *arg) {
+  int flags;
+#ifdef HAVE_EPOLL
+  struct epoll_event ev;
+#endif
+
+  flags = fcntl(fd, F_GETFL, 0);
+  if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    ELOG(LOG_ERROR, "Could not make fd %d non-blocking", fd);
+    return -1;
+  }
+#ifdef HAVE_IO_URING
+  if(loop->ring.fd > -1) {
+    h->loop = loop;
+    h->fd = fd;
+    h->events = events;
+    h->func = func;
+    h->arg = arg;
+    return uring_add(h);
+  }
+#endif
+#ifdef HAVE_EPOLL
+  h->gen++;
+  ev.events = get_epoll_events(events);
+  ev.data.u64 = get_epoll_data(h);
+  if(epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    ELOG(LOG_ERROR, "Could not add fd %d to event loop", fd);
+    return -1;
+  }
+#else
+  if(grow_handlers(loop, loop->count + 1) < 0)
+    return -1;
+  h->idx = loop->count++;
+  loop->fds[h->idx].fd = fd;
+  loop->fds[h->idx].events = ((events & EVT_READ) ? POLLIN : 0)
+                             | ((events & EVT_WRITE) ? POLLOUT : 0);
+  loop->fds[h->idx].revents = 0;
+  loop->handlers[h->idx] = h;
+#endif
+  h->loop = loop;
+  h->fd = fd;
+  h->events = events;
+  h->func = func;
+  h->arg = arg;
+  return 0;
+}
+
+int evt_mod(evt_handler *h, int events) {
+#ifdef HAVE_EPOLL
+  struct epoll_event ev;
+#endif
+
+  if(h->fd < 0 || h->events == events)
+    return 0;
+#ifdef HAVE_IO_URING
+  if(h->loop->ring.fd > -1) {
+    uring_mod(h, events);
+    h->events = events;
+    return 0;
+  }
+#endif
+#ifdef HAVE_EPOLL
+  ev.events = get_epoll_events(events);
+  ev.data.u64 = get_epoll_data(h);
+  if(epoll_ctl(h->loop->fd, EPOLL_CTL_MOD, h->fd, &ev) < 0) {
+    ELOG(LOG_ERROR, "Could not change events for fd %d", h->fd);
+    return -1;
+  }
+#else
+  h->loop->fds[h->idx].events = ((events & EVT_READ) ? POLLIN : 0)
+                                | ((events & EVT_WRITE) ? POLLOUT : 0);
+#endif
+  h->events = events;
+  return 0;
+}
+
+/*
+ * Must be called before the descriptor is closed, as the poll() loop
+ * would otherwise keep polling a dead (or reused) descriptor.
+ */
+int evt_del(evt_handler *h) {
+#ifdef HAVE_EPOLL
+  struct epoll_event ev;
+#endif
+
+  if(h->fd < 0)
+    return 0;
+#ifdef HAVE_IO_URING
+  if(h->loop->ring.fd > -1) {
+    uring_del(h);
+    h->fd = -1;
+    h->events = 0;
+    return 0;
+  }
+#endif
+#ifdef HAVE_EPOLL
+  if(epoll_ctl(h->loop->fd, EPOLL_CTL_DEL, h->fd, &ev) < 0) {
+    ELOG(LOG_WARN, "Could not remove fd %d from event loop", h->fd);
+  }
+  h->gen++;
+#else
+  h->loop->fds[h->idx].fd = -1;
+  h->loop->handlers[h->idx] = NULL;
+  h->loop->is_dirty = TRUE;
+  h->idx = -1;
+#endif
+  h->fd = -1;
+  h->events = 0;
+  return 0;
+}
+
+/*
+ * Sockets on an io_uring loop are read and written by the loop, and
+ * their owners go through these rather than the descriptor.  Everywhere
+ * else they are never async, and reads go straight to the descriptor.
+ */
+int evt_is_async(evt_handler *h) {
+#ifdef HAVE_IO_URING
+  return (h->fd > -1 && h->io.is_async);
+#else
+  return FALSE;
+#endif
+}
+
+int evt_read(evt_handler *h, unsigned char *data, int len) {
+#ifdef HAVE_IO_URING
+  if(evt_is_async(h))
+    return uring_read(h, data, len);
+#endif
+  return read(h->fd, data, len);
+}
+
+int evt_writev(evt_handler *h, struct iovec *iov, int cnt) {
+#ifdef HAVE_IO_URING
+  if(evt_is_async(h))
+    return uring_writev(h, iov, cnt);
+#endif
+  errno = ENOSYS;
+  return -1;
+}
+
+int evt_write_busy(evt_handler *h) {
+#ifdef HAVE_IO_URING
+  return (h->io.writes > 0);
+#else
+  return FALSE;
+#endif
+}
+
+int evt_write_done(evt_handler *h) {
+#ifdef HAVE_IO_URING
+  if(evt_is_async(h))
+    return uring_write_done(h);
+#endif
+  return 0;
+}
+
+/*
+ * Timers live in a binary min-heap ordered on their deadline.
+ */
+void timer_swap(evt_loop *loop, int i, int j) {
+  evt_timer *t = loop->timers[i];
+
+  loop->timers[i] = loop->timers[j];
+  loop->timers[j] = t;
+  loop->timers[i]->idx = i;
+  loop->timers[j]->idx = j;
+}
+
+void timer_up(evt_loop *loop, int i) {
+  while(i > 0 && loop->timers[(i - 1) / 2]->when > loop->timers[i]->when) {
+    timer_swap(loop, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+void timer_down(evt_loop *loop, int i) {
+  int child;
+
+  for(;;) {
+    child = i * 2 + 1;
+    if(child >= loop->timer_count)
+      break;
+    if(child + 1 < loop->timer_count
+       && loop->timers[child + 1]->when < loop->timers[child]->when)
+      child++;
+    if(loop->timers[i]->when <= loop->timers[child]->when)
+      break;
+    timer_swap(loop, i, child);
+    i = child;
+  }
+}
+
+void evt_timer_clear(evt_timer *t) {
+  evt_loop *loop = t->loop;
+  int i = t->idx;
+
+  if(i < 0)
+    return;
+  loop->timer_count--;
+  if(i != loop->timer_count) {
+    timer_swap(loop, i, loop->timer_count);
+    timer_up(loop, i);
+    timer_down(loop, i);
+  }
+  t->idx = -1;
+}
+
+int evt_timer_set(evt_loop *loop, evt_timer *t, long msec, evt_func func, void *arg) {
+  evt_timer_clear(t);
+  if(grow_timers(loop, loop->timer_count + 1) < 0)
+    return -1;
+  t->loop = loop;
+  t->when = evt_now() + msec;
+  t->func = func;
+  t->arg = arg;
+  t->idx = loop->timer_count++;
+  loop->timers[t->idx] = t;
+  timer_up(loop, t->idx);
+  return 0;
+}
+
+int get_timeout(evt_loop *loop) {
+  long long wait;
+
+  if(loop->timer_count == 0)
+    return -1;
+  wait = loop->timers[0]->when - evt_now();
+  return (wait < 0 ? 0 : (int)wait);
+}
+
+void run_timers(evt_loop *loop) {
+  long long now = evt_now();
+  evt_timer *t;
+
+  while(loop->timer_count > 0 && loop->timers[0]->when <= now) {
+    t = loop->timers[0];
+    evt_timer_clear(t);
+    t->func(loop, t->arg, EVT_TIMER);
+  }
+}
+
+#ifdef HAVE_EPOLL
+int evt_poll(evt_loop *loop) {
+  struct epoll_event events[EVT_BATCH];
+  evt_handler *h;
+  int rc;
+  int i;
+  int ev;
+
+#ifdef HAVE_IO_URING
+  if(loop->ring.fd > -1) {
+    if(uring_wait(loop, get_timeout(loop)) < 0)
+      return -1;
+    run_timers(loop);
+    return 0;
+  }
+#endif
+  rc = epoll_wait(loop->fd, events, EVT_BATCH, get_timeout(loop));
+  if(rc < 0 && errno != EINTR) {
+    ELOG(LOG_ERROR, "Event loop wait failed");
+    return -1;
+  }
+  for(i = 0; i < rc; i++) {
+    h = get_epoll_handler(events[i].data.u64);
+    if(h == NULL)
+      continue;
+    ev = 0;
+    if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      ev |= EVT_READ;
+    if(events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+      ev |= EVT_WRITE;
+    h->func(loop, h->arg, ev & (h->events | EVT_READ));
+  }
+  run_timers(loop);
+  return 0;
+}
+#else
+void compact_handlers(evt_loop *loop) {
+  int i;
+  int j = 0;
+
+  for(i = 0; i < loop->count; i++) {
+    if(loop->handlers[i] != NULL) {
+      loop->fds[j] = loop->fds[i];
+      loop->handlers[j] = loop->handlers[i];
+      loop->handlers[j]->idx = j;
+      j++;
+    }
+  }
+  loop->count = j;
+  loop->is_dirty = FALSE;
+}
+
+int evt_poll(evt_loop *loop) {
+  evt_handler *h;
+  int count;
+  int rc;
+  int i;
+  int ev;
+  int revents;
+
+  if(loop->is_dirty)
+    compact_handlers(loop);
+  count = loop->count;
+  rc = poll(loop->fds, count, get_timeout(loop));
+  if(rc < 0 && errno != EINTR) {
+    ELOG(LOG_ERROR, "Event loop wait failed");
+    return -1;
+  }
+  for(i = 0; rc > 0 && i < count; i++) {
+    h = loop->handlers[i];
+    revents = loop->fds[i].revents;
+    if(h == NULL || revents == 0)
+      continue;
+    ev = 0;
+    if(revents & (POLLIN | POLLHUP | POLLERR))
+      ev |= EVT_READ;
+    if(revents & (POLLOUT | POLLHUP | POLLERR))
+      ev |= EVT_WRITE;
+    h->func(loop, h->arg, ev & (h->events | EVT_READ));
+  }
+  run_timers(loop);
+  return 0;
+}
+#endif
+
+int evt_run(evt_loop *loop) {
+  int rc = 0;
+
+  LOG_ENTER();
+  while(rc > -1) {
+    rc = evt_poll(loop);
+  }
+  LOG_EXIT();
+  return rc;
+}
@@ -0,0 +1,93 @@
+#ifndef EVT_H
+#define EVT_H 1
+
+/* Linux gets an edge-triggered epoll loop, everyone else a poll() loop.
+ * Handlers are written to drain their descriptor either way.  Building
+ * with USE_IO_URING adds an io_uring loop, with epoll as the fallback
+ * when the kernel will not give us a ring.
+ */
+#if defined(__linux__) && !defined(NO_EPOLL)
+#  define HAVE_EPOLL 1
+#  ifdef USE_IO_URING
+#    define HAVE_IO_URING 1
+#  endif
+#endif
+
+#ifdef HAVE_EPOLL
+#  include <sys/epoll.h>
+#else
+#  include <poll.h>
+#endif
+#ifdef HAVE_IO_URING
+#  include "uring.h"
+#endif
+#include <sys/uio.h>
+
+#define EVT_READ  1
+#define EVT_WRITE 2
+#define EVT_TIMER 4
+
+struct evt_loop;
+
+typedef void (*evt_func)(struct evt_loop *loop, void *arg, int events);
+
+typedef struct evt_handler {
+  struct evt_loop *loop;
+  int fd;
+  int events;
+  evt_func func;
+  void *arg;
+  int idx;
+  unsigned int gen;     // bumped on each add and delete
+#ifdef HAVE_IO_URING
+  uring_io io;
+#endif
+} evt_handler;
+
+typedef struct evt_timer {
+  struct evt_loop *loop;
+  long long when;
+  evt_func func;
+  void *arg;
+  int idx;
+} evt_timer;
+
+typedef struct evt_loop {
+#ifdef HAVE_IO_URING
+  uring_ring ring;
+#endif
+#ifdef HAVE_EPOLL
+  int fd;
+#else
+  struct pollfd *fds;
+  evt_handler **handlers;
+  int count;
+  int size;
+  int reserved;
+  int is_dirty;
+#endif
+  evt_timer **timers;
+  int timer_count;
+  int timer_size;
+  int timer_reserved;
+} evt_loop;
+
+long long evt_now(void);
+int evt_init(evt_loop *loop);
+void evt_init_handler(evt_handler *h);
+void evt_init_timer(evt_timer *t);
+int evt_add(evt_loop *loop, evt_handler *h, int fd, int events, evt_func func, void *arg);
+int evt_reserve(evt_loop *loop, int handlers, int timers);
+int evt_mod(evt_handler *h, int events);
+int evt_del(evt_handler *h);
+int evt_is_async(evt_handler *h);
+int evt_read(evt_handler *h, unsigned char *data, int len);
+int evt_writev(evt_handler *h, struct iovec *iov, int cnt);
+int evt_write_busy(evt_handler *h);
+int evt_write_done(evt_handler *h);
+int evt_timer_set(evt_loop *loop, evt_timer *t, long msec, evt_func func, void *arg);
+void evt_timer_clear(evt_timer *t);
+int evt_poll(evt_loop *loop);
+int evt_run(evt_loop *loop);
+
+#endif
@@ -1,13 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>       // for exit,atoi
 #include <unistd.h>
+#include "banner.h"
 #include "debug.h"
+#include "ip.h"
 #include "phone_book.h"
+#include "pool.h"
+#include "worker.h"
 #include "init.h"
 
 void print_help(char* name) {
   fprintf(stderr, "Usage: %s <parameters>\n", name);
   fprintf(stderr, "  -p   tcp port (or address:port) to listen on (defaults to 6400)\n");
+  fprintf(stderr, "  -b   calls the system may hold before they are accepted (listen backlog)\n");
+  fprintf(stderr, "  -F   turn on TCP fast open for calls, with this many pending (Linux only)\n");
+  fprintf(stderr, "  -G   start a hunt group (name=address[:port][,address[:port]]) for the\n");
+  fprintf(stderr, "       modems that follow; -r, -q, -Q, -B and -U after it apply to the group\n");
+  fprintf(stderr, "  -r   which free modem takes a call: first, rr, lru, traffic or speed\n");
+  fprintf(stderr, "  -q   callers who may wait in line when all modems are busy (defaults to 0)\n");
+  fprintf(stderr, "  -Q   seconds between telling callers in line their place (defaults to never)\n");
+  fprintf(stderr, "  -U   filename to send when no answer, for every modem in the group\n");
   fprintf(stderr, "  -t   trace flags: (can be combined)\n");
   fprintf(stderr, "       'm' = modem input\n");
   fprintf(stderr, "       'M' = modem output\n");
@@ -17,6 +29,9 @@ void print_help(char* name) {
   fprintf(stderr, "       'I' = IP output\n");
   fprintf(stderr, "  -l   0 (NONE), 1 (FATAL) - 7 (DEBUG_X) (defaults to 0)\n");
   fprintf(stderr, "  -L   log file (defaults to stderr)\n");
+  fprintf(stderr, "  -W   number of worker threads to spread modems over (defaults to 1)\n");
+  fprintf(stderr, "  -P   pin each worker thread to its own CPU\n");
+  fprintf(stderr, "  -f   phone book file, one number=replacement per line (reread on SIGHUP)\n");
   fprintf(stderr, "\n");
   fprintf(stderr, "  The following can be repeated for each modem desired\n");
   fprintf(stderr, "  (-s, -S, and -i will apply to any subsequent device if not set again)\n");
@@ -26,6 +41,7 @@ void print_help(char* name) {
   fprintf(stderr, "  -s   serial port speed (defaults to 38400)\n");
   fprintf(stderr, "  -S   speed modem will report (defaults to -s value)\n");
   fprintf(stderr, "  -I   invert DCD pin\n");
+  fprintf(stderr, "  -Z   splice raw 8 bit calls between port and socket (Linux only)\n");
   fprintf(stderr, "  -n   add phone entry (number=replacement)\n");
   fprintf(stderr, "  -a   filename to send to local side upon answer\n");
   fprintf(stderr, "  -A   filename to send to remote side upon answer\n");
@@ -39,14 +55,50 @@ void print_help(char* name) {
   exit(1);
 }
 
-int init(int argc,
-         char **argv,
-         modem_config cfg[],
-         int max_modem,
-         char **ip_addr, 
-         char *all_busy,
-         int all_busy_len
-         ) {
+/*
+ * Banner files are read once, before any call comes in.
+ */
+char *add_banner(char *name) {
+  if(-1 == bnr_add(name)) {
+    LOG(LOG_FATAL, "Could not keep banner %s", name);
+    exit(-1);
+  }
+  return name;
+}
+
+/*
+ * Makes room for modem i in the list, which grows as needed.
+ */
+modem_config **add_modem(modem_config **cfg, int *size, int i) {
+  modem_config **list = cfg;
+
+  if(i == *size) {
+    list = realloc(cfg, *size * 2 * sizeof(modem_config *));
+    if(list == NULL) {
+      LOG(LOG_FATAL, "Could not allocate modem list");
+      exit(-1);
+    }
+    *size *= 2;
+  }
+  list[i] = calloc(1, sizeof(modem_config));
+  if(list[i] == NULL) {
+    LOG(LOG_FATAL, "Could not allocate modem #%d", i);
+    exit(-1);
+  }
+  return list;
+}
+
+/*
+ * Returns the modems the command line asks for, count of them.  Each is
+ * allocated on its own, so they never move once the workers have them.
+ */
+modem_config **init(int argc,
+                    char **argv,
+                    int *count,
+                    char **ip_addr
+                   ) {
+  modem_config **cfg = NULL;
+  int size = 16;
   int i = 0;
   int j = 0;
   int opt = 0;
@@ -56,12 +108,18 @@ int init(int argc,
   int tty_set = FALSE;
 
   LOG_ENTER();
-  mdm_init_config(&cfg[0]);
-  cfg[0].dce_data.port_speed = 38400;
-  cfg[0].line_speed = 38400;
+  cfg = malloc(size * sizeof(modem_config *));
+  if(cfg == NULL) {
+    LOG(LOG_FATAL, "Could not allocate modem list");
+    exit(-1);
+  }
+  cfg = add_modem(cfg, &size, 0);
+  mdm_init_config(cfg[0]);
+  cfg[0]->dce_data.port_speed = 38400;
+  cfg[0]->line_speed = 38400;
 
-  while(opt>-1 && i < max_modem) {
-    opt=getopt(argc, argv, "p:s:S:d:v:hw:i:Il:L:t:n:a:A:c:C:N:B:T:D:");
+  while(opt>-1) {
+    opt=getopt(argc, argv, "p:b:F:G:r:q:Q:U:s:S:d:v:hw:i:Il:L:t:n:f:a:A:c:C:N:B:T:D:W:PZ");
     switch(opt) {
       case 't':
         trace_flags = log_get_trace_flags();
@@ -90,40 +148,76 @@ int init(int argc,
         }
         break;
       case 'a':
-        strncpy(cfg[i].local_answer, optarg, sizeof(cfg[i].local_answer));
+        cfg[i]->local_answer = add_banner(optarg);
         break;
       case 'A':
-        strncpy(cfg[i].remote_answer, optarg, sizeof(cfg[i].remote_answer));
+        cfg[i]->remote_answer = add_banner(optarg);
         break;
       case 'c':
-        strncpy(cfg[i].local_connect, optarg, sizeof(cfg[i].local_connect));
+        cfg[i]->local_connect = add_banner(optarg);
         break;
       case 'C':
-        strncpy(cfg[i].remote_connect, optarg, sizeof(cfg[i].remote_connect));
+        cfg[i]->remote_connect = add_banner(optarg);
         break;
       case 'B':
-        strncpy(all_busy, optarg, all_busy_len);
+        pool_set_busy(add_banner(optarg));
+        break;
+      case 'G':
+        tok = strchr(optarg, '=');
+        if(tok == NULL || tok == optarg || tok[1] == 0) {
+          print_help(argv[0]);
+        }
+        *tok++ = 0;
+        if(-1 == pool_add_group(optarg, tok)) {
+          LOG(LOG_FATAL, "Could not add hunt group %s", optarg);
+          exit(-1);
+        }
         break;
       case 'N':
-        strncpy(cfg[i].no_answer, optarg, sizeof(cfg[i].no_answer));
+        cfg[i]->no_answer = add_banner(optarg);
+        break;
+      case 'U':
+        pool_set_no_answer(add_banner(optarg));
         break;
       case 'T':
-        strncpy(cfg[i].inactive, optarg, sizeof(cfg[i].inactive));
+        cfg[i]->inactive = optarg;
         break;
       case 'i':
-        strncpy(cfg[i].cur_line, optarg, sizeof(cfg[i].cur_line));
-        cfg[i].cur_line_idx = strlen(cfg[i].cur_line);
+        strncpy(cfg[i]->cur_line, optarg, sizeof(cfg[i]->cur_line));
+        cfg[i]->cur_line_idx = strlen(cfg[i]->cur_line);
         break;
       case 'I':
-        cfg[i].invert_dcd = TRUE;
+        cfg[i]->invert_dcd = TRUE;
+        break;
+      case 'Z':
+        cfg[i]->use_splice = TRUE;
         break;
       case 'p':
         *ip_addr = optarg;
         break;
+      case 'b':
+        ip_set_backlog(atoi(optarg));
+        break;
+      case 'F':
+        ip_set_fastopen(atoi(optarg));
+        break;
+      case 'r':
+        if(-1 == pool_set_policy(optarg))
+          print_help(argv[0]);
+        break;
+      case 'q':
+        pool_set_line(atoi(optarg));
+        break;
+      case 'Q':
+        pool_set_hold_interval(atoi(optarg));
+        break;
       case 'n':
         tok = strtok(optarg, "=");
         pb_add(tok, strtok(NULL, "="));
         break;
+      case 'f':
+        pb_set_file(optarg);
+        break;
       case 'l':
         log_set_level(atoi(optarg));
         break;
@@ -131,11 +225,17 @@ int init(int argc,
         log_set_file(fopen(optarg, "w+"));
         // should check to see if an error occurred...
         break;
+      case 'W':
+        wkr_set_count(atoi(optarg));
+        break;
+      case 'P':
+        wkr_set_pinning(TRUE);
+        break;
       case 's':
-        cfg[i].dce_data.port_speed = atoi(optarg);
-        LOG(LOG_ALL, "Setting DTE speed to %d", cfg[i].dce_data.port_speed);
+        cfg[i]->dce_data.port_speed = atoi(optarg);
+        LOG(LOG_ALL, "Setting DTE speed to %d", cfg[i]->dce_data.port_speed);
         if(dce_set == FALSE)
-          cfg[i].line_speed = cfg[i].dce_data.port_speed;
+          cfg[i]->line_speed = cfg[i]->dce_data.port_speed;
         break;
       case '?':
       case 'h':
@@ -144,43 +244,39 @@ int init(int argc,
       case 'd':
       case 'v':
         if (tty_set) {
-          if (++i < max_modem) {
-            dce_set = FALSE;
-            mdm_init_config(&cfg[i]);
-            cfg[i].dce_data.port_speed = cfg[i - 1].dce_data.port_speed;
-            cfg[i].line_speed = cfg[i - 1].line_speed;
-            cfg[i].dce_data.is_ip232 = FALSE;
-            strncpy((char *)cfg[i].cur_line, (char *)cfg[i - 1].cur_line, sizeof(cfg[i].cur_line));
-            strncpy((char *)cfg[i].local_connect, (char *)cfg[i - 1].local_connect, sizeof(cfg[i].local_connect));
-            strncpy((char *)cfg[i].remote_connect, (char *)cfg[i - 1].remote_connect, sizeof(cfg[i].remote_connect));
-            strncpy((char *)cfg[i].local_answer, (char *)cfg[i - 1].local_answer, sizeof(cfg[i].local_answer));
-            strncpy((char *)cfg[i].remote_answer, (char *)cfg[i - 1].remote_answer, sizeof(cfg[i].remote_answer));
-            strncpy((char *)cfg[i].no_answer, (char *)cfg[i - 1].no_answer, sizeof(cfg[i].no_answer));
-            strncpy((char *)cfg[i].inactive, (char *)cfg[i - 1].inactive, sizeof(cfg[i].inactive));
-          } else {
-            LOG(LOG_WARN, "Maximum modems defined - ignoring extra");
-            break;
-          }
+          cfg = add_modem(cfg, &size, ++i);
+          dce_set = FALSE;
+          mdm_init_config(cfg[i]);
+          cfg[i]->dce_data.port_speed = cfg[i - 1]->dce_data.port_speed;
+          cfg[i]->line_speed = cfg[i - 1]->line_speed;
+          cfg[i]->dce_data.is_ip232 = FALSE;
+          strncpy((char *)cfg[i]->cur_line, (char *)cfg[i - 1]->cur_line, sizeof(cfg[i]->cur_line));
+          cfg[i]->local_connect = cfg[i - 1]->local_connect;
+          cfg[i]->remote_connect = cfg[i - 1]->remote_connect;
+          cfg[i]->local_answer = cfg[i - 1]->local_answer;
+          cfg[i]->remote_answer = cfg[i - 1]->remote_answer;
+          cfg[i]->no_answer = cfg[i - 1]->no_answer;
+          cfg[i]->inactive = cfg[i - 1]->inactive;
         }
-        strncpy((char *)cfg[i].dce_data.tty, optarg, sizeof(cfg[i].dce_data.tty));
+        strncpy((char *)cfg[i]->dce_data.tty, optarg, sizeof(cfg[i]->dce_data.tty));
         LOG(LOG_ALL, "Setting TTY to %s", optarg);
-        cfg[i].dce_data.is_ip232 = ('v' == opt);
+        cfg[i]->dce_data.is_ip232 = ('v' == opt);
+        cfg[i]->pool_id = pool_get_group();
         tty_set = TRUE;
         break;
       case 'S':
-        cfg[i].line_speed = atoi(optarg);
+        cfg[i]->line_speed = atoi(optarg);
         dce_set = TRUE;
         break;
       case 'D':
-        cfg[i].direct_conn = TRUE;
-        strncpy(cfg[i].direct_conn_num, optarg, sizeof(cfg[i].direct_conn_num));
+        cfg[i]->direct_conn = TRUE;
+        cfg[i]->direct_conn_num = optarg;
         break;
     }
   }
 
   if (tty_set) {
-    if (i < max_modem)
-      i++;
+    i++;
   } else {
     // no modems defined
     LOG(LOG_FATAL, "No modems defined");
@@ -190,5 +286,6 @@ int init(int argc,
   LOG(LOG_DEBUG, "Read configuration for %i serial port(s)", i);
 
   LOG_EXIT();
-  return i;
+  *count = i;
+  return cfg;
 }
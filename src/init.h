@@ -6,12 +6,9 @@
 #include "modem_core.h"
 
 void print_help(char *name);
-int init(int argc,
-         char **argv,
-         modem_config cfg[], 
-         int max_modem, 
-         char **ip_addr,
-         char *all_busy,
-         int all_busy_len
-        );
+modem_config **init(int argc,
+                    char **argv,
+                    int *count,
+                    char **ip_addr
+                   );
 
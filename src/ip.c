@@ -1,25 +1,122 @@
+#ifdef __linux__
+#define _GNU_SOURCE       // for accept4
+#endif
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>  // for TCP_FASTOPEN
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>       // for read...
 #include <stdlib.h>       // for atoi...
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
 
+#include "util.h"
 #include "debug.h"
 #include "ip.h"
 
-const int BACK_LOG = 5;
+const int BACK_LOG = 5;      // for ports with one caller, like ip232
 
-int ip_init_server_conn(char *ip) {
-  int port;
-  char *ip_addr = NULL;
+int ip_backlog = SOMAXCONN;  // for the port modems take calls on
+int ip_fastopen = 0;
+
+void ip_set_backlog(int backlog) {
+  if(backlog > 0)
+    ip_backlog = backlog;
+}
+
+void ip_set_fastopen(int qlen) {
+  ip_fastopen = qlen;
+}
+
+/*
+ * Splits addr ("host", "host:port", "[v6 address]:port" or a bare v6
+ * address) into host and port.  port is left alone if addr has none.
+ */
+int ip_parse(char *addr, char *host, int len, int *port) {
+  char *end;
+  char *colon;
+  int host_len;
+
+  if(addr[0] == '[' && NULL != (end = strchr(addr, ']'))) {
+    addr++;
+    host_len = end - addr;
+    colon = (end[1] == ':' ? end + 1 : NULL);
+  } else {
+    colon = strchr(addr, ':');
+    if(colon != NULL && strchr(colon + 1, ':') != NULL)
+      colon = NULL;   // more than one, so an address with no port
+    host_len = (colon != NULL ? colon - addr : (int)strlen(addr));
+  }
+  if(host_len > len - 1)
+    host_len = len - 1;
+  memcpy(host, addr, host_len);
+  host[host_len] = 0;
+  if(colon != NULL && colon[1] != 0)
+    *port = atoi(colon + 1);
+  return 0;
+}
+
+/*
+ * Fills in the address to listen on: host if there is one, or else any
+ * address of the family asked for.
+ */
+int get_server_addr(char *host, int family, int port, struct sockaddr_storage *addr, socklen_t *len) {
+  struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+  struct addrinfo hints;
+  struct addrinfo *res;
+  int rc;
+
+  memset(addr, 0, sizeof(*addr));
+  if(host[0] != 0) {
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if(0 != (rc = getaddrinfo(host, NULL, &hints, &res))) {
+      LOG(LOG_FATAL, "Could not look up %s: %s", host, gai_strerror(rc));
+      return -1;
+    }
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+    LOG(LOG_DEBUG, "Using specified ip address %s", host);
+  } else if(family == AF_INET6) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_addr = in6addr_any;
+    *len = sizeof(*sin6);
+  } else {
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(INADDR_ANY);
+    *len = sizeof(*sin);
+  }
+  /* network-order */
+  if(addr->ss_family == AF_INET6) {
+    sin6->sin6_port = htons(port);
+  } else {
+    sin->sin_port = htons(port);
+  }
+  return 0;
+}
+
+/*
+ * Listens on ip ("port", or an address and port as for ip_parse).  With
+ * no address, one IPv6 socket takes IPv4 calls too, if the host has
+ * IPv6 at all.  If is_shared, more sockets may listen on the same port
+ * and the kernel spreads calls over them.
+ */
+int init_listener(char *ip, int backlog, int fastopen, int is_shared) {
+  char host[256] = "";
+  int port = 0;
   int sSocket = 0, on = 0, rc = 0;
-  struct sockaddr_in serverName = { 0 };
+  struct sockaddr_storage serverName;
+  socklen_t len = 0;
 
-  if (strstr(ip, ":") > 0) {
-    ip_addr = strtok(ip, ":");
-    port = (atoi(strtok(NULL, ":")));
+  if (strchr(ip, ':') != NULL) {
+    ip_parse(ip, host, sizeof(host), &port);
   } else {
     port = (atoi(ip));
   }
@@ -29,7 +126,16 @@ int ip_init_server_conn(char *ip) {
 
   LOG(LOG_DEBUG, "Creating server socket");
 
-  sSocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if(0 > get_server_addr(host, AF_INET6, port, &serverName, &len)) {
+    LOG_EXIT();
+    return -1;
+  }
+  sSocket = socket(serverName.ss_family, SOCK_STREAM, IPPROTO_TCP);
+  if(-1 == sSocket && host[0] == 0) {
+    LOG(LOG_INFO, "No IPv6 here, listening for IPv4 calls only");
+    get_server_addr(host, AF_INET, port, &serverName, &len);
+    sSocket = socket(serverName.ss_family, SOCK_STREAM, IPPROTO_TCP);
+  }
   if (-1 == sSocket) {
     ELOG(LOG_FATAL, "Server socket could not be created");
   } else {
@@ -53,32 +159,48 @@ int ip_init_server_conn(char *ip) {
       ELOG(LOG_ERROR, "bind address checking could not be turned off");
     }
 
-    if(ip_addr != NULL) { /* gwb */
-      serverName.sin_addr.s_addr = inet_addr(ip_addr);
-      LOG(LOG_DEBUG, "Using specified ip address %s", ip_addr);
-    } else {
-      serverName.sin_addr.s_addr = htonl(INADDR_ANY);
+    if(is_shared) {
+#ifdef SO_REUSEPORT
+      if(-1 == setsockopt(sSocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+        ELOG(LOG_WARN, "Server socket port could not be shared");
+      }
+#endif
     }
-    serverName.sin_family = AF_INET;
 
-    /* network-order */
-    serverName.sin_port = htons(port);
+    if(serverName.ss_family == AF_INET6 && host[0] == 0) {
+      // some systems default to IPv6 only
+      on = 0;
+      if(-1 == setsockopt(sSocket, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on))) {
+        ELOG(LOG_WARN, "Server socket will only take IPv6 calls");
+      }
+    }
 
     LOG(LOG_DEBUG, "Binding server socket to port %d", port);
     rc = bind(sSocket,
               (struct sockaddr *) &serverName,
-              sizeof(serverName)
+              len
              );
     if (-1 == rc) {
       ELOG(LOG_FATAL, "Server socket could not be bound to port");
+      close(sSocket);
       sSocket = -1;
     } else {
       LOG(LOG_INFO, "Server socket bound to port");
 
-      rc = listen(sSocket, BACK_LOG);
+      if(fastopen > 0) {
+#ifdef TCP_FASTOPEN
+        if(-1 == setsockopt(sSocket, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen))) {
+          ELOG(LOG_WARN, "TCP fast open could not be turned on");
+        }
+#else
+        LOG(LOG_WARN, "TCP fast open is not supported here");
+#endif
+      }
+      rc = listen(sSocket, backlog);
       LOG(LOG_INFO, "Server socket listening for connections");
       if (-1 == rc) {
         ELOG(LOG_FATAL, "Server socket could not listen on port");
+        close(sSocket);
         sSocket = -1;
       }
     }
@@ -87,70 +209,101 @@ int ip_init_server_conn(char *ip) {
   return sSocket;
 }
 
-int ip_connect(char *ip) {
-  struct sockaddr_in pin;
-  struct in_addr cin_addr;
-  struct hostent *hp;
-  int sd = 0;
-  int port = 23;
-  char *address;
-  char *tmp;
-
-  LOG_ENTER();
-  address = strtok(ip, ":");
-  tmp = strtok(NULL, ":");
-  if(tmp != NULL && strlen(tmp) > 0) {
-    port = atoi(tmp);
-  }
+int ip_init_server_conn(char *ip) {
+  return init_listener(ip, BACK_LOG, 0, FALSE);
+}
 
-  LOG(LOG_DEBUG, "Calling %s", ip);
-  memset(&pin, 0, sizeof(pin));
+/*
+ * Listens for calls to the modems, on a port each accept thread can
+ * share.
+ */
+int ip_init_call_conn(char *ip) {
+  return init_listener(ip, ip_backlog, ip_fastopen, TRUE);
+}
 
-  /* go find out about the desired host machine */
-  if((hp = gethostbyname(address)) == 0) {
-    // well, not a DNS entry... Treat as IP...
-    if(1 != inet_aton(address, &cin_addr)) {
-      ELOG(LOG_ERROR, "Host %s was invalid", ip);
-      return -1;
-    }
-  } else {
-    cin_addr = *((struct in_addr *)(hp->h_addr));
+/*
+ * Puts addr in text form into buf, for logging.
+ */
+char *ip_get_name(struct sockaddr *addr, socklen_t len, char *buf, int size) {
+  if(0 != getnameinfo(addr, len, buf, size, NULL, 0, NI_NUMERICHOST)) {
+    strncpy(buf, "unknown address", size - 1);
+    buf[size - 1] = 0;
   }
+  return buf;
+}
 
-  pin.sin_family = AF_INET;
-  pin.sin_addr.s_addr = cin_addr.s_addr;
-  pin.sin_port = htons(port);
+/*
+ * Starts a call to addr (see dns_lookup) without waiting for the far
+ * end.  The socket turns writable once ip_connect_done can say how it
+ * went.
+ */
+int ip_connect(struct sockaddr *addr, socklen_t len) {
+  char name[NI_MAXHOST];
+  int sd = 0;
 
+  LOG_ENTER();
+  LOG(LOG_DEBUG, "Connecting to %s", ip_get_name(addr, len, name, sizeof(name)));
   /* grab an Internet domain socket */
-  if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+  if ((sd = socket(addr->sa_family, SOCK_STREAM, 0)) == -1) {
     ELOG(LOG_ERROR, "could not create client socket");
     return -1;
   }
 
-  /* connect to PORT on HOST */
-  if (connect(sd, (struct sockaddr *)&pin, sizeof(pin)) == -1) {
+  /* connect to PORT on HOST, leaving the handshake to the kernel */
+  if (fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) < 0
+      || (connect(sd, addr, len) == -1
+          && errno != EINPROGRESS)) {
     ELOG(LOG_ERROR, "could not connect to address");
+    close(sd);
     return -1;
   }
-  LOG(LOG_INFO, "Connection to %s established", ip);
   LOG_EXIT();
   return sd;
 }
 
+/*
+ * Returns 0 if the call started by ip_connect went through, or -1 with
+ * errno saying why it did not.
+ */
+int ip_connect_done(int sd) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if(getsockopt(sd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+    return -1;
+  if(err != 0) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * As ip_accept_call, for the ip232 listeners.
+ */
 int ip_accept(int sSocket) {
-  struct sockaddr_in clientName = { 0 };
+  struct sockaddr_storage clientName;
   socklen_t clientLength = sizeof(clientName);
+  char name[NI_MAXHOST];
   int cSocket = -1;
+  int err;
 
   LOG_ENTER();
   (void) memset(&clientName, 0, sizeof(clientName));
 
-  cSocket = accept(sSocket,
-                   (struct sockaddr *)&clientName, 
-                   &clientLength
-                  );
+  do {
+    clientLength = sizeof(clientName);
+    cSocket = accept(sSocket,
+                     (struct sockaddr *)&clientName, 
+                     &clientLength
+                    );
+  } while(-1 == cSocket && (errno == EINTR || errno == ECONNABORTED));
   if (-1 == cSocket) {
-    ELOG(LOG_ERROR, "Could not accept incoming connection");
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+      err = errno;
+      ELOG(LOG_ERROR, "Could not accept incoming connection");
+      errno = err;
+    }
     return -1;
   }
 
@@ -162,13 +315,57 @@ int ip_accept(int sSocket) {
   } else {
     LOG(LOG_INFO, 
         "Connection accepted from %s",
-        inet_ntoa(clientName.sin_addr)
+        ip_get_name((struct sockaddr *)&clientName, clientLength, name, sizeof(name))
        );
   }
   LOG_EXIT();
   return cSocket;
 }
 
+/*
+ * Accepts a call for an accept thread, which hands it to a worker.  The
+ * socket comes back non-blocking and closed on exec, and addr says who
+ * called.  Calls that hung up before they were accepted are skipped, so
+ * -1 with errno EAGAIN means none are left, and any other errno that
+ * the rest must wait (for a free descriptor, most likely).
+ */
+int ip_accept_call(int sSocket, struct sockaddr_storage *addr, socklen_t *len) {
+  char name[NI_MAXHOST];
+  int cSocket;
+  int err;
+
+  do {
+    *len = sizeof(*addr);
+#ifdef __linux__
+    cSocket = accept4(sSocket, (struct sockaddr *)addr, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    cSocket = accept(sSocket, (struct sockaddr *)addr, len);
+#endif
+  } while(-1 == cSocket && (errno == EINTR || errno == ECONNABORTED));
+#ifndef __linux__
+  if(cSocket > -1
+     && (-1 == fcntl(cSocket, F_SETFL, fcntl(cSocket, F_GETFL) | O_NONBLOCK)
+         || -1 == fcntl(cSocket, F_SETFD, FD_CLOEXEC))) {
+    ELOG(LOG_ERROR, "Could not set up incoming connection");
+    close(cSocket);
+    return -1;
+  }
+#endif
+  if (-1 == cSocket) {
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+      err = errno;
+      ELOG(LOG_ERROR, "Could not accept incoming connection");
+      errno = err;
+    }
+    return -1;
+  }
+  LOG(LOG_INFO,
+      "Connection accepted from %s",
+      ip_get_name((struct sockaddr *)addr, *len, name, sizeof(name))
+     );
+  return cSocket;
+}
+
 int ip_disconnect(int fd) {
   if(fd > -1)
     close(fd);
@@ -177,7 +374,7 @@ int ip_disconnect(int fd) {
 
 int ip_write(int fd, unsigned char *data, int len) {
   log_trace(TRACE_IP_OUT, data, len);
-  return write(fd, data, len);
+  return writeAll(fd, data, len);
 }
 
 int ip_read(int fd, unsigned char *data, int len) {
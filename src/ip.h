@@ -1,15 +1,27 @@
 #ifndef IP_H
 #define IP_H
 
+#include <sys/types.h>
+#include <sys/socket.h>
+
 #ifndef TRUE
 #define TRUE 1
 #define FALSE 0
 #endif
 
+#define IP_ACCEPT_BACKOFF 100   // ms before accepting again, after running out of descriptors
+
+void ip_set_backlog(int backlog);
+void ip_set_fastopen(int qlen);
 int ip_init(void);
+int ip_parse(char *addr, char *host, int len, int *port);
 int ip_init_server_conn(char *ip);
-int ip_connect(char *ip);
+int ip_init_call_conn(char *ip);
+char *ip_get_name(struct sockaddr *addr, socklen_t len, char *buf, int size);
+int ip_connect(struct sockaddr *addr, socklen_t len);
+int ip_connect_done(int sd);
 int ip_accept(int sSocket);
+int ip_accept_call(int sSocket, struct sockaddr_storage *addr, socklen_t *len);
 int ip_disconnect(int fd);
 int ip_write(int fd, unsigned char *data, int len);
 int ip_read(int fd, unsigned char *data, int len);
@@ -6,61 +6,38 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
-#include <pthread.h>
+#include <errno.h>
 
 #include "util.h"
 #include "debug.h"
 #include "dce.h"
 #include "ip.h"
+#include "nvt.h"
 #include "ip232.h"
 
-void *ip232_thread(void *arg) {
-  dce_config *cfg = (dce_config *)arg;
+/*
+ * Returns -1 if connections are still waiting but cannot be taken yet.
+ */
+int ip232_accept(dce_config *cfg) {
   int rc;
-  unsigned char buf[256];
-
-  fd_set readfs;
-  int max_fd = 0;
 
   LOG_ENTER();
-  for (;;) {
-    FD_ZERO(&readfs);
-    FD_SET(cfg->dp[1][0], &readfs);
-    max_fd = cfg->dp[1][0];
-    FD_SET(cfg->sSocket, &readfs);
-    max_fd = MAX(max_fd, cfg->sSocket);
-    LOG(LOG_ALL, "Waiting for incoming ip232 connections");
-    rc = select(max_fd + 1, &readfs, NULL, NULL, NULL);
-
-    if (rc < 0) {
-      // handle error
+  // the listener is non-blocking, take everything that is waiting
+  while((rc = ip_accept(cfg->sSocket)) > -1) {
+    if(cfg->is_connected) {
+      LOG(LOG_DEBUG, "Already have ip232 connection, rejecting new");
+      close(rc);
     } else {
-      if (FD_ISSET(cfg->dp[1][0], &readfs)) {  // pipe
-        rc = read(cfg->dp[1][0], buf, sizeof(buf) - 1);
-        LOG(LOG_DEBUG, "ip232 thread notified");
-      }
-      if (FD_ISSET(cfg->sSocket, &readfs)) {  // ip connection
-        if(cfg->is_connected) {
-          LOG(LOG_DEBUG, "Already have ip232 connection, rejecting new");
-          // already have a connection... accept and close
-          rc = ip_accept(cfg->sSocket);
-          if(rc > -1) {
-            close(rc);
-          }
-        } else {
-          LOG(LOG_DEBUG, "Incoming ip232 connection");
-          rc = ip_accept(cfg->sSocket);
-          if(rc > -1) {
-            cfg->fd = rc;
-            cfg->is_connected = TRUE;
-            cfg->ip232_dtr = FALSE;
-            cfg->ip232_dcd = FALSE;
-          }
-        }
-      }
+      LOG(LOG_DEBUG, "Incoming ip232 connection");
+      cfg->fd = rc;
+      cfg->is_connected = TRUE;
+      cfg->ip232_dtr = FALSE;
+      cfg->ip232_dcd = FALSE;
     }
   }
+  rc = (errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
   LOG_EXIT();
+  return rc;
 }
 
 int ip232_init_conn(dce_config *cfg) {
@@ -74,19 +51,9 @@ int ip232_init_conn(dce_config *cfg) {
     ELOG(LOG_FATAL, "Could not initialize ip232 server socket");
     exit(-1);
   }
-  if(-1 == pipe(cfg->dp[0])) {
-    ELOG(LOG_FATAL, "ip232 thread incoming IPC pipe could not be created");
-    exit(-1);
-  }
-
-  if(-1 == pipe(cfg->dp[1])) {
-    ELOG(LOG_FATAL, "ip232 thread outgoing IPC pipe could not be created");
-    exit(-1);
-  }
 
   cfg->sSocket = rc;
   cfg->is_connected = FALSE;
-  spawn_thread(ip232_thread, (void *)cfg, "IP232");
   LOG(LOG_INFO, "ip232 device configured");
   LOG_EXIT();
   return 0;
@@ -122,7 +89,7 @@ int ip232_set_control_lines(dce_config *cfg, int state) {
       LOG(LOG_DEBUG, "Sending data");
       cmd[0] = 255;
       cmd[1] = dcd ? 1 : 0;
-      write(cfg->fd, cmd, sizeof(cmd));
+      dce_send(cfg, cmd, sizeof(cmd));
     }
   }
   return 0;
@@ -131,65 +98,64 @@ int ip232_set_control_lines(dce_config *cfg, int state) {
 int ip232_write(dce_config *cfg, unsigned char* data, int len) {
   int retval;
   int i = 0;
-  int double_iac = FALSE;
-  unsigned char text[1024];
-  int text_len = 0;
+  struct iovec iov[64];
+  int cnt;
+  int used;
 
   log_trace(TRACE_MODEM_OUT, data, len);
   retval = len;
   if (cfg->is_connected) {
-    while(i < len) {
-      if (double_iac) {
-        text[text_len++] = 255;
-        double_iac = FALSE;
-        i++;
-      } else {
-        if(255 == data[i]) {
-          text[text_len++] = 255;
-          double_iac = TRUE;
-        } else {
-          text[text_len++] = data[i++];
-        }
-      }
-
-      if(text_len == sizeof(text)) {
-        retval = write(cfg->fd, text, text_len);
-        text_len = 0;
-      }
-    }
-    if(text_len) {
-      retval = write(cfg->fd, text, text_len);
+    // 255 is doubled on the wire, just like a telnet IAC
+    while(i < len && retval > -1) {
+      cnt = nvt_escape_iac(data + i, len - i, iov, sizeof(iov) / sizeof(iov[0]), &used);
+      retval = dce_sendv(cfg, iov, cnt);
+      i += used;
     }
   }
   return retval;
 }
 
+int ip232_get_pending(dce_config *cfg) {
+  int pending = 0;
+
+  if (cfg->is_connected) {
+    if(0 > ioctl(cfg->fd, FIONREAD, &pending)) {
+      ELOG(LOG_WARN, "Could not obtain ip232 socket input backlog");
+      return -1;
+    }
+  }
+  return pending;
+}
+
 int ip232_read(dce_config *cfg, unsigned char *data, int len) {
   int res;
-  //int rc;
-  unsigned char buf[256];
   int i = 0;
   unsigned char ch;
   int text_len = 0;
 
   LOG_ENTER();
-  if (len > sizeof(buf)) {
-    LOG(LOG_FATAL, "ip232_read: len > sizeof(buf)");
-    exit(-1);
-  }
-
   if (cfg->is_connected) {
-    res = recv(cfg->fd, buf, len, 0);
-    if (0 >= res) {
+    // read straight into the caller's buffer, unescaping in place.
+    if(evt_is_async(&cfg->evt)) {
+      res = evt_read(&cfg->evt, data, len);
+    } else {
+      res = recv(cfg->fd, data, len, 0);
+    }
+    cfg->is_read_full = (res == len);
+    if (0 > res && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      text_len = -1;  // nothing waiting
+    } else if (0 >= res) {
       LOG(LOG_INFO, "No ip232 socket data read, assume closed peer");
+      evt_del(&cfg->evt);
       ip_disconnect(cfg->fd);
+      ring_clear(&cfg->out);
       cfg->is_connected = FALSE;
     } else {
       LOG(LOG_DEBUG, "Read %d bytes from ip232 socket", res);
-      log_trace(TRACE_MODEM_IN, buf, res);
+      log_trace(TRACE_MODEM_IN, data, res);
 
       while(i < res) {
-        ch = buf[i];
+        ch = data[i];
         if (cfg->ip232_iac) {
           cfg->ip232_iac = FALSE;
           switch (ch) {
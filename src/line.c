@@ -1,3 +1,11 @@
+#include <stdio.h>
+#include <stdlib.h>       // for atoi...
+#include <string.h>
+#include <poll.h>
+#include <errno.h>
+#include <netinet/in.h>
+
+#include "banner.h"
 #include "debug.h"
 #include "modem_core.h"
 #include "phone_book.h"
@@ -8,34 +16,166 @@
 
 void reset_config(line_config *cfg) {
   cfg->fd = -1;
+  cfg->targets = 0;
+  cfg->target_timed = 0;
+  cfg->dial_count = 0;
+  cfg->dial_timed = 0;
   cfg->is_telnet = FALSE;
   cfg->is_data_received = FALSE;
   cfg->is_connected = FALSE;
+  cfg->is_connecting = FALSE;
   nvt_init_config(&cfg->nvt_data);
 }
 
 void line_init_config(line_config *cfg) {
+  evt_init_handler(&cfg->evt);
+  cfg->dial = NULL;
+  cfg->spare = NULL;
+  cfg->resolved = NULL;
+  cfg->resolved_arg = NULL;
+  evt_init_timer(&cfg->dial_timer);
+  evt_init_timer(&cfg->target_timer);
+  ring_init(&cfg->out);
+  spl_init_config(&cfg->pipe);
+  cfg->banner_count = 0;
+  cfg->banner_pos = 0;
   reset_config(cfg);
 }
 
 int line_read(line_config *cfg, unsigned char *data, int len) {
+  int res;
 
+  if(evt_is_async(&cfg->evt)) {
+    // the loop has already read it, or is waiting to
+    res = evt_read(&cfg->evt, data, len);
+    if(0 < res)
+      log_trace(TRACE_IP_IN, data, res);
+    return res;
+  }
   // should do escaping in here, like we do for writes below
   return ip_read(cfg->fd, data, len);
 }
 
+int get_banner_len(line_config *cfg) {
+  int len = 0;
+  int i;
+
+  for(i = 0; i < cfg->banner_count; i++) {
+    len += cfg->banner[i]->len;
+  }
+  return len - cfg->banner_pos;
+}
+
+/*
+ * Moves as much of the waiting banners into out as it has room for, so
+ * a banner is never copied whole, and is only read on as the socket
+ * takes it.  Returns the banner bytes still waiting.
+ */
+int feed_banners(line_config *cfg) {
+  bnr_text *t;
+  int n;
+
+  while(cfg->banner_count > 0) {
+    t = cfg->banner[0];
+    n = ring_put(&cfg->out, t->data + cfg->banner_pos, t->len - cfg->banner_pos);
+    log_trace(TRACE_IP_OUT, t->data + cfg->banner_pos, n);
+    cfg->banner_pos += n;
+    if(cfg->banner_pos < t->len)
+      break;
+    bnr_put(t);
+    cfg->banner_count--;
+    memmove(&cfg->banner[0], &cfg->banner[1], cfg->banner_count * sizeof(bnr_text *));
+    cfg->banner_pos = 0;
+  }
+  return get_banner_len(cfg);
+}
+
+/*
+ * Writes what the socket will take of out and the banners behind it, and
+ * leaves the rest for write events.  Returns the bytes still waiting, or
+ * -1 if the socket failed.
+ */
+int send_banners(line_config *cfg) {
+  int rc;
+
+  do {
+    feed_banners(cfg);
+    rc = ring_push(&cfg->out, &cfg->evt, cfg->fd);
+  } while(rc == 0 && cfg->banner_count > 0);
+  return (rc < 0 ? -1 : rc + get_banner_len(cfg));
+}
+
+void drop_banners(line_config *cfg) {
+  while(cfg->banner_count > 0) {
+    bnr_put(cfg->banner[--cfg->banner_count]);
+  }
+  cfg->banner_pos = 0;
+}
+
+/*
+ * Sends data as is, queueing what the socket will not take right now.
+ * While a banner is waiting, out is kept full with it, so data only gets
+ * in once the banner has.
+ */
+int line_send(line_config *cfg, unsigned char *data, int len) {
+  log_trace(TRACE_IP_OUT, data, len);
+  if(cfg->banner_count > 0) {
+    feed_banners(cfg);
+    return ring_queue(&cfg->out, &cfg->evt, cfg->fd, data, len);
+  }
+  if(spl_drain(&cfg->pipe, cfg->fd) > 0) {
+    return ring_queue(&cfg->out, &cfg->evt, cfg->fd, data, len);
+  }
+  return ring_send(&cfg->out, &cfg->evt, cfg->fd, data, len);
+}
+
+int line_sendv(line_config *cfg, struct iovec *iov, int cnt) {
+  int len = 0;
+  int i;
+
+  if(cfg->banner_count > 0 || spl_drain(&cfg->pipe, cfg->fd) > 0) {
+    // telnet turned up after splicing started, queue behind it
+    for(i = 0; i < cnt; i++) {
+      if(0 > line_send(cfg, iov[i].iov_base, iov[i].iov_len))
+        return -1;
+      len += iov[i].iov_len;
+    }
+    return len;
+  }
+  for(i = 0; i < cnt; i++) {
+    log_trace(TRACE_IP_OUT, iov[i].iov_base, iov[i].iov_len);
+  }
+  return ring_sendv(&cfg->out, &cfg->evt, cfg->fd, iov, cnt);
+}
+
+/*
+ * Moves up to len bytes from fd to the socket without copying them, see
+ * spl_fill for the return value.
+ */
+int line_splice(line_config *cfg, int fd, int len) {
+  int res;
+
+  res = spl_fill(&cfg->pipe, fd, len);
+  if(res > 0 && spl_drain(&cfg->pipe, cfg->fd) > 0) {
+    evt_mod(&cfg->evt, cfg->evt.events | EVT_WRITE);
+  }
+  return res;
+}
+
 int line_write(line_config *cfg, unsigned char* data, int len) {
   int retval;
   int i = 0;
   int double_iac = FALSE;
   unsigned char text[1024];
   int text_len = 0;
-  int mask = 0x7f;
+  struct iovec iov[64];
+  int cnt;
+  int used;
 
-  if(cfg->is_telnet) {
-    if(cfg->nvt_data.binary_xmit) {
-      mask = 0xff;
-    }
+  if(cfg->is_telnet
+     && !cfg->nvt_data.binary_xmit
+     && nvt_scan(data, len, 0x80) < len) {
+    // 8 bit data on a 7 bit link has to be masked on the way through
     retval = 0;
     while(i < len) {
       if (double_iac) {
@@ -47,61 +187,459 @@ int line_write(line_config *cfg, unsigned char* data, int len) {
           text[text_len++] = NVT_IAC;
           double_iac = TRUE;
         } else {
-          text[text_len++] = data[i++] & mask;
+          text[text_len++] = data[i++] & 0x7f;
         }
       }
       if(text_len == sizeof(text)) {
-        retval = ip_write(cfg->fd, text, text_len);
+        retval = line_send(cfg, text, text_len);
         text_len = 0;
       }
     }
     if(text_len) {
-      retval = ip_write(cfg->fd, text, text_len);
+      retval = line_send(cfg, text, text_len);
+    }
+    return retval;
+  } else if(cfg->is_telnet) {
+    // send the runs between IACs as they are, only the IACs get doubled
+    retval = 0;
+    while(i < len && retval > -1) {
+      cnt = nvt_escape_iac(data + i, len - i, iov, sizeof(iov) / sizeof(iov[0]), &used);
+      retval = line_sendv(cfg, iov, cnt);
+      i += used;
     }
     return retval;
   }
 
-  return ip_write(cfg->fd, data, len);
+  return line_send(cfg, data, len);
+}
+
+/*
+ * Sends the copy of the file kept in memory, see banner.h.  The socket
+ * gets it as fast as it takes it, and the copy is kept until then.
+ */
+int line_write_file(line_config *cfg, char *name) {
+  bnr_text *t = bnr_get(name);
+  int rc = 0;
+
+  if(t == NULL)
+    return -1;
+  if(t->len == 0 || cfg->fd < 0 || cfg->banner_count == LINE_BANNERS) {
+    if(t->len > 0) {
+      LOG(LOG_WARN, "Could not send banner %s", name);
+      rc = -1;
+    }
+    bnr_put(t);
+    return rc;
+  }
+  cfg->banner[cfg->banner_count++] = t;
+  if(spl_drain(&cfg->pipe, cfg->fd) > 0) {
+    // the pipe goes first, write events send the banner after it
+    feed_banners(cfg);
+    evt_mod(&cfg->evt, cfg->evt.events | EVT_WRITE);
+    return 0;
+  }
+  return (0 > send_banners(cfg) ? -1 : 0);
+}
+
+int line_drain(line_config *cfg) {
+  // the pipe was filled before anything now in the queue
+  if(spl_drain(&cfg->pipe, cfg->fd) > 0)
+    return cfg->pipe.len + ring_len(&cfg->out) + get_banner_len(cfg);
+  if(cfg->banner_count > 0)
+    return send_banners(cfg);
+  return ring_drain(&cfg->out, &cfg->evt);
+}
+
+/*
+ * Output the socket has yet to take, wherever it is waiting.
+ */
+int line_get_backlog(line_config *cfg) {
+  return cfg->pipe.len + ring_len(&cfg->out) + get_banner_len(cfg);
 }
 
 int line_listen(line_config *cfg) {
   return 0;
 }
 
-int line_accept(line_config *cfg) {
-  cfg->fd = ip_accept(cfg->sfd);
-  if(cfg->fd > -1) {
-    LOG(LOG_ALL, "Connection accepted");
-    cfg->is_connected = TRUE;
-    return 0;
-  }
-  LOG(LOG_ALL, "Could not accept connection");
-  return -1;
+/*
+ * Takes a call an accept thread has already accepted.
+ */
+int line_accept(line_config *cfg, int fd) {
+  cfg->fd = fd;
+  cfg->is_connected = TRUE;
+  return 0;
 }
 
 int line_off_hook(line_config *cfg) {
   return 0;
 }
 
+/*
+ * Takes dial state for a call about to be placed, from the spare list if
+ * an earlier call left one there.
+ */
+line_dial *get_dial(line_config *cfg) {
+  line_dial *d = NULL;
+  int i;
+
+  if(cfg->spare != NULL && *cfg->spare != NULL) {
+    d = *cfg->spare;
+    *cfg->spare = d->next;
+  } else {
+    d = malloc(sizeof(line_dial));
+    if(d == NULL) {
+      ELOG(LOG_ERROR, "Could not allocate room to place a call");
+      return NULL;
+    }
+    for(i = 0; i < LINE_ATTEMPTS; i++) {
+      evt_init_handler(&d->dial_evt[i]);
+    }
+    for(i = 0; i < PB_TARGETS; i++) {
+      dns_init_query(&d->query[i], NULL, NULL);
+    }
+  }
+  for(i = 0; i < LINE_ATTEMPTS; i++) {
+    d->dial_fd[i] = -1;
+  }
+  for(i = 0; i < PB_TARGETS; i++) {
+    dns_set_func(&d->query[i], cfg->resolved, cfg->resolved_arg);
+  }
+  return d;
+}
+
+void put_dial(line_config *cfg) {
+  if(cfg->spare == NULL) {
+    free(cfg->dial);
+  } else {
+    cfg->dial->next = *cfg->spare;
+    *cfg->spare = cfg->dial;
+  }
+  cfg->dial = NULL;
+}
+
+void start_target(line_config *cfg, int t) {
+  line_dial *d = cfg->dial;
+  char host[DNS_HOST_LEN];
+
+  LOG(LOG_DEBUG, "Calling %s", d->call.addr[t]);
+  d->port[t] = 23;
+  ip_parse(d->call.addr[t], host, sizeof(host), &d->port[t]);
+  d->dial_next[t] = 0;
+  d->is_failed[t] = FALSE;
+  dns_lookup(&d->query[t], host);
+}
+
+int get_attempts(line_config *cfg, int t) {
+  line_dial *d = cfg->dial;
+  int count = 0;
+  int i;
+
+  for(i = 0; i < LINE_ATTEMPTS; i++) {
+    if(d->dial_fd[i] > -1 && (t < 0 || d->dial_target[i] == t))
+      count++;
+  }
+  return count;
+}
+
+void drop_attempt(line_config *cfg, int i) {
+  line_dial *d = cfg->dial;
+
+  evt_del(&d->dial_evt[i]);
+  ip_disconnect(d->dial_fd[i]);
+  d->dial_fd[i] = -1;
+}
+
+/*
+ * Starts calling the next address of host t.  Returns -1 if it has none
+ * left that a call could be started to.
+ */
+int start_attempt(line_config *cfg, int t) {
+  line_dial *d = cfg->dial;
+  struct sockaddr *addr;
+  int i;
+
+  while(d->dial_next[t] < d->query[t].count) {
+    addr = (struct sockaddr *)&d->query[t].addr[d->dial_next[t]];
+    if(addr->sa_family == AF_INET6) {
+      ((struct sockaddr_in6 *)addr)->sin6_port = htons(d->port[t]);
+    } else {
+      ((struct sockaddr_in *)addr)->sin_port = htons(d->port[t]);
+    }
+    // never more attempts than addresses, so there is always a slot
+    for(i = 0; d->dial_fd[i] > -1; i++);
+    d->dial_fd[i] = ip_connect(addr, d->query[t].addr_len[d->dial_next[t]]);
+    d->dial_target[i] = t;
+    d->dial_next[t]++;
+    cfg->dial_count++;
+    if(d->dial_fd[i] > -1)
+      return 0;
+  }
+  return -1;
+}
+
+void fail_target(line_config *cfg, int t) {
+  line_dial *d = cfg->dial;
+  int i;
+
+  LOG(LOG_INFO, "Could not reach %s", d->call.addr[t]);
+  for(i = 0; i < LINE_ATTEMPTS; i++) {
+    if(d->dial_fd[i] > -1 && d->dial_target[i] == t)
+      drop_attempt(cfg, i);
+  }
+  dns_cancel(&d->query[t]);
+  d->is_failed[t] = TRUE;
+  pb_report(&d->call, t, FALSE);
+}
+
+/*
+ * Starts the first address of hosts that have just been looked up, gives
+ * up on hosts with nothing left to try, and moves on to the next host if
+ * none is left.  Returns -1 once every host has failed.
+ */
+int check_targets(line_config *cfg) {
+  line_dial *d = cfg->dial;
+  int active;
+  int rc;
+  int t;
+
+  for(;;) {
+    active = 0;
+    for(t = 0; t < cfg->targets; t++) {
+      if(d->is_failed[t])
+        continue;
+      rc = dns_result(&d->query[t]);
+      if(rc < 0) {
+        LOG(LOG_ERROR, "Host %s was invalid", d->query[t].host);
+      } else if(rc == 0 && d->dial_next[t] == 0) {
+        start_attempt(cfg, t);
+      }
+      if(rc < 0
+         || (rc == 0
+             && d->dial_next[t] >= d->query[t].count
+             && get_attempts(cfg, t) == 0)) {
+        fail_target(cfg, t);
+      } else {
+        active++;
+      }
+    }
+    if(active > 0)
+      return 0;
+    if(cfg->targets == d->call.count)
+      return -1;
+    start_target(cfg, cfg->targets++);
+  }
+}
+
+void drop_call(line_config *cfg) {
+  line_dial *d = cfg->dial;
+  int i;
+
+  for(i = 0; i < LINE_ATTEMPTS; i++) {
+    if(d->dial_fd[i] > -1)
+      drop_attempt(cfg, i);
+  }
+  for(i = 0; i < cfg->targets; i++) {
+    dns_cancel(&d->query[i]);
+  }
+  evt_timer_clear(&cfg->dial_timer);
+  evt_timer_clear(&cfg->target_timer);
+  put_dial(cfg);
+  cfg->is_connecting = FALSE;
+}
+
+/*
+ * Starts placing a call to addy ("host[:port]", "[v6 address]:port", or
+ * a phone book number standing for one or more of them).  The line
+ * stays connecting while names are looked up (see line_resolved), and
+ * while addresses race each other (Happy Eyeballs, RFC 8305) until
+ * line_connect_done finds one that went through.  Hosts are tried as
+ * the phone book entry says, each for call.timeout seconds.
+ */
 int line_connect(line_config *cfg, char *addy) {
+  line_dial *d;
+
   LOG(LOG_INFO, "Connecting line");
-  addy = pb_search(addy);
-  cfg->fd = ip_connect(addy);
-  if(cfg->fd > -1) {
-    LOG(LOG_ALL, "Connected to %s", addy);
+  if(NULL == (d = get_dial(cfg)))
+    return -1;
+  cfg->dial = d;
+  pb_get_call(addy, &d->call);
+  cfg->targets = 0;
+  cfg->target_timed = 0;
+  cfg->dial_count = 0;
+  cfg->dial_timed = 0;
+  cfg->is_connecting = TRUE;
+  while(d->call.policy == PB_RACE && cfg->targets < d->call.count) {
+    start_target(cfg, cfg->targets++);
+  }
+  if(0 > check_targets(cfg)) {
+    LOG(LOG_ALL, "Could not connect to %s", addy);
+    drop_call(cfg);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Carries on once a name has been looked up.  Returns -1 if the call
+ * cannot go on.
+ */
+int line_resolved(line_config *cfg) {
+  if(!cfg->is_connecting)
+    return 0;   // given up
+  return check_targets(cfg);
+}
+
+/*
+ * Returns TRUE if a host being called has addresses not yet tried.
+ */
+int line_is_racing(line_config *cfg) {
+  line_dial *d = cfg->dial;
+  int t;
+
+  for(t = 0; t < cfg->targets; t++) {
+    if(!d->is_failed[t]
+       && d->dial_next[t] > 0
+       && d->dial_next[t] < d->query[t].count)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+/*
+ * Adds the next address of each host being called to the race.  Returns
+ * -1 if the call cannot go on.
+ */
+int line_connect_next(line_config *cfg) {
+  line_dial *d = cfg->dial;
+  int t;
+
+  for(t = 0; t < cfg->targets; t++) {
+    if(!d->is_failed[t] && d->dial_next[t] > 0)
+      start_attempt(cfg, t);
+  }
+  return check_targets(cfg);
+}
+
+/*
+ * Gives up on the hosts being called, once they have had their time,
+ * and moves on to the next.  Returns -1 if there is none.
+ */
+int line_next_target(line_config *cfg) {
+  line_dial *d = cfg->dial;
+  int t;
+
+  for(t = 0; t < cfg->targets; t++) {
+    if(!d->is_failed[t]) {
+      LOG(LOG_INFO, "No answer from %s within %d seconds", d->call.addr[t], d->call.timeout);
+      fail_target(cfg, t);
+    }
+  }
+  return check_targets(cfg);
+}
+
+/*
+ * Looks at the attempts that have an answer.  Returns 0 if one went
+ * through (the rest are dropped), 1 if the call is still being placed,
+ * or -1 if every host failed.
+ */
+int line_connect_done(line_config *cfg) {
+  line_dial *d = cfg->dial;
+  struct pollfd pfd;
+  int i;
+
+  for(i = 0; i < LINE_ATTEMPTS; i++) {
+    if(d->dial_fd[i] < 0)
+      continue;
+    pfd.fd = d->dial_fd[i];
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if(poll(&pfd, 1, 0) < 1)
+      continue;
+    if(0 > ip_connect_done(d->dial_fd[i])) {
+      ELOG(LOG_INFO, "Call on fd %d did not go through", d->dial_fd[i]);
+      drop_attempt(cfg, i);
+      continue;
+    }
+    LOG(LOG_INFO, "Call on fd %d to %s established", d->dial_fd[i], d->call.addr[d->dial_target[i]]);
+    evt_del(&d->dial_evt[i]);
+    cfg->fd = d->dial_fd[i];
+    d->dial_fd[i] = -1;
+    pb_report(&d->call, d->dial_target[i], TRUE);
+    drop_call(cfg);
     cfg->is_connected = TRUE;
     return 0;
-  } else {
-    LOG(LOG_ALL, "Could not connect to %s",addy);
-    return -1;
   }
+  return (0 == check_targets(cfg) ? 1 : -1);
+}
+
+/*
+ * Waits for a call line_connect started, for callers that cannot go on
+ * without it.
+ */
+int line_connect_wait(line_config *cfg) {
+  struct pollfd pfd[LINE_ATTEMPTS];
+  line_dial *d;
+  long long end = 0;
+  long long now;
+  int targets = 0;
+  int count;
+  int wait;
+  int rc;
+  int i;
+
+  while(cfg->is_connecting) {
+    d = cfg->dial;
+    for(i = 0; i < cfg->targets; i++) {
+      if(!d->is_failed[i])
+        dns_wait(&d->query[i]);
+    }
+    if(0 > check_targets(cfg))
+      return -1;
+    now = evt_now();
+    if(targets != cfg->targets) {
+      targets = cfg->targets;
+      end = now + d->call.timeout * 1000LL;
+    }
+    count = 0;
+    for(i = 0; i < LINE_ATTEMPTS; i++) {
+      if(d->dial_fd[i] > -1) {
+        pfd[count].fd = d->dial_fd[i];
+        pfd[count++].events = POLLOUT;
+      }
+    }
+    wait = (int)(end > now ? end - now : 0);
+    if(line_is_racing(cfg) && wait > LINE_ATTEMPT_DELAY)
+      wait = LINE_ATTEMPT_DELAY;
+    rc = poll(pfd, count, wait);
+    if(rc < 0 && errno != EINTR) {
+      return -1;
+    } else if(rc > 0) {
+      rc = line_connect_done(cfg);
+    } else if(rc == 0 && evt_now() >= end) {
+      rc = line_next_target(cfg);
+    } else if(rc == 0) {
+      rc = line_connect_next(cfg);
+    }
+    if(rc < 0)
+      return -1;
+  }
+  return 0;
 }
 
 int line_disconnect(line_config *cfg) {
   LOG(LOG_INFO, "Disconnecting line");
   if(cfg->is_connected == TRUE) {
+    // last chance for anything still queued, but do not wait for it
+    line_drain(cfg);
+    evt_del(&cfg->evt);
     ip_disconnect(cfg->fd);
+  } else if(cfg->is_connecting == TRUE) {
+    LOG(LOG_INFO, "Abandoning call to %s", cfg->dial->call.addr[0]);
+    drop_call(cfg);
   }
+  spl_clear(&cfg->pipe);
+  ring_clear(&cfg->out);
+  drop_banners(cfg);
   reset_config(cfg);
   return 0;
 }
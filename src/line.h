@@ -1,12 +1,56 @@
 #ifndef LINE_H
 #define LINE_H 1
 
+#include "banner.h"
+#include "evt.h"
 #include "nvt.h"
+#include "ring.h"
+#include "splice.h"
+#include "dns.h"
+#include "phone_book.h"
+
+// RFC 8305: how long one address gets before the next joins the race
+#define LINE_ATTEMPT_DELAY 250
+#define LINE_ATTEMPTS (PB_TARGETS * DNS_ADDRS)
+#define LINE_BANNERS 4  // banners that can wait to be sent at once
+
+/* What placing a call needs is only held while the call is being placed.
+ * It comes from the worker's spare list and goes back there once the
+ * call is through or given up, never to the heap, as a resolver thread
+ * can still be holding one of the queries (see dns_thread).
+ */
+typedef struct line_dial {
+  pb_call call;          // hosts the number stands for
+  dns_query query[PB_TARGETS];
+  int port[PB_TARGETS];
+  int dial_next[PB_TARGETS];  // next address of each host to try
+  int is_failed[PB_TARGETS];
+  int dial_fd[LINE_ATTEMPTS];   // addresses being tried, -1 if unused
+  int dial_target[LINE_ATTEMPTS];
+  evt_handler dial_evt[LINE_ATTEMPTS];
+  struct line_dial *next;   // on the spare list
+} line_dial;
 
 typedef struct line_config {
   int fd;
-  int sfd;
+  evt_handler evt;
+  ring out;             // socket output not yet taken by the kernel
+  spl_pipe pipe;        // spliced socket output, goes ahead of out
+  bnr_text *banner[LINE_BANNERS];   // banners still to go, behind out
+  int banner_count;
+  int banner_pos;       // how much of the first has gone into out
   int is_connected;
+  int is_connecting;     // a call is being placed, fd is -1 until it goes through
+  line_dial *dial;       // set while is_connecting
+  line_dial **spare;     // the worker's finished dial state
+  dns_func resolved;     // told on a resolver thread when a name is in
+  void *resolved_arg;
+  int targets;          // hosts started so far
+  int target_timed;     // targets when target_timer was last set
+  evt_timer target_timer;
+  int dial_count;       // attempts started so far
+  int dial_timed;       // dial_count when dial_timer was last set
+  evt_timer dial_timer;
   int is_telnet;
   int is_data_received;
   nvt_vars nvt_data;
@@ -15,11 +59,23 @@ typedef struct line_config {
 void line_init_config(line_config *cfg);
 int line_init_conn(line_config *cfg);
 int line_read(line_config *cfg, unsigned char *data, int len);
+int line_send(line_config *cfg, unsigned char *data, int len);
+int line_sendv(line_config *cfg, struct iovec *iov, int cnt);
+int line_splice(line_config *cfg, int fd, int len);
 int line_write(line_config *cfg, unsigned char *data, int len);
+int line_write_file(line_config *cfg, char *name);
+int line_drain(line_config *cfg);
+int line_get_backlog(line_config *cfg);
 int line_listen(line_config *cfg);
-int line_accept(line_config *cfg);
+int line_accept(line_config *cfg, int fd);
 int line_off_hook(line_config *cfg);
 int line_connect(line_config *cfg, char* dialno);
+int line_resolved(line_config *cfg);
+int line_connect_next(line_config *cfg);
+int line_is_racing(line_config *cfg);
+int line_next_target(line_config *cfg);
+int line_connect_done(line_config *cfg);
+int line_connect_wait(line_config *cfg);
 int line_disconnect(line_config *cfg);
 
 #endif
@@ -1,11 +1,12 @@
 #include <unistd.h>
-#include <stdlib.h>       // for atoi
+#include <stdlib.h>       // for atoi...
+#include <sys/param.h>   // for MIN
 
 #include "getcmd.h"
 #include "debug.h"
 #include "modem_core.h"
 
-char* mdm_responses[MDM_RESP_END_OF_LIST - 1];
+char* mdm_responses[MDM_RESP_END_OF_LIST];
 
 void mdm_init(void) {
   mdm_responses[MDM_RESP_OK] =             "OK";
@@ -62,14 +63,14 @@ modem_response get_connect_response(int speed, int level) {
 
 void mdm_init_config(modem_config *cfg) {
   int i = 0;
-  cfg->local_connect[0] = 0;
-  cfg->remote_connect[0] = 0;
-  cfg->local_answer[0] = 0;
-  cfg->remote_answer[0] = 0;
-  cfg->no_answer[0] = 0;
-  cfg->inactive[0] = 0;
+  cfg->local_connect = "";
+  cfg->remote_connect = "";
+  cfg->local_answer = "";
+  cfg->remote_answer = "";
+  cfg->no_answer = "";
+  cfg->inactive = "";
   cfg->direct_conn = FALSE;
-  cfg->direct_conn_num[0] = 0;
+  cfg->direct_conn_num = "";
   cfg->is_binary_negotiated = FALSE;
 
   cfg->send_responses = TRUE;
@@ -82,6 +83,7 @@ void mdm_init_config(modem_config *cfg) {
   cfg->is_off_hook = FALSE;
   cfg->is_ringing = FALSE;
   cfg->cur_line_idx = 0;
+  cfg->echo_len = 0;
   cfg->rings = 0;
 
   for(i = 0; i < sizeof(cfg->s) / sizeof(cfg->s[0]); i++) {
@@ -98,6 +100,8 @@ void mdm_init_config(modem_config *cfg) {
   cfg->s[S_REG_CARRIER_LOSS] = 14;
   cfg->s[S_REG_DTMF_TIME] = 95;
   cfg->s[S_REG_GUARD_TIME] = 50;
+  cfg->s[S_REG_HIGH_WATER] = 16;
+  cfg->s[S_REG_LOW_WATER] = 4;
 
   cfg->crlf[0] = cfg->s[S_REG_CR];
   cfg->crlf[1] = cfg->s[S_REG_LF];
@@ -106,6 +110,9 @@ void mdm_init_config(modem_config *cfg) {
   cfg->dial_type = 0;
   cfg->last_dial_type = 0;
   cfg->disconnect_delay = 0;
+  cfg->is_hanging_up = FALSE;
+  cfg->hangup_count = 0;
+  cfg->hangup_timed = 0;
 
   cfg->pre_break_delay = FALSE;
   cfg->break_len = 0;
@@ -119,13 +126,26 @@ void mdm_init_config(modem_config *cfg) {
   cfg->allow_transmit = TRUE;
   cfg->invert_dsr = FALSE;
   cfg->invert_dcd = FALSE;
+  cfg->use_splice = FALSE;
+  cfg->data_buf = NULL;
+  cfg->id = 0;
+  cfg->pool_id = 0;
+  cfg->worker_id = 0;
+  cfg->pool_idx = -1;
+  cfg->pool_key = 0;
+  cfg->pool_turn = 0;
+  cfg->traffic = 0;
+  cfg->is_call_pending = FALSE;
+  cfg->is_dce_backlogged = FALSE;
+  cfg->is_line_backlogged = FALSE;
 
   dce_init_config(&cfg->dce_data);
   line_init_config(&cfg->line_data);
 }
 
 int get_new_cts_state(modem_config *cfg, int up) {
-  return DCE_CL_CTS;
+  // hold off the DTE while the socket cannot keep up
+  return (cfg->is_line_backlogged ? 0 : DCE_CL_CTS);
 }
 
 int get_new_dsr_state(modem_config *cfg, int up) {
@@ -161,6 +181,14 @@ int mdm_set_control_lines(modem_config *cfg) {
   return 0;
 }
 
+void mdm_flush_echo(modem_config *cfg) {
+  if(cfg->echo_len > 0) {
+    dce_stage(&cfg->dce_data);
+    dce_write_raw(&cfg->dce_data, cfg->echo_buf, cfg->echo_len);
+    cfg->echo_len = 0;
+  }
+}
+
 void mdm_write_char(modem_config *cfg, unsigned char data) {
   unsigned char str[1];
 
@@ -169,6 +197,12 @@ void mdm_write_char(modem_config *cfg, unsigned char data) {
 }
 
 void mdm_write(modem_config *cfg, unsigned char data[], int len) {
+  if(cfg->is_cmd_mode == TRUE) {
+    // command output goes to the DTE with the rest of this pass
+    dce_stage(&cfg->dce_data);
+  }
+  // keep echoed characters ahead of anything the modem says
+  mdm_flush_echo(cfg);
   if(cfg->allow_transmit == TRUE) {
     dce_write(&cfg->dce_data, data, len);
   }
@@ -179,6 +213,7 @@ void mdm_send_response(int msg, modem_config *cfg) {
 
   LOG(LOG_DEBUG, "Sending %s response to modem", mdm_responses[msg]);
   if(cfg->send_responses == TRUE) {
+    dce_stage(&cfg->dce_data);
     mdm_write(cfg, (unsigned char *)cfg->crlf, 2);
     if(cfg->text_responses == TRUE) {
       LOG(LOG_ALL, "Sending text response");
@@ -226,6 +261,26 @@ int mdm_off_hook(modem_config *cfg) {
   return 0;
 }
 
+/*
+ * Called once the disconnect delay is over, or straight away if there
+ * is none, to make the modem ready for the next call.
+ */
+int mdm_hangup_done(modem_config *cfg) {
+  cfg->is_hanging_up = FALSE;
+  cfg->rings = 0;
+  return mdm_listen(cfg);
+}
+
+void wait_disconnect(modem_config *cfg) {
+  if(cfg->disconnect_delay > 0) {
+    // the loop runs the delay, and calls mdm_hangup_done when it is over
+    cfg->is_hanging_up = TRUE;
+    cfg->hangup_count++;
+  } else {
+    mdm_hangup_done(cfg);
+  }
+}
+
 int mdm_answer(modem_config *cfg) {
   if(cfg->is_ringing == TRUE) {
     cfg->is_ringing = FALSE;
@@ -241,7 +296,7 @@ int mdm_answer(modem_config *cfg) {
     mdm_set_control_lines(cfg);
   } else {
     mdm_send_response(MDM_RESP_NO_CARRIER, cfg);
-    usleep(cfg->disconnect_delay * 1000);
+    wait_disconnect(cfg);
     //mdm_disconnect(cfg, FALSE);
   }
   return 0;
@@ -251,24 +306,45 @@ int mdm_connect(modem_config *cfg) {
   off_hook(cfg);
   cfg->is_cmd_mode = FALSE;
   if(cfg->conn_type == MDM_CONN_NONE) {
-    if(line_connect(&cfg->line_data, cfg->dialno) == 0) {
-      cfg->conn_type = MDM_CONN_OUTGOING;
-      mdm_set_control_lines(cfg);
-      mdm_print_speed(cfg);
-    } else {
+    // the loop finishes the call, see mdm_connect_done
+    if(line_connect(&cfg->line_data, cfg->dialno) != 0) {
+      // nothing to wait for, so back on hook for the next command
+      cfg->is_cmd_mode = TRUE;
+      cfg->is_off_hook = FALSE;
       mdm_send_response(MDM_RESP_NO_CARRIER, cfg);
-      usleep(cfg->disconnect_delay * 1000);
+      wait_disconnect(cfg);
     }
   }
   return 0;
 }
 
+int mdm_resolved(modem_config *cfg) {
+  if(0 != line_resolved(&cfg->line_data)) {
+    mdm_disconnect(cfg, FALSE);
+  }
+  return 0;
+}
+
+int mdm_connect_done(modem_config *cfg) {
+  int rc = line_connect_done(&cfg->line_data);
+
+  if(rc == 0) {
+    cfg->conn_type = MDM_CONN_OUTGOING;
+    mdm_set_control_lines(cfg);
+    mdm_print_speed(cfg);
+  } else if(rc < 0) {
+    mdm_disconnect(cfg, FALSE);
+  }
+  return 0;
+}
+
 int mdm_listen(modem_config *cfg) {
   return line_listen(&cfg->line_data);
 }
 
 int mdm_disconnect(modem_config* cfg, unsigned char force) {
   int type;
+  int is_dialing;
 
   LOG_ENTER();
   LOG(LOG_INFO, "Disconnecting modem");
@@ -281,20 +357,29 @@ int mdm_disconnect(modem_config* cfg, unsigned char force) {
   if(cfg->direct_conn && !force) {
     LOG(LOG_INFO, "Direct connection active, maintaining link");
   } else {
+    is_dialing = cfg->line_data.is_connecting;
     line_disconnect(&cfg->line_data);
     type = cfg->conn_type;
     cfg->conn_type = MDM_CONN_NONE;
     mdm_set_control_lines(cfg);
     if(type != MDM_CONN_NONE) {
+      LOG(LOG_DEBUG,
+          "Serial data: %lu bytes in %lu reads",
+          cfg->dce_data.rx_bytes,
+          cfg->dce_data.rx_reads
+         );
+      cfg->traffic += cfg->dce_data.rx_bytes;
+      cfg->dce_data.rx_bytes = 0;
+      cfg->dce_data.rx_reads = 0;
+      mdm_send_response(MDM_RESP_NO_CARRIER, cfg);
+    } else if(is_dialing) {
+      // the call was given up before it went through
       mdm_send_response(MDM_RESP_NO_CARRIER, cfg);
-      usleep(cfg->disconnect_delay * 1000);
     } else {
       // ath0 after just off hook
       mdm_send_response(MDM_RESP_OK, cfg);
-      usleep(cfg->disconnect_delay * 1000);
     }
-    cfg->rings = 0;
-    mdm_listen(cfg);
+    wait_disconnect(cfg);
   }
   LOG_EXIT();
   return 0;
@@ -569,8 +654,12 @@ int mdm_parse_cmd(modem_config* cfg) {
 int mdm_handle_char(modem_config *cfg, unsigned char ch) {
   char ch_raw = ch & 0x7f;
 
-  if(cfg->is_echo == TRUE)
-    dce_write_char_raw(&cfg->dce_data, ch);
+  if(cfg->is_echo == TRUE) {
+    if(cfg->echo_len == sizeof(cfg->echo_buf)) {
+      mdm_flush_echo(cfg);
+    }
+    cfg->echo_buf[cfg->echo_len++] = ch;
+  }
   if(cfg->is_cmd_started == TRUE) { // we previously got an 'AT'
     if(ch_raw == (cfg->s[S_REG_BS])) {
       if(cfg->cur_line_idx == 0 && cfg->is_echo == TRUE) {
@@ -648,13 +737,54 @@ int mdm_send_ring(modem_config *cfg) {
   return 0;
 }
 
+int is_dialing(modem_config *cfg) {
+  return (cfg->conn_type == MDM_CONN_NONE
+          && cfg->is_cmd_mode == FALSE
+          && cfg->is_off_hook == TRUE);
+}
+
+/*
+ * Any key stops a call being placed, except the end of the line the
+ * dial command came on, which terminals often send apart from it.
+ */
+int is_keypress(modem_config *cfg, unsigned char *data, int len) {
+  unsigned char ch;
+  int i;
+
+  for(i = 0; i < len; i++) {
+    ch = dce_strip_parity(&cfg->dce_data, data[i]);
+    if(ch != cfg->s[S_REG_CR] && ch != cfg->s[S_REG_LF])
+      return TRUE;
+  }
+  return FALSE;
+}
+
 int mdm_parse_data(modem_config *cfg, unsigned char *data, int len) {
   int i;
 
+  if(is_dialing(cfg)) {
+    if(is_keypress(cfg, data, len)) {
+      LOG(LOG_INFO, "Key pressed while dialing, abandoning the call");
+      mdm_disconnect(cfg, FALSE);
+    }
+    return 0;
+  }
   if(cfg->is_cmd_mode == TRUE) {
-    for(i = 0; i < len; i++) {
+    for(i = 0; i < len && cfg->is_cmd_mode == TRUE; i++) {
       mdm_handle_char(cfg, data[i]);
     }
+    mdm_flush_echo(cfg);
+    if(i < len) {
+      // a command in this block left command mode, handle the rest
+      // the same way as if it had been read afterwards.
+      if(is_dialing(cfg)) {
+        // it came in with the dial command, before the dial started
+        LOG(LOG_DEBUG, "Ignoring %d bytes sent with the dial command", len - i);
+      } else {
+        dce_strip_parity_buf(&cfg->dce_data, data + i, len - i);
+        mdm_parse_data(cfg, data + i, len - i);
+      }
+    }
   } else {
     line_write(&cfg->line_data, data, len);
     if(cfg->pre_break_delay == TRUE) {
@@ -677,18 +807,28 @@ int mdm_parse_data(modem_config *cfg, unsigned char *data, int len) {
   return 0;
 }
 
+/*
+ * data_buf is DCE_MAX_READ_LEN bytes, reads only use as much of it as
+ * the dce sizing asks for.
+ */
+int mdm_get_read_len(modem_config *cfg) {
+  int len;
+
+  len = cfg->dce_data.read_len;
+  if(cfg->is_cmd_mode == FALSE) {
+    len = dce_get_read_len(&cfg->dce_data);
+  }
+  return MIN(len, DCE_MAX_READ_LEN);
+}
+
 int mdm_read(modem_config *cfg, unsigned char *data, int len) {
   int res;
 
   if(cfg->is_cmd_mode == TRUE) {
-    // read one char in raw mode
-    res = dce_read_char_raw(&cfg->dce_data);
-    if(res > 0) { // we have a character
-      data[0] = (unsigned char)res; // fixup
-      res = 1;
-    }
+    // commands need the parity bits intact, read them raw
+    res = dce_read_raw(&cfg->dce_data, data, len);
   } else {
-    res = dce_read(&cfg->dce_data, data, sizeof(data));
+    res = dce_read(&cfg->dce_data, data, len);
   }
   return res;
 }
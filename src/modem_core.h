@@ -38,6 +38,7 @@ typedef enum {
 #define FALSE 0
 #endif
 
+#include "evt.h"
 #include "dce.h"
 #include "line.h"
 #include "nvt.h"
@@ -58,22 +59,22 @@ enum {
   S_REG_CARRIER_LOSS = 10,
   S_REG_DTMF_TIME = 11,
   S_REG_GUARD_TIME = 12,
-  S_REG_INACTIVITY_TIME = 30
+  S_REG_INACTIVITY_TIME = 30,
+  S_REG_HIGH_WATER = 40,   // output queue flow control, in KB
+  S_REG_LOW_WATER = 41
 };
 
 typedef struct modem_config {
-  // master configuration information
-  int mp[2][2];
-  int cp[2][2];
-  int wp[2][2];
-  char no_answer[256];
-  char local_connect[256];
-  char remote_connect[256];
-  char local_answer[256];
-  char remote_answer[256];
-  char inactive[256];
+  // master configuration information, the strings are shared between
+  // modems and never freed
+  char *no_answer;
+  char *local_connect;
+  char *remote_connect;
+  char *local_answer;
+  char *remote_answer;
+  char *inactive;
   int direct_conn;
-  char direct_conn_num[256];
+  char *direct_conn_num;
 
   // need to eventually change these
   dce_config dce_data;
@@ -87,6 +88,7 @@ typedef struct modem_config {
   int force_dcd;
   int invert_dsr;
   int invert_dcd;
+  int use_splice;       // raw calls skip user space where they can
   int allow_transmit;
   int is_binary_negotiated;
   int rings;
@@ -98,6 +100,8 @@ typedef struct modem_config {
   char cur_line[1024];
   int cur_line_idx;
   int last_line_idx;
+  unsigned char echo_buf[256];
+  int echo_len;
   // dailing information
   char dialno[256];
   char last_dialno[256];
@@ -113,7 +117,35 @@ typedef struct modem_config {
   int s[100];
   int break_len;
   int disconnect_delay;
+  int is_hanging_up;    // waiting out disconnect_delay
+  int hangup_count;     // delays asked for
+  int hangup_timed;     // delays the loop has started
   char crlf[3];
+  // serial read buffer, DCE_MAX_READ_LEN bytes shared by the worker's
+  // modems, of which reads use only what the dce sizing asks for
+  unsigned char *data_buf;
+  // event loop state
+  int id;               // place on the command line
+  int worker_id;
+  int is_call_pending;  // an accept thread has queued a call for this modem
+  evt_loop *loop;
+  evt_timer timer;
+  evt_timer hangup_timer;
+  int wp[2];            // control line watcher pipe (serial ports)
+  evt_handler wp_evt;
+  int ctrl_status;
+  int last_conn_type;
+  int last_cmd_mode;
+  int pool_id;          // hunt group
+  int pool_state;       // POOL_ state as of the last update
+  int pool_idx;         // place in the pool's free heap, -1 if not in one
+  long long pool_key;   // where the policy puts it in the heap
+  unsigned long long pool_turn;   // when it was last handed a call
+  unsigned long long traffic;     // bytes carried on calls, both ways
+  int is_line_pending;
+  int is_dce_pending;
+  int is_dce_backlogged;   // serial output queue over the high water mark
+  int is_line_backlogged;  // socket output queue over the high water mark
 } modem_config;
 
 void mdm_init(void);
@@ -122,6 +154,7 @@ int get_new_cts_state(modem_config *cfg, int up);
 int get_new_dsr_state(modem_config *cfg, int up);
 int get_new_dcd_state(modem_config *cfg, int up);
 int mdm_set_control_lines(modem_config *cfg);
+void mdm_flush_echo(modem_config *cfg);
 void mdm_write_char(modem_config *cfg, unsigned char data);
 void mdm_write(modem_config *cfg, unsigned char *data, int len);
 void mdm_send_response(int msg, modem_config *cfg);
@@ -129,7 +162,10 @@ int mdm_off_hook(modem_config *cfg);
 int mdm_answer(modem_config *cfg);
 int mdm_print_speed(modem_config *cfg);
 int mdm_connect(modem_config *cfg);
+int mdm_resolved(modem_config *cfg);
+int mdm_connect_done(modem_config *cfg);
 int mdm_listen(modem_config *cfg);
+int mdm_hangup_done(modem_config *cfg);
 int mdm_disconnect(modem_config *cfg, unsigned char force);
 int mdm_parse_cmd(modem_config *cfg);
 int mdm_handle_char(modem_config *cfg, unsigned char ch);
@@ -137,6 +173,7 @@ int mdm_clear_break(modem_config *cfg);
 int mdm_parse_data(modem_config *cfg, unsigned char *data, int len);
 int mdm_handle_timeout(modem_config *cfg);
 int mdm_send_ring(modem_config *cfg);
+int mdm_get_read_len(modem_config *cfg);
 int mdm_read(modem_config *cfg, unsigned char *data, int len);
 
 #include "line.h"
@@ -1,8 +1,12 @@
 #include <string.h>
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#  include <immintrin.h>
+#  define HAVE_SSE2_SCAN 1
+#endif
 
 #include "debug.h"
-#include "ip.h"
 #include "modem_core.h"
+#include "line.h"
 
 #include "nvt.h"
 
@@ -13,6 +17,134 @@ void nvt_init_config(nvt_vars *vars) {
   vars->binary_recv = FALSE;
   for (i = 0; i < 256; i++)
     vars->term[i] = 0;
+  vars->partial_len = 0;
+}
+
+/*
+ * Returns FALSE if the command starting at data (on an IAC) runs past
+ * len, and so has to wait for the next read.  Sub negotiations too long
+ * to hold back are parsed as they are.
+ */
+int nvt_is_complete(unsigned char *data, int len) {
+  int i;
+
+  if(len < 2)
+    return FALSE;
+  switch(data[1]) {
+    case NVT_WILL:
+    case NVT_WONT:
+    case NVT_DO:
+    case NVT_DONT:
+      return (len > 2);
+    case NVT_SB:
+      if(len >= NVT_PARTIAL_LEN)
+        return TRUE;
+      for(i = 2; i < len - 1; i++) {
+        if(NVT_IAC == data[i] && NVT_SE == data[i + 1])
+          return TRUE;
+      }
+      return FALSE;
+  }
+  return TRUE;
+}
+
+int scan_scalar(unsigned char *data, int len, unsigned char limit) {
+  int i;
+
+  for(i = 0; i < len && data[i] < limit; i++)
+    ;
+  return i;
+}
+
+#ifdef HAVE_SSE2_SCAN
+/* unsigned v >= limit is the same as max(v, limit) == v */
+int scan_sse2(unsigned char *data, int len, unsigned char limit) {
+  __m128i lim = _mm_set1_epi8((char)limit);
+  __m128i v;
+  int mask;
+  int i;
+
+  for(i = 0; i + 16 <= len; i += 16) {
+    v = _mm_loadu_si128((__m128i *)(data + i));
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, lim), v));
+    if(mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + scan_scalar(data + i, len - i, limit);
+}
+
+__attribute__((target("avx2")))
+int scan_avx2(unsigned char *data, int len, unsigned char limit) {
+  __m256i lim = _mm256_set1_epi8((char)limit);
+  __m256i v;
+  unsigned int mask;
+  int i;
+
+  for(i = 0; i + 32 <= len; i += 32) {
+    v = _mm256_loadu_si256((__m256i *)(data + i));
+    mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v, lim), v));
+    if(mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + scan_sse2(data + i, len - i, limit);
+}
+
+int (*scan_func)(unsigned char *, int, unsigned char) = scan_sse2;
+#else
+int (*scan_func)(unsigned char *, int, unsigned char) = scan_scalar;
+#endif
+
+void nvt_init(void) {
+#ifdef HAVE_SSE2_SCAN
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    LOG(LOG_DEBUG, "Using AVX2 IAC scanner");
+    scan_func = scan_avx2;
+  }
+#endif
+}
+
+/*
+ * Returns the offset of the first byte at or above limit, or len if
+ * there is none.  Telnet data rarely holds an IAC, so this is the hot
+ * loop for every byte that passes through.
+ */
+int nvt_scan(unsigned char *data, int len, unsigned char limit) {
+  return scan_func(data, len, limit);
+}
+
+/*
+ * Fills iov with slices of data that, sent back to back, double every
+ * IAC.  A slice ends on each IAC and the next one starts on it again,
+ * so nothing is copied.  Returns the number of slices and sets *used to
+ * how much of data they cover, which is less than len if iov ran out.
+ */
+int nvt_escape_iac(unsigned char *data, int len, struct iovec *iov, int max, int *used) {
+  int cnt = 0;
+  int start = 0;
+  int from = 0;
+  int end = -1;
+  int n;
+
+  while(end < 0 && cnt < max - 1) {
+    n = (from < len ? nvt_scan(data + from, len - from, NVT_IAC) : 0);
+    if(from + n >= len) {
+      end = len;
+    } else {
+      iov[cnt].iov_base = data + start;
+      iov[cnt++].iov_len = from + n + 1 - start;
+      start = from + n;
+      from = start + 1;
+    }
+  }
+  if(end < 0)
+    end = from;   // out of slices, but the last IAC still needs its twin
+  if(end > start) {
+    iov[cnt].iov_base = data + start;
+    iov[cnt++].iov_len = end - start;
+  }
+  *used = end;
+  return cnt;
 }
 
 unsigned char get_nvt_cmd_response(unsigned char action, unsigned char type) {
@@ -48,7 +180,7 @@ unsigned char get_nvt_cmd_response(unsigned char action, unsigned char type) {
   return rc;
 }
 
-int parse_nvt_subcommand(dce_config *cfg, int fd, nvt_vars *vars, unsigned char *data, int len) {
+int parse_nvt_subcommand(dce_config *cfg, line_config *line, nvt_vars *vars, unsigned char *data, int len) {
   // overflow issue, again...
   nvt_option opt = data[2];
   unsigned char resp[100];
@@ -104,7 +236,7 @@ int parse_nvt_subcommand(dce_config *cfg, int fd, nvt_vars *vars, unsigned char
     resp_len += response_len;
     resp[resp_len++] = NVT_IAC;
     resp[resp_len++] = NVT_SE;
-    ip_write(fd, resp, resp_len);
+    line_send(line, resp, resp_len);
   }
   return rc;
 }
@@ -129,7 +261,7 @@ void get_action(char *txt, nvt_command action) {
   }
 }
 
-int send_nvt_command(int fd, nvt_vars *vars, nvt_command action, nvt_option opt) {
+int send_nvt_command(line_config *line, nvt_vars *vars, nvt_command action, nvt_option opt) {
   unsigned char cmd[3];
   char txt[20];
 
@@ -139,13 +271,13 @@ int send_nvt_command(int fd, nvt_vars *vars, nvt_command action, nvt_option opt)
   cmd[1] = action;
   cmd[2] = opt;
 
-  ip_write(fd, cmd, 3);
+  line_send(line, cmd, 3);
   vars->term[opt] = action;
 
   return 0;
 }
 
-int parse_nvt_command(dce_config *cfg, int fd, nvt_vars *vars, nvt_command action, nvt_option opt) {
+int parse_nvt_command(dce_config *cfg, line_config *line, nvt_vars *vars, nvt_command action, nvt_option opt) {
   int accept = FALSE;
   char txt[20];
   int resp;
@@ -198,6 +330,6 @@ int parse_nvt_command(dce_config *cfg, int fd, nvt_vars *vars, nvt_command actio
       resp = get_nvt_cmd_response(action, FALSE);
       break;
   }
-  send_nvt_command(fd, vars, resp, opt);
+  send_nvt_command(line, vars, resp, opt);
   return 0;
 }
@@ -1,6 +1,8 @@
 #ifndef NVT_H
 #define NVT_H 1
 
+#include <sys/uio.h>
+
 #include "dce.h"
 
 typedef enum {
@@ -40,16 +42,27 @@ typedef enum {
 #define FALSE 0
 #endif
 
+struct line_config;    // nvt replies go out through the line
+
+#define NVT_PARTIAL_LEN 64
+
 typedef struct nvt_vars {
   int binary_xmit;
   int binary_recv;
   char term[256];
+  // start of a command that was split across socket reads
+  unsigned char partial[NVT_PARTIAL_LEN];
+  int partial_len;
 } nvt_vars;
 
+void nvt_init(void);
 void nvt_init_config(nvt_vars *vars);
+int nvt_is_complete(unsigned char *data, int len);
+int nvt_scan(unsigned char *data, int len, unsigned char limit);
+int nvt_escape_iac(unsigned char *data, int len, struct iovec *iov, int max, int *used);
 unsigned char get_nvt_cmd_response(unsigned char action, unsigned char type);
-int parse_nvt_subcommand(dce_config *cfg, int fd, nvt_vars *vars , unsigned char *data, int len);
-int parse_nvt_command(dce_config *cfg, int fd, nvt_vars *vars, nvt_command action, nvt_option opt);
-int send_nvt_command(int fd, nvt_vars *vars, nvt_command action, nvt_option opt);
+int parse_nvt_subcommand(dce_config *cfg, struct line_config *line, nvt_vars *vars , unsigned char *data, int len);
+int parse_nvt_command(dce_config *cfg, struct line_config *line, nvt_vars *vars, nvt_command action, nvt_option opt);
+int send_nvt_command(struct line_config *line, nvt_vars *vars, nvt_command action, nvt_option opt);
 
 #endif
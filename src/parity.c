@@ -0,0 +1,150 @@
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#  include <immintrin.h>
+#  define HAVE_SSE2_PARITY 1
+#endif
+
+#include "debug.h"
+#include "dce.h"
+#include "parity.h"
+
+/* par_bit[v] is 0x80 when the 7 bit value v has an odd number of bits set */
+#define P2(n) n, n ^ 0x80, n ^ 0x80, n
+#define P4(n) P2(n), P2(n ^ 0x80), P2(n ^ 0x80), P2(n)
+#define P6(n) P4(n), P4(n ^ 0x80), P4(n ^ 0x80), P4(n)
+
+const unsigned char par_bit[128] = { P6(0), P6(0x80) };
+
+void par_even(unsigned char *out, unsigned char *in, int len) {
+  int i;
+
+  for(i = 0; i < len; i++) {
+    out[i] = (in[i] & 0x7f) | par_bit[in[i] & 0x7f];
+  }
+}
+
+void par_odd(unsigned char *out, unsigned char *in, int len) {
+  int i;
+
+  for(i = 0; i < len; i++) {
+    out[i] = (in[i] & 0x7f) | (par_bit[in[i] & 0x7f] ^ 0x80);
+  }
+}
+
+void par_mark(unsigned char *out, unsigned char *in, int len) {
+  int i;
+
+  for(i = 0; i < len; i++) {
+    out[i] = in[i] | 0x80;
+  }
+}
+
+void par_none(unsigned char *out, unsigned char *in, int len) {
+  int i;
+
+  if(out != in) {
+    for(i = 0; i < len; i++) {
+      out[i] = in[i];
+    }
+  }
+}
+
+#ifdef HAVE_SSE2_PARITY
+/*
+ * The parity of each nibble is looked up 16 bytes at a time with pshufb,
+ * and the two halves xored together.
+ */
+__attribute__((target("ssse3")))
+void par_ssse3(unsigned char *out, unsigned char *in, int len, int odd) {
+  __m128i nibble = _mm_setr_epi8(0, 0x80, 0x80, 0, 0x80, 0, 0, 0x80,
+                                 0x80, 0, 0, 0x80, 0, 0x80, 0x80, 0);
+  __m128i low = _mm_set1_epi8(0x0f);
+  __m128i high = _mm_set1_epi8(0x07);
+  __m128i data = _mm_set1_epi8(0x7f);
+  __m128i flip = _mm_set1_epi8(odd ? (char)0x80 : 0);
+  __m128i v;
+  __m128i p;
+  int i;
+
+  for(i = 0; i + 16 <= len; i += 16) {
+    v = _mm_and_si128(_mm_loadu_si128((__m128i *)(in + i)), data);
+    p = _mm_xor_si128(_mm_shuffle_epi8(nibble, _mm_and_si128(v, low)),
+                      _mm_shuffle_epi8(nibble, _mm_and_si128(_mm_srli_epi16(v, 4), high)));
+    _mm_storeu_si128((__m128i *)(out + i), _mm_or_si128(v, _mm_xor_si128(p, flip)));
+  }
+  if(odd)
+    par_odd(out + i, in + i, len - i);
+  else
+    par_even(out + i, in + i, len - i);
+}
+
+void par_even_ssse3(unsigned char *out, unsigned char *in, int len) {
+  par_ssse3(out, in, len, 0);
+}
+
+void par_odd_ssse3(unsigned char *out, unsigned char *in, int len) {
+  par_ssse3(out, in, len, 1);
+}
+
+void par_mark_sse2(unsigned char *out, unsigned char *in, int len) {
+  __m128i mark = _mm_set1_epi8((char)0x80);
+  int i;
+
+  for(i = 0; i + 16 <= len; i += 16) {
+    _mm_storeu_si128((__m128i *)(out + i),
+                     _mm_or_si128(_mm_loadu_si128((__m128i *)(in + i)), mark));
+  }
+  par_mark(out + i, in + i, len - i);
+}
+
+int has_ssse3 = 0;
+#endif
+
+void par_init(void) {
+#ifdef HAVE_SSE2_PARITY
+  __builtin_cpu_init();
+  has_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+/*
+ * Picks the fastest kernel this CPU has for the parity found by
+ * dce_detect_parity().
+ */
+par_func par_get_func(int parity) {
+  switch(parity) {
+    case PARITY_ODD:
+#ifdef HAVE_SSE2_PARITY
+      if(has_ssse3)
+        return par_odd_ssse3;
+#endif
+      return par_odd;
+    case PARITY_EVEN:
+#ifdef HAVE_SSE2_PARITY
+      if(has_ssse3)
+        return par_even_ssse3;
+#endif
+      return par_even;
+    case PARITY_MARK:
+#ifdef HAVE_SSE2_PARITY
+      return par_mark_sse2;
+#else
+      return par_mark;
+#endif
+  }
+  return par_none;
+}
+
+void par_strip(unsigned char *data, int len) {
+  int i = 0;
+#ifdef HAVE_SSE2_PARITY
+  __m128i mask = _mm_set1_epi8(0x7f);
+
+  for(; i + 16 <= len; i += 16) {
+    _mm_storeu_si128((__m128i *)(data + i),
+                     _mm_and_si128(_mm_loadu_si128((__m128i *)(data + i)), mask));
+  }
+#endif
+  for(; i < len; i++) {
+    data[i] &= 0x7f;
+  }
+}
@@ -0,0 +1,13 @@
+#ifndef PARITY_H
+#define PARITY_H 1
+
+/* Kernels that set the high bit of 7 bit data for ODD, EVEN or MARK
+ * parity (SPACE leaves data alone).  out may be the same as in.
+ */
+typedef void (*par_func)(unsigned char *out, unsigned char *in, int len);
+
+void par_init(void);
+par_func par_get_func(int parity);
+void par_strip(unsigned char *data, int len);
+
+#endif
@@ -1,48 +1,659 @@
 #include <stdio.h>
+#include <stdlib.h>       // for atoi...
 #include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>        // for sched_yield
 #include "phone_book.h"
+#include "evt.h"          // for evt_now
 #include "debug.h"
 
-#define PBSIZE 100
+#define PB_KEYS 11        // the digits, then x for any digit
+#define PB_ANY_DIGIT 10
 
-char phone_book[PBSIZE][2][128];
-int size = 0;
+typedef struct pb_target {
+  char addr[PB_ADDR_LEN];
+  int weight;
+  int credit;           // for the weighted rotation
+  long long dead_until; // ms, while it is being skipped, read without a lock
+} pb_target;
+
+typedef struct pb_entry {
+  char number[128];
+  int policy;
+  int timeout;
+  int count;
+  pb_target target[PB_TARGETS];
+} pb_entry;
+
+typedef struct pb_node {
+  int child[PB_KEYS];   // 0 if none, the root is never a child
+  int end;              // rule that ends here, or -1
+  int any;              // rule that ends with * here, or -1
+} pb_node;
+
+typedef struct pb_book {
+  unsigned int gen;
+  pb_entry *entries;
+  int count;
+  int size;
+  int *index;           // exact numbers by hash, -1 if empty
+  int index_size;       // a power of two
+  pb_node *nodes;       // the rules, nodes[0] is the root
+  int node_count;
+  int node_size;
+  int rules;
+} pb_book;
+
+char **pb_args = NULL;  // "number=hosts" from -n, kept for every reload
+int pb_arg_count = 0;
+int pb_arg_size = 0;
+char *pb_file = NULL;
+unsigned int pb_gen = 0;
+// lookups read the book without a lock.  Each counts itself in as a
+// reader of the current phase, and pb_load waits out the readers of
+// both phases before freeing a book it has swapped out.
+pb_book *pb_current = NULL;
+unsigned int pb_phase = 0;
+int pb_readers[2] = { 0, 0 };
+// taken for the weighted rotation, which all workers share
+pthread_mutex_t pb_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int pb_init() {
   return 0;
 }
 
+/*
+ * Sets the policy from "failover", "race" or "rr", each optionally
+ * followed by ":seconds" for how long a host gets.
+ */
+int parse_policy(pb_entry *e, char *policy) {
+  char *timeout = strchr(policy, ':');
+  int len = (timeout != NULL ? timeout - policy : (int)strlen(policy));
+
+  if(timeout != NULL && atoi(timeout + 1) > 0)
+    e->timeout = atoi(timeout + 1);
+  if(len == 0 || 0 == strncmp(policy, "failover", len)) {
+    e->policy = PB_FAILOVER;
+  } else if(0 == strncmp(policy, "race", len)) {
+    e->policy = PB_RACE;
+  } else if(0 == strncmp(policy, "rr", len)) {
+    e->policy = PB_ROUND_ROBIN;
+  } else {
+    LOG(LOG_ERROR, "Unknown phone book policy '%s'", policy);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Fills in e for a number standing for "host[:port][*weight],...[/policy]".
+ */
+int parse_entry(pb_entry *e, char *from, char *to) {
+  char buf[PB_TARGETS * PB_ADDR_LEN];
+  char *policy;
+  char *addr;
+  char *weight;
+  char *next;
+
+  memset(e, 0, sizeof(*e));
+  if(from == NULL
+     || to == NULL
+     || strlen(from) == 0
+     || strlen(from) >= sizeof(e->number)
+     || strlen(to) == 0
+    ) {
+    return -1;
+  }
+  strcpy(e->number, from);
+  e->timeout = PB_TIMEOUT;
+  strncpy(buf, to, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = 0;
+  policy = strchr(buf, '/');
+  if(policy != NULL) {
+    *policy++ = 0;
+    if(0 > parse_policy(e, policy))
+      return -1;
+  }
+  for(addr = buf; addr != NULL && e->count < PB_TARGETS; addr = next) {
+    next = strchr(addr, ',');
+    if(next != NULL)
+      *next++ = 0;
+    weight = strchr(addr, '*');
+    if(weight != NULL)
+      *weight++ = 0;
+    if(strlen(addr) == 0)
+      continue;
+    strncpy(e->target[e->count].addr, addr, PB_ADDR_LEN - 1);
+    e->target[e->count].weight = (weight != NULL && atoi(weight) > 0 ? atoi(weight) : 1);
+    e->count++;
+  }
+  if(addr != NULL) {
+    LOG(LOG_WARN, "Only the first %d hosts for %s are used", PB_TARGETS, from);
+  }
+  return (e->count > 0 ? 0 : -1);
+}
+
+/*
+ * Returns TRUE if number is a dial plan rule: digits and x's, maybe
+ * ending in *, with at least one wildcard.
+ */
+int is_rule(char *number) {
+  int is_wild = FALSE;
+
+  for(; *number; number++) {
+    if(*number == 'x' || *number == 'X' || (*number == '*' && number[1] == 0)) {
+      is_wild = TRUE;
+    } else if(!isdigit((unsigned char)*number)) {
+      return FALSE;
+    }
+  }
+  return is_wild;
+}
+
+unsigned int hash_number(char *number) {
+  unsigned int hash = 2166136261u;
+
+  while(*number) {
+    hash = (hash ^ (unsigned char)*number++) * 16777619u;
+  }
+  return hash;
+}
+
+int add_node(pb_book *b) {
+  pb_node *nodes;
+  int size = (b->node_size ? b->node_size * 2 : 64);
+  int i;
+
+  if(b->node_count == b->node_size) {
+    nodes = realloc(b->nodes, size * sizeof(pb_node));
+    if(nodes == NULL)
+      return -1;
+    b->nodes = nodes;
+    b->node_size = size;
+  }
+  for(i = 0; i < PB_KEYS; i++) {
+    b->nodes[b->node_count].child[i] = 0;
+  }
+  b->nodes[b->node_count].end = -1;
+  b->nodes[b->node_count].any = -1;
+  return b->node_count++;
+}
+
+/*
+ * Files entry idx under its number in the trie.  The first rule for a
+ * pattern wins, as the first entry for a number does.
+ */
+int add_rule(pb_book *b, int idx) {
+  char *p = b->entries[idx].number;
+  int node = 0;
+  int key;
+  int next;
+
+  for(; *p && *p != '*'; p++) {
+    key = (isdigit((unsigned char)*p) ? *p - '0' : PB_ANY_DIGIT);
+    if(b->nodes[node].child[key] == 0) {
+      if(0 > (next = add_node(b)))
+        return -1;
+      b->nodes[node].child[key] = next;
+    }
+    node = b->nodes[node].child[key];
+  }
+  if(*p == '*' && b->nodes[node].any < 0) {
+    b->nodes[node].any = idx;
+  } else if(*p == 0 && b->nodes[node].end < 0) {
+    b->nodes[node].end = idx;
+  }
+  b->rules++;
+  return 0;
+}
+
+int add_entry(pb_book *b, pb_entry *e) {
+  pb_entry *entries;
+  int size = (b->size ? b->size * 2 : 64);
+
+  if(b->count == b->size) {
+    entries = realloc(b->entries, size * sizeof(pb_entry));
+    if(entries == NULL)
+      return -1;
+    b->entries = entries;
+    b->size = size;
+  }
+  b->entries[b->count] = *e;
+  if(is_rule(e->number) && 0 > add_rule(b, b->count))
+    return -1;
+  b->count++;
+  return 0;
+}
+
+/*
+ * Returns the entry for number, or -1.
+ */
+int find_number(pb_book *b, char *number) {
+  unsigned int i = hash_number(number) & (b->index_size - 1);
+
+  while(b->index[i] > -1) {
+    if(0 == strcmp(b->entries[b->index[i]].number, number))
+      return b->index[i];
+    i = (i + 1) & (b->index_size - 1);
+  }
+  return -1;
+}
+
+int build_index(pb_book *b) {
+  unsigned int j;
+  int i;
+
+  b->index_size = 64;
+  while(b->index_size < b->count * 2) {
+    b->index_size *= 2;
+  }
+  b->index = malloc(b->index_size * sizeof(int));
+  if(b->index == NULL)
+    return -1;
+  for(i = 0; i < b->index_size; i++) {
+    b->index[i] = -1;
+  }
+  for(i = 0; i < b->count; i++) {
+    if(is_rule(b->entries[i].number) || find_number(b, b->entries[i].number) > -1)
+      continue;
+    j = hash_number(b->entries[i].number) & (b->index_size - 1);
+    while(b->index[j] > -1) {
+      j = (j + 1) & (b->index_size - 1);
+    }
+    b->index[j] = i;
+  }
+  return 0;
+}
+
+/*
+ * Returns the most specific rule matching number, putting what its
+ * wildcards matched in wild (as long as number).  A digit is tried
+ * before x, and both before a *.
+ */
+int match_rule(pb_book *b, int node, char *number, char *wild, int len) {
+  pb_node *n = &b->nodes[node];
+  int rc;
+
+  if(*number == 0 && n->end > -1) {
+    wild[len] = 0;
+    return n->end;
+  }
+  if(isdigit((unsigned char)*number)) {
+    if(n->child[*number - '0'] != 0
+       && -1 < (rc = match_rule(b, n->child[*number - '0'], number + 1, wild, len)))
+      return rc;
+    if(n->child[PB_ANY_DIGIT] != 0) {
+      wild[len] = *number;
+      if(-1 < (rc = match_rule(b, n->child[PB_ANY_DIGIT], number + 1, wild, len + 1)))
+        return rc;
+    }
+  }
+  if(n->any > -1) {
+    strcpy(wild + len, number);
+    return n->any;
+  }
+  return -1;
+}
+
+/*
+ * Returns the entry filed under number, exact or rule, or -1.
+ */
+int find_listed(pb_book *b, char *number) {
+  char *p = number;
+  int node = 0;
+  int key;
+
+  if(!is_rule(number))
+    return find_number(b, number);
+  for(; *p && *p != '*'; p++) {
+    key = (isdigit((unsigned char)*p) ? *p - '0' : PB_ANY_DIGIT);
+    node = b->nodes[node].child[key];
+    if(node == 0)
+      return -1;
+  }
+  return (*p == '*' ? b->nodes[node].any : b->nodes[node].end);
+}
+
+/*
+ * Carries the health and rotation of each host over from the old book,
+ * for hosts still listed under the same number.
+ */
+void keep_health(pb_book *b, pb_book *old) {
+  pb_entry *e;
+  pb_entry *o;
+  int idx;
+  int i;
+  int j;
+  int k;
+
+  for(i = 0; old != NULL && i < b->count; i++) {
+    e = &b->entries[i];
+    idx = find_listed(old, e->number);
+    if(idx < 0)
+      continue;
+    o = &old->entries[idx];
+    for(j = 0; j < e->count; j++) {
+      for(k = 0; k < o->count; k++) {
+        if(0 == strcmp(e->target[j].addr, o->target[k].addr)) {
+          e->target[j].credit = o->target[k].credit;
+          e->target[j].dead_until = __atomic_load_n(&o->target[k].dead_until, __ATOMIC_RELAXED);
+          break;
+        }
+      }
+    }
+  }
+}
+
+int enter_book(void) {
+  int phase = __atomic_load_n(&pb_phase, __ATOMIC_SEQ_CST);
+
+  __atomic_add_fetch(&pb_readers[phase], 1, __ATOMIC_SEQ_CST);
+  return phase;
+}
+
+void leave_book(int phase) {
+  __atomic_sub_fetch(&pb_readers[phase], 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Returns once nothing can still be reading a book swapped out before
+ * the call.  New readers go to the other phase, so each one drains.
+ */
+void wait_readers(void) {
+  int phase;
+  int i;
+
+  for(i = 0; i < 2; i++) {
+    phase = pb_phase;
+    __atomic_store_n(&pb_phase, phase ^ 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&pb_readers[phase], __ATOMIC_SEQ_CST) > 0) {
+      sched_yield();
+    }
+  }
+}
+
+void free_book(pb_book *b) {
+  if(b != NULL) {
+    free(b->entries);
+    free(b->index);
+    free(b->nodes);
+    free(b);
+  }
+}
+
+int load_entry(pb_book *b, char *line, char *where) {
+  pb_entry e;
+  char *to;
+
+  to = strchr(line, '=');
+  if(to != NULL)
+    *to++ = 0;
+  if(0 > parse_entry(&e, line, to)) {
+    LOG(LOG_ERROR, "Invalid phone book entry at %s", where);
+    return 0;
+  }
+  return add_entry(b, &e);
+}
+
+char *trim(char *text) {
+  char *end;
+
+  while(isspace((unsigned char)*text)) {
+    text++;
+  }
+  end = text + strlen(text);
+  while(end > text && isspace((unsigned char)end[-1])) {
+    *--end = 0;
+  }
+  return text;
+}
+
+int load_file(pb_book *b, char *name) {
+  char line[1024];
+  char where[256];
+  char *text;
+  FILE *file;
+  int count = 0;
+  int rc = 0;
+
+  if(NULL == (file = fopen(name, "r"))) {
+    ELOG(LOG_ERROR, "Could not open phone book %s", name);
+    return -1;
+  }
+  while(rc == 0 && NULL != fgets(line, sizeof(line), file)) {
+    count++;
+    text = trim(line);
+    if(text[0] != 0 && text[0] != '#') {
+      snprintf(where, sizeof(where), "%s:%d", name, count);
+      rc = load_entry(b, text, where);
+    }
+  }
+  fclose(file);
+  return rc;
+}
+
+/*
+ * Adds a number standing for "host[:port][*weight],...[/policy]".
+ * It takes effect at the next pb_load.
+ */
 int pb_add(char* from, char* to) {
+  pb_entry e;
+  char **args;
+  int size = (pb_arg_size ? pb_arg_size * 2 : 16);
+
   LOG_ENTER();
-  if(size < PBSIZE 
-     && from != NULL
-     && to != NULL
-     && strlen(from) > 0
-     && strlen(to) > 0
-    ) {
-    // should really trim spaces.
-    strncpy(phone_book[size][0], from, sizeof(phone_book[size][0]));
-    strncpy(phone_book[size][1], to, sizeof(phone_book[size][1]));
-    size++;
+  if(0 > parse_entry(&e, from, to)) {
+    LOG(LOG_ERROR, "Invalid phone book entry %s", (from != NULL ? from : ""));
     LOG_EXIT();
-    return 0;
+    return -1;
   }
+  if(pb_arg_count == pb_arg_size) {
+    args = realloc(pb_args, size * sizeof(char *));
+    if(args == NULL) {
+      LOG_EXIT();
+      return -1;
+    }
+    pb_args = args;
+    pb_arg_size = size;
+  }
+  pb_args[pb_arg_count] = malloc(strlen(from) + strlen(to) + 2);
+  if(pb_args[pb_arg_count] == NULL) {
+    LOG_EXIT();
+    return -1;
+  }
+  sprintf(pb_args[pb_arg_count++], "%s=%s", from, to);
   LOG_EXIT();
-  return -1;
+  return 0;
+}
+
+int pb_set_file(char *name) {
+  pb_file = name;
+  return 0;
 }
 
-char* pb_search(char *number) {
-  int i=0;
+/*
+ * Builds a new book from the -n entries and the phone book file, and
+ * swaps it for the old one.  Lookups never wait, on the file or the
+ * swap.  Hosts keep their health and rotation across a reload.  If the
+ * file cannot be read, the old book stays.
+ */
+int pb_load(void) {
+  char line[1024];
+  pb_book *b;
+  pb_book *old;
+  int rc = 0;
+  int i;
 
   LOG_ENTER();
-  for(i = 0; i < size; i++) {
-    if(strcmp(phone_book[i][0], number) == 0) {
+  b = calloc(1, sizeof(pb_book));
+  if(b == NULL || 0 > add_node(b)) {
+    free_book(b);
+    LOG_EXIT();
+    return -1;
+  }
+  for(i = 0; rc == 0 && i < pb_arg_count; i++) {
+    strncpy(line, pb_args[i], sizeof(line) - 1);
+    line[sizeof(line) - 1] = 0;
+    rc = load_entry(b, line, "-n");
+  }
+  if(rc == 0 && pb_file != NULL)
+    rc = load_file(b, pb_file);
+  if(rc == 0)
+    rc = build_index(b);
+  if(rc != 0) {
+    LOG(LOG_ERROR, "Keeping the phone book as it was");
+    free_book(b);
+    LOG_EXIT();
+    return -1;
+  }
 
-      LOG(LOG_INFO, "Found a match for '%s': '%s'", number, phone_book[i][1]);
-      strcpy(number, phone_book[i][1]);
-      break;
+  // only this thread swaps books, so the old one is safe to read here
+  old = pb_current;
+  pthread_mutex_lock(&pb_lock);
+  keep_health(b, old);
+  b->gen = ++pb_gen;
+  __atomic_store_n(&pb_current, b, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&pb_lock);
+  if(old != NULL) {
+    wait_readers();
+    free_book(old);
+  }
+  LOG(LOG_INFO, "Phone book has %d numbers and %d rules", b->count - b->rules, b->rules);
+  LOG_EXIT();
+  return 0;
+}
+
+/*
+ * Picks the host the rotation has come round to: each one earns its
+ * weight in credit per call, and the richest is picked and pays for it.
+ */
+int get_next(pb_entry *e, int *is_live) {
+  int total = 0;
+  int best = -1;
+  int i;
+
+  for(i = 0; i < e->count; i++) {
+    if(is_live[i]) {
+      e->target[i].credit += e->target[i].weight;
+      total += e->target[i].weight;
+      if(best < 0 || e->target[i].credit > e->target[best].credit)
+        best = i;
     }
   }
+  if(best > -1)
+    e->target[best].credit -= total;
+  return best;
+}
+
+/*
+ * Copies addr, with each $ replaced by wild.
+ */
+void put_addr(char *buf, char *addr, char *wild) {
+  int len = 0;
+  int i;
+
+  for(; *addr && len < PB_ADDR_LEN - 1; addr++) {
+    if(*addr == '$') {
+      for(i = 0; wild[i] && len < PB_ADDR_LEN - 1; i++) {
+        buf[len++] = wild[i];
+      }
+    } else {
+      buf[len++] = *addr;
+    }
+  }
+  buf[len] = 0;
+}
+
+/*
+ * Fills in the hosts to call for number, in the order to try them.
+ * Hosts that have not answered lately are left out, unless that would
+ * leave none.
+ */
+int pb_get_call(char *number, pb_call *call) {
+  int is_live[PB_TARGETS];
+  char wild[128];
+  long long now = evt_now();
+  pb_book *b;
+  pb_entry *e;
+  int idx = -1;
+  int live = 0;
+  int phase;
+  int first;
+  int i;
+
+  LOG_ENTER();
+  call->entry = -1;
+  call->policy = PB_FAILOVER;
+  call->timeout = PB_TIMEOUT;
+  call->count = 1;
+  call->target[0] = 0;
+  wild[0] = 0;
+  phase = enter_book();
+  b = __atomic_load_n(&pb_current, __ATOMIC_SEQ_CST);
+  if(b != NULL) {
+    idx = find_number(b, number);
+    if(idx < 0 && b->rules > 0 && strlen(number) < sizeof(wild))
+      idx = match_rule(b, 0, number, wild, 0);
+  }
+  if(idx < 0) {
+    leave_book(phase);
+    strncpy(call->addr[0], number, PB_ADDR_LEN - 1);
+    call->addr[0][PB_ADDR_LEN - 1] = 0;
+    LOG_EXIT();
+    return 0;
+  }
+
+  e = &b->entries[idx];
+  LOG(LOG_INFO, "Found a match for '%s' in '%s': %d host(s)", number, e->number, e->count);
+  call->entry = idx;
+  call->gen = b->gen;
+  call->policy = e->policy;
+  call->timeout = e->timeout;
+  call->count = 0;
+  for(i = 0; i < e->count; i++) {
+    is_live[i] = (__atomic_load_n(&e->target[i].dead_until, __ATOMIC_RELAXED) <= now);
+    live += is_live[i];
+  }
+  for(i = 0; live == 0 && i < e->count; i++) {
+    is_live[i] = TRUE;
+  }
+  first = 0;
+  if(e->policy == PB_ROUND_ROBIN) {
+    pthread_mutex_lock(&pb_lock);
+    first = get_next(e, is_live);
+    pthread_mutex_unlock(&pb_lock);
+  }
+  for(i = 0; i < e->count; i++) {
+    if(is_live[(first + i) % e->count]) {
+      call->target[call->count] = (first + i) % e->count;
+      put_addr(call->addr[call->count], e->target[(first + i) % e->count].addr, wild);
+      call->count++;
+    } else {
+      LOG(LOG_DEBUG, "Skipping %s for now", e->target[(first + i) % e->count].addr);
+    }
+  }
+  leave_book(phase);
   LOG_EXIT();
-  return number;
+  return 0;
+}
+
+/*
+ * Records whether host i of call answered.  Calls placed before the
+ * book was reloaded are not recorded.
+ */
+void pb_report(pb_call *call, int i, int is_up) {
+  pb_target *t;
+  pb_book *b;
+  int phase;
+
+  if(call->entry < 0)
+    return;
+  phase = enter_book();
+  b = __atomic_load_n(&pb_current, __ATOMIC_SEQ_CST);
+  if(b != NULL && b->gen == call->gen) {
+    t = &b->entries[call->entry].target[call->target[i]];
+    __atomic_store_n(&t->dead_until, (is_up ? 0 : evt_now() + PB_COOLDOWN * 1000LL), __ATOMIC_RELAXED);
+  }
+  leave_book(phase);
 }
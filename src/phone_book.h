@@ -1,3 +1,49 @@
+#ifndef PHONE_BOOK_H
+#define PHONE_BOOK_H 1
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+/* A number can stand for several hosts.  A call tries them one at a time
+ * (failover), all at once (race), or starting from the next one in a
+ * weighted rotation (rr).  A host that does not answer is skipped by
+ * later calls for PB_COOLDOWN seconds.
+ *
+ * Numbers are looked up in a hash table, and then in a trie of dial
+ * plan rules, where x stands for any digit and a trailing * for anything
+ * at all ("9*", "555xxxx").  A $ in a rule's hosts is replaced by what
+ * the wildcards matched.  The book is built from the -n entries and the
+ * phone book file, and rebuilt by pb_load, which keeps each host's
+ * health and rotation.
+ */
+#define PB_TARGETS 4
+#define PB_ADDR_LEN 128
+#define PB_TIMEOUT 10         // seconds a host gets before the next is tried
+#define PB_COOLDOWN 60
+
+enum {
+  PB_FAILOVER = 0,
+  PB_RACE,
+  PB_ROUND_ROBIN
+};
+
+typedef struct pb_call {
+  int entry;            // -1 if the number was not in the book
+  unsigned int gen;     // book the entry is in
+  int policy;
+  int timeout;          // seconds each host gets
+  int count;
+  int target[PB_TARGETS];   // host's place in the entry, for pb_report
+  char addr[PB_TARGETS][PB_ADDR_LEN];
+} pb_call;
+
 int pb_init(void);
 int pb_add(char *from, char *to);
-char *pb_search(char *number);
+int pb_set_file(char *name);
+int pb_load(void);
+int pb_get_call(char *number, pb_call *call);
+void pb_report(pb_call *call, int i, int is_up);
+
+#endif
@@ -0,0 +1,608 @@
+#ifdef __linux__
+#define _GNU_SOURCE       // for POLLRDHUP
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "banner.h"
+#include "debug.h"
+#include "ip.h"
+#include "util.h"
+#include "worker.h"
+#include "pool.h"
+
+const char MDM_BUSY[] = "BUSY\n";
+const char MDM_IN_LINE[] = "All lines are busy, you are number %d in line\r\n";
+
+modem_pool **pools = NULL;    // hunt groups, the default one first
+int pool_count = 0;
+evt_loop acceptors[MAX_WORKERS];  // one accept thread each
+
+void hold_timer_handler(evt_loop *loop, void *arg, int events);
+void accept_timer_handler(evt_loop *loop, void *arg, int events);
+
+/*
+ * The group that modems and group options on the command line go to
+ * now, which is the default group until -G starts another.
+ */
+modem_pool *get_group(void) {
+  if(pool_count == 0)
+    pool_add_group(POOL_DEFAULT_NAME, NULL);
+  return pools[pool_count - 1];
+}
+
+/*
+ * Starts a new hunt group, listening on addrs ("port", "address:port",
+ * or several of these split by commas).  Returns -1 if it could not be
+ * added, or the name is taken.
+ */
+int pool_add_group(char *name, char *addrs) {
+  modem_pool **list;
+  modem_pool *pool;
+  int i;
+
+  if(pool_count == 0 && 0 != strcmp(name, POOL_DEFAULT_NAME))
+    get_group();
+  for(i = 0; i < pool_count; i++) {
+    if(0 == strcmp(name, pools[i]->name))
+      return -1;
+  }
+  list = realloc(pools, (pool_count + 1) * sizeof(modem_pool *));
+  if(list == NULL)
+    return -1;
+  pools = list;
+  pool = calloc(1, sizeof(modem_pool));
+  if(pool == NULL)
+    return -1;
+  pool->id = pool_count;
+  pool->name = name;
+  pool->addrs = addrs;
+  pool->policy = POOL_FIRST;
+  pool->all_busy = "";
+  pool->no_answer = "";
+  pools[pool_count++] = pool;
+  return 0;
+}
+
+int pool_get_group(void) {
+  return get_group()->id;
+}
+
+int pool_set_policy(char *name) {
+  char *names[] = { "first", "rr", "lru", "traffic", "speed" };
+  int i;
+
+  for(i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if(0 == strcmp(name, names[i])) {
+      get_group()->policy = i;
+      return 0;
+    }
+  }
+  LOG(LOG_FATAL, "Unknown modem pool policy %s", name);
+  return -1;
+}
+
+void pool_set_busy(char *name) {
+  get_group()->all_busy = name;
+}
+
+void pool_set_no_answer(char *name) {
+  get_group()->no_answer = name;
+}
+
+/*
+ * The file a caller gets when the modem handed their call does not
+ * answer: the group's if it has one, or the modem's own.
+ */
+char *pool_get_no_answer(modem_config *cfg) {
+  modem_pool *pool = pools[cfg->pool_id];
+
+  return (strlen(pool->no_answer) > 0 ? pool->no_answer : cfg->no_answer);
+}
+
+void pool_set_line(int size) {
+  get_group()->line_size = (size > 0 ? size : 0);
+}
+
+void pool_set_hold_interval(int secs) {
+  get_group()->hold_interval = (secs > 0 ? secs : 0);
+}
+
+/*
+ * Calls are non-blocking, so a caller too slow to take the whole notice
+ * gets what fits, and a flood of them never holds up the accept thread.
+ */
+void busy_connection(modem_pool *pool, int cSocket) {
+  bnr_text *t;
+
+  // No tracing on this data output
+  if(strlen(pool->all_busy) < 1) {
+    if(-1 == write(cSocket, MDM_BUSY, strlen(MDM_BUSY)))
+      LOG(LOG_DEBUG, "Could not send busy notice");
+  } else if(NULL != (t = bnr_get(pool->all_busy))) {
+    if(t->len > 0 && -1 == write(cSocket, t->data, t->len))
+      LOG(LOG_DEBUG, "Could not send busy notice");
+    bnr_put(t);
+  }
+  close(cSocket);
+}
+
+/*
+ * The policy's key for a modem going into a free heap; the lowest key
+ * comes out first.
+ */
+long long get_key(modem_pool *pool, modem_config *cfg) {
+  switch(pool->policy) {
+    case POOL_RR:
+      return cfg->pool_turn;
+    case POOL_LRU:
+      return pool->turn++;
+    case POOL_TRAFFIC:
+      return cfg->traffic;
+    case POOL_SPEED:
+      return -(long long)cfg->line_speed;
+  }
+  return 0;
+}
+
+int is_before(modem_config *a, modem_config *b) {
+  return a->pool_key < b->pool_key
+         || (a->pool_key == b->pool_key && a->id < b->id);
+}
+
+void put_at(pool_heap *h, int i, modem_config *cfg) {
+  h->cfg[i] = cfg;
+  cfg->pool_idx = i;
+}
+
+void heap_up(pool_heap *h, int i) {
+  modem_config *cfg = h->cfg[i];
+
+  while(i > 0 && is_before(cfg, h->cfg[(i - 1) / 2])) {
+    put_at(h, i, h->cfg[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  put_at(h, i, cfg);
+}
+
+void heap_down(pool_heap *h, int i) {
+  modem_config *cfg = h->cfg[i];
+  int child;
+
+  while((child = 2 * i + 1) < h->count) {
+    if(child + 1 < h->count && is_before(h->cfg[child + 1], h->cfg[child]))
+      child++;
+    if(!is_before(h->cfg[child], cfg))
+      break;
+    put_at(h, i, h->cfg[child]);
+    i = child;
+  }
+  put_at(h, i, cfg);
+}
+
+void heap_add(pool_heap *h, modem_config *cfg) {
+  put_at(h, h->count++, cfg);
+  heap_up(h, cfg->pool_idx);
+}
+
+void heap_remove(pool_heap *h, modem_config *cfg) {
+  modem_config *last;
+  int i = cfg->pool_idx;
+
+  cfg->pool_idx = -1;
+  if(i != --h->count) {
+    last = h->cfg[h->count];
+    put_at(h, i, last);
+    heap_up(h, i);
+    heap_down(h, last->pool_idx);
+  }
+}
+
+void add_free(modem_pool *pool, modem_config *cfg) {
+  cfg->pool_key = get_key(pool, cfg);
+  heap_add(&pool->free[cfg->pool_state - 1], cfg);
+}
+
+/*
+ * Takes the free modem the policy likes best, preferring ones that
+ * answer by themselves, and marks it as handed a call.
+ */
+modem_config *get_modem(modem_pool *pool) {
+  modem_config *cfg = NULL;
+  pool_heap *h;
+
+  pthread_mutex_lock(&pool->free_lock);
+  h = &pool->free[POOL_AUTO - 1];
+  if(h->count == 0)
+    h = &pool->free[POOL_MANUAL - 1];
+  if(h->count > 0) {
+    cfg = h->cfg[0];
+    heap_remove(h, cfg);
+    cfg->pool_turn = ++pool->turn;
+    cfg->is_call_pending = TRUE;
+    LOG(LOG_DEBUG, "Sending incoming connection for %s to modem #%d", pool->name, cfg->id);
+  }
+  pthread_mutex_unlock(&pool->free_lock);
+  return cfg;
+}
+
+/*
+ * Called by a worker when one of its modems changes state.  A modem
+ * handed a call stays out of the heaps until its worker has taken it.
+ */
+void pool_update(modem_config *cfg, int state) {
+  modem_pool *pool = pools[cfg->pool_id];
+
+  pthread_mutex_lock(&pool->free_lock);
+  if(cfg->pool_idx > -1)
+    heap_remove(&pool->free[cfg->pool_state - 1], cfg);
+  cfg->pool_state = state;
+  if(state != POOL_BUSY && !__atomic_load_n(&cfg->is_call_pending, __ATOMIC_ACQUIRE))
+    add_free(pool, cfg);
+  pthread_mutex_unlock(&pool->free_lock);
+  // someone may be waiting in line for it
+  if(state != POOL_BUSY && __atomic_load_n(&pool->waiting, __ATOMIC_ACQUIRE) > 0)
+    writePipe(pool->hp[1], 'F');
+}
+
+/*
+ * Hands a call to a free modem's worker.  Returns -1 if there is none.
+ */
+int answer_call(modem_pool *pool, int fd, struct sockaddr_storage *addr, socklen_t len, long long accepted) {
+  modem_config *cfg = get_modem(pool);
+
+  if(cfg == NULL)
+    return -1;
+  if(-1 == wkr_call(cfg, fd, addr, len, accepted)) {
+    // give the modem back
+    pthread_mutex_lock(&pool->free_lock);
+    cfg->is_call_pending = FALSE;
+    if(cfg->pool_state != POOL_BUSY && cfg->pool_idx < 0)
+      add_free(pool, cfg);
+    pthread_mutex_unlock(&pool->free_lock);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Puts a caller in line.  Returns -1 if the line is full.
+ */
+int hold_call(modem_pool *pool, int fd, struct sockaddr_storage *addr, socklen_t len, long long accepted) {
+  pool_caller *c;
+
+  pthread_mutex_lock(&pool->lock);
+  if(pool->waiting == pool->line_size) {
+    pthread_mutex_unlock(&pool->lock);
+    return -1;
+  }
+  c = &pool->line[pool->waiting];
+  c->fd = fd;
+  memcpy(&c->addr, addr, len);
+  c->addr_len = len;
+  c->accepted = accepted;
+  c->is_told = FALSE;
+  __atomic_store_n(&pool->waiting, pool->waiting + 1, __ATOMIC_RELEASE);
+  if(pool->waiting > pool->most_waiting)
+    pool->most_waiting = pool->waiting;
+  pthread_mutex_unlock(&pool->lock);
+  writePipe(pool->hp[1], 'W');
+  return 0;
+}
+
+/*
+ * Accepts every waiting call and queues each for the worker owning the
+ * modem it goes to, so a burst of calls is answered by all the workers
+ * at once.  While anyone is in line, new callers join the end of it.
+ */
+void listen_handler(evt_loop *loop, void *arg, int events) {
+  pool_listener *l = (pool_listener *)arg;
+  struct sockaddr_storage addr;
+  socklen_t len;
+  long long now;
+  int fd;
+
+  while((fd = ip_accept_call(l->sfd, &addr, &len)) > -1) {
+    now = evt_now();
+    if((__atomic_load_n(&l->pool->waiting, __ATOMIC_ACQUIRE) > 0
+        || -1 == answer_call(l->pool, fd, &addr, len, now))
+       && -1 == hold_call(l->pool, fd, &addr, len, now)) {
+      LOG(LOG_DEBUG, "No open modem to send to, send notice and close");
+      busy_connection(l->pool, fd);
+    }
+  }
+  if(errno != EAGAIN && errno != EWOULDBLOCK) {
+    // calls are still waiting, and the listener may not say so again
+    evt_mod(&l->listen_evt, 0);
+    evt_timer_set(loop, &l->accept_timer, IP_ACCEPT_BACKOFF, accept_timer_handler, l);
+  }
+}
+
+void accept_timer_handler(evt_loop *loop, void *arg, int events) {
+  pool_listener *l = (pool_listener *)arg;
+
+  evt_mod(&l->listen_evt, EVT_READ);
+  listen_handler(loop, arg, EVT_READ);
+}
+
+void drop_caller(modem_pool *pool, int i) {
+  __atomic_store_n(&pool->waiting, pool->waiting - 1, __ATOMIC_RELEASE);
+  memmove(&pool->line[i], &pool->line[i + 1], (pool->waiting - i) * sizeof(pool_caller));
+}
+
+void log_line(modem_pool *pool, char *what, long long wait) {
+  LOG(LOG_INFO,
+      "Caller for %s %s after %lld ms in line, %d waiting (%d at most), %lu answered, %lu hung up, %lld ms average wait, %lld ms worst",
+      pool->name,
+      what,
+      wait,
+      pool->waiting,
+      pool->most_waiting,
+      pool->answered,
+      pool->abandoned,
+      (pool->answered ? pool->total_wait_ms / (long long)pool->answered : 0),
+      pool->max_wait_ms
+     );
+}
+
+/*
+ * Returns TRUE if the caller has hung up.  Whatever they typed is left
+ * for the modem that answers them.
+ */
+int is_gone(int fd) {
+#ifdef POLLRDHUP
+  struct pollfd p;
+
+  p.fd = fd;
+  p.events = POLLRDHUP;
+  p.revents = 0;
+  return poll(&p, 1, 0) > 0;
+#else
+  unsigned char ch;
+  int rc = recv(fd, &ch, 1, MSG_PEEK);
+
+  return rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+#endif
+}
+
+/*
+ * Tells a caller their place in line, without waiting on them.  Returns
+ * -1 if they are gone.
+ */
+int tell_place(pool_caller *c, int place) {
+  char msg[80];
+  int len = snprintf(msg, sizeof(msg), MDM_IN_LINE, place);
+
+  c->is_told = TRUE;
+  if(-1 == write(c->fd, msg, len) && errno != EAGAIN && errno != EWOULDBLOCK)
+    return -1;
+  return 0;
+}
+
+/*
+ * Answers callers from the front of the line while there are free
+ * modems, drops those who hung up, and tells the rest where they
+ * stand.
+ */
+void serve_line(modem_pool *pool, int is_check) {
+  long long now = evt_now();
+  long long wait;
+  int is_telling;
+  pool_caller *c;
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  while(pool->waiting > 0
+        && 0 == answer_call(pool, pool->line[0].fd, &pool->line[0].addr, pool->line[0].addr_len, pool->line[0].accepted)) {
+    wait = now - pool->line[0].accepted;
+    pool->answered++;
+    pool->total_wait_ms += wait;
+    if(wait > pool->max_wait_ms)
+      pool->max_wait_ms = wait;
+    drop_caller(pool, 0);
+    log_line(pool, "answered", wait);
+  }
+  is_telling = (pool->hold_interval > 0 && is_check
+                && now - pool->last_told >= pool->hold_interval * 1000LL);
+  if(is_telling)
+    pool->last_told = now;
+  for(i = 0; i < pool->waiting; i++) {
+    c = &pool->line[i];
+    if((is_check && is_gone(c->fd))
+       || ((is_telling || (pool->hold_interval > 0 && !c->is_told))
+           && -1 == tell_place(c, i + 1))) {
+      wait = now - c->accepted;
+      pool->abandoned++;
+      close(c->fd);
+      drop_caller(pool, i--);
+      log_line(pool, "hung up", wait);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  // look at the line now and then while anyone is in it
+  if(pool->waiting > 0 && !pool->is_timed) {
+    pool->is_timed = TRUE;
+    evt_timer_set(pool->hp_evt.loop, &pool->hold_timer, POOL_CHECK_INTERVAL, hold_timer_handler, pool);
+  }
+}
+
+void hold_timer_handler(evt_loop *loop, void *arg, int events) {
+  modem_pool *pool = (modem_pool *)arg;
+
+  pool->is_timed = FALSE;
+  serve_line(pool, TRUE);
+}
+
+void hold_handler(evt_loop *loop, void *arg, int events) {
+  modem_pool *pool = (modem_pool *)arg;
+  unsigned char buf[64];
+
+  while(readPipe(pool->hp[0], buf, sizeof(buf)) == sizeof(buf));
+  serve_line(pool, FALSE);
+}
+
+/*
+ * Sets up a group holding count of the modems.
+ */
+int init_group(modem_pool *pool, int count) {
+  int i;
+
+  pool->cfg = calloc(count, sizeof(modem_config *));
+  pool->count = 0;
+  pthread_mutex_init(&pool->free_lock, NULL);
+  for(i = 0; i < 2; i++) {
+    pool->free[i].count = 0;
+    pool->free[i].cfg = calloc(count, sizeof(modem_config *));
+    if(pool->cfg == NULL || pool->free[i].cfg == NULL) {
+      ELOG(LOG_FATAL, "Could not allocate modem pool");
+      return -1;
+    }
+  }
+  pool->turn = 0;
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->line = NULL;
+  if(pool->line_size > 0
+     && NULL == (pool->line = calloc(pool->line_size, sizeof(pool_caller)))) {
+    ELOG(LOG_FATAL, "Could not allocate room for %d callers in line", pool->line_size);
+    return -1;
+  }
+  pool->waiting = 0;
+  pool->is_timed = FALSE;
+  pool->last_told = 0;
+  pool->answered = 0;
+  pool->abandoned = 0;
+  pool->most_waiting = 0;
+  pool->total_wait_ms = 0;
+  pool->max_wait_ms = 0;
+  evt_init_handler(&pool->hp_evt);
+  evt_init_timer(&pool->hold_timer);
+  // workers must never block on a full pipe
+  if(-1 == pipe(pool->hp)
+     || -1 == fcntl(pool->hp[1], F_SETFL, O_NONBLOCK)) {
+    ELOG(LOG_FATAL, "Modem pool IPC pipe could not be created");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Sorts the modems into their groups.  The default group listens on
+ * ip_addr.
+ */
+int pool_init(modem_config **cfg, int count, char *ip_addr) {
+  int *size;
+  int i;
+
+  get_group();
+  if(pools[0]->addrs == NULL)
+    pools[0]->addrs = ip_addr;
+  size = calloc(pool_count, sizeof(int));
+  if(size == NULL)
+    return -1;
+  for(i = 0; i < count; i++) {
+    size[cfg[i]->pool_id]++;
+  }
+  for(i = 0; i < pool_count; i++) {
+    if(-1 == init_group(pools[i], size[i])) {
+      free(size);
+      return -1;
+    }
+  }
+  free(size);
+  for(i = 0; i < count; i++) {
+    pools[cfg[i]->pool_id]->cfg[pools[cfg[i]->pool_id]->count++] = cfg[i];
+  }
+  return 0;
+}
+
+void *listen_thread(void *arg) {
+  evt_run((evt_loop *)arg);
+  return NULL;
+}
+
+/*
+ * Listens on addr for pool, with a socket for each accept thread, or as
+ * many as the system lets share the port.
+ */
+int add_listeners(modem_pool *pool, char *addr) {
+  pool_listener *l;
+  int fd;
+  int i;
+
+  // a shared port would let a second tcpser take half our calls, so
+  // first make sure no one else is listening on it.
+  fd = ip_init_server_conn(addr);
+  if(-1 == fd) {
+    LOG(LOG_FATAL, "Could not listen on %s for %s", addr, pool->name);
+    return -1;
+  }
+  close(fd);
+  for(i = 0; i < wkr_get_count(); i++) {
+    l = calloc(1, sizeof(pool_listener));
+    if(l == NULL)
+      return -1;
+    l->pool = pool;
+    l->sfd = ip_init_call_conn(addr);
+    if(-1 == l->sfd) {
+      free(l);
+      if(i == 0)
+        return -1;
+      LOG(LOG_WARN, "Could not share %s, using %d listener(s)", addr, i);
+      break;
+    }
+    evt_init_handler(&l->listen_evt);
+    evt_init_timer(&l->accept_timer);
+    if(-1 == evt_add(&acceptors[i], &l->listen_evt, l->sfd, EVT_READ, listen_handler, l))
+      return -1;
+  }
+  LOG(LOG_INFO, "Listening on %s for %s", addr, pool->name);
+  return 0;
+}
+
+/*
+ * Opens the listening sockets of every group that has modems, and
+ * starts the accept threads.  Each listening socket's handler knows its
+ * group, so a call goes straight to the group it was made to.  The
+ * lines are looked after by loop.
+ */
+int pool_start(evt_loop *loop) {
+  modem_pool *pool;
+  char *addrs;
+  char *addr;
+  char *next;
+  int i;
+
+  for(i = 0; i < wkr_get_count(); i++) {
+    if(-1 == evt_init(&acceptors[i]))
+      return -1;
+  }
+  for(i = 0; i < pool_count; i++) {
+    pool = pools[i];
+    if(pool->count == 0) {
+      if(i > 0)
+        LOG(LOG_WARN, "Hunt group %s has no modems", pool->name);
+      continue;
+    }
+    if(-1 == evt_add(loop, &pool->hp_evt, pool->hp[0], EVT_READ, hold_handler, pool))
+      return -1;
+    addrs = strdup(pool->addrs);
+    if(addrs == NULL)
+      return -1;
+    for(addr = strtok_r(addrs, ",", &next); addr != NULL; addr = strtok_r(NULL, ",", &next)) {
+      if(-1 == add_listeners(pool, addr)) {
+        free(addrs);
+        return -1;
+      }
+    }
+    free(addrs);
+  }
+  for(i = 0; i < wkr_get_count(); i++) {
+    spawn_thread(listen_thread, (void *)&acceptors[i], "ACCEPT");
+  }
+  return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef POOL_H
+#define POOL_H 1
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "evt.h"
+#include "modem_core.h"
+#include "worker.h"
+
+#define POOL_CHECK_INTERVAL 1000    // ms between looks at the callers in line
+#define POOL_DEFAULT_NAME "main"    // the group -p listens for
+
+// a modem as the pool sees it
+enum {
+  POOL_BUSY = 0,
+  POOL_MANUAL,          // free, rings until answered with ATA
+  POOL_AUTO             // free, and answers by itself (S0 set)
+};
+
+// which free modem a call goes to
+enum {
+  POOL_FIRST = 0,       // the first one
+  POOL_RR,              // the one handed a call longest ago
+  POOL_LRU,             // the one on hook longest
+  POOL_TRAFFIC,         // the one that has carried the least data
+  POOL_SPEED            // the fastest one
+};
+
+/* Free modems are kept in heaps ordered by the policy, one for modems
+ * that answer by themselves, which are tried first, and one for the
+ * rest.  Workers move their modems in and out as they go on and off
+ * hook, so picking one never looks at the busy ones.
+ */
+typedef struct pool_heap {
+  modem_config **cfg;
+  int count;
+} pool_heap;
+
+/* Callers who find every modem busy can wait in line, up to a set
+ * number of them, instead of getting BUSY.  Each goes to the next modem
+ * that goes back on hook, oldest first.  The line is kept by the main
+ * loop; accept threads only add to it.
+ */
+typedef struct pool_caller {
+  int fd;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  long long accepted;   // ms, see evt_now
+  int is_told;          // has heard its place in line
+} pool_caller;
+
+/* A hunt group: modems that share listening addresses, a policy, a line,
+ * and busy and no answer banners.  Modems not put in a group with -G are in the
+ * default group, which listens on -p.
+ */
+typedef struct modem_pool {
+  int id;
+  char *name;
+  char *addrs;              // "address[:port]" list, split by commas
+  int policy;
+  int hold_interval;        // seconds, 0 to never tell callers their place
+  modem_config **cfg;
+  int count;
+  char *all_busy;
+  char *no_answer;          // sent instead of the modem's own -N file
+  pthread_mutex_t free_lock;
+  pool_heap free[2];        // POOL_MANUAL and POOL_AUTO modems
+  unsigned long long turn;  // counts calls handed out and modems freed
+  pthread_mutex_t lock;     // for the line
+  pool_caller *line;        // callers waiting, oldest first
+  int line_size;
+  int waiting;
+  int hp[2];                // wake ups for the main loop
+  evt_handler hp_evt;
+  evt_timer hold_timer;
+  int is_timed;
+  long long last_told;
+  unsigned long answered;
+  unsigned long abandoned;
+  int most_waiting;
+  long long total_wait_ms;
+  long long max_wait_ms;
+} modem_pool;
+
+/* There is an accept thread for each worker, and each listens on every
+ * group's addresses with sockets of its own, so a flood of calls is
+ * accepted as fast as the workers can answer them.  Any accept thread
+ * may hand a call to any modem in the socket's group.
+ */
+typedef struct pool_listener {
+  modem_pool *pool;
+  int sfd;
+  evt_handler listen_evt;
+  evt_timer accept_timer;   // to accept again after running out of descriptors
+} pool_listener;
+
+int pool_add_group(char *name, char *addrs);
+int pool_get_group(void);
+int pool_set_policy(char *name);
+void pool_set_busy(char *name);
+void pool_set_no_answer(char *name);
+char *pool_get_no_answer(modem_config *cfg);
+void pool_set_line(int size);
+void pool_set_hold_interval(int secs);
+int pool_init(modem_config **cfg, int count, char *ip_addr);
+int pool_start(evt_loop *loop);
+void pool_update(modem_config *cfg, int state);
+
+#endif
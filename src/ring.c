@@ -0,0 +1,315 @@
+#include <pthread.h>
+#include <stdlib.h>       // for malloc...
+#include <string.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "ring.h"
+
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned char *ring_spare = NULL;   // each holds the next in its first bytes
+
+void ring_init(ring *r) {
+  r->buf = NULL;
+  r->head = 0;
+  r->tail = 0;
+}
+
+int ring_alloc(ring *r) {
+  if(r->buf != NULL)
+    return 0;
+  pthread_mutex_lock(&ring_lock);
+  if(ring_spare != NULL) {
+    r->buf = ring_spare;
+    memcpy(&ring_spare, r->buf, sizeof(ring_spare));
+  }
+  pthread_mutex_unlock(&ring_lock);
+  if(r->buf == NULL && NULL == (r->buf = malloc(RING_SIZE))) {
+    ELOG(LOG_ERROR, "Could not allocate output queue");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Hands the buffer back if nothing is queued in it, and no write the
+ * loop started is still reading it.
+ */
+void ring_release(ring *r, evt_handler *h) {
+  if(r->buf == NULL || ring_len(r) > 0 || evt_write_busy(h))
+    return;
+  pthread_mutex_lock(&ring_lock);
+  memcpy(r->buf, &ring_spare, sizeof(ring_spare));
+  ring_spare = r->buf;
+  pthread_mutex_unlock(&ring_lock);
+  r->buf = NULL;
+  r->head = 0;
+  r->tail = 0;
+}
+
+/*
+ * Empties the queue, but keeps the buffer, see ring_release.
+ */
+void ring_clear(ring *r) {
+  r->head = 0;
+  r->tail = 0;
+}
+
+int ring_len(ring *r) {
+  return (int)(r->tail - r->head);
+}
+
+int ring_put(ring *r, unsigned char *data, int len) {
+  unsigned int pos;
+  int n;
+
+  if(0 > ring_alloc(r))
+    return 0;
+  if(len > RING_SIZE - ring_len(r))
+    len = RING_SIZE - ring_len(r);
+  pos = r->tail & (RING_SIZE - 1);
+  n = (len < RING_SIZE - pos ? len : RING_SIZE - pos);
+  memcpy(r->buf + pos, data, n);
+  memcpy(r->buf, data + n, len - n);
+  r->tail += len;
+  return len;
+}
+
+int write_some(int fd, unsigned char *data, int len) {
+  int rc;
+
+  do {
+    rc = write(fd, data, len);
+  } while(rc < 0 && errno == EINTR);
+  if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
+  return rc;
+}
+
+int get_iov(ring *r, struct iovec *iov) {
+  unsigned int pos = r->head & (RING_SIZE - 1);
+  int len = ring_len(r);
+
+  iov[0].iov_base = r->buf + pos;
+  iov[0].iov_len = (len < RING_SIZE - pos ? len : RING_SIZE - pos);
+  iov[1].iov_base = r->buf;
+  iov[1].iov_len = len - iov[0].iov_len;
+  return (iov[1].iov_len ? 2 : 1);
+}
+
+/*
+ * Writes as much of the queue as fd will take.  Returns the number of
+ * bytes still queued, or -1 if the descriptor failed.
+ */
+int ring_flush(ring *r, int fd) {
+  struct iovec iov[2];
+  int cnt;
+  int rc;
+
+  while(ring_len(r) > 0) {
+    cnt = get_iov(r, iov);
+    do {
+      rc = writev(fd, iov, cnt);
+    } while(rc < 0 && errno == EINTR);
+    if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if(rc < 0) {
+      ELOG(LOG_WARN, "Could not write queued data to fd %d", fd);
+      return -1;
+    }
+    r->head += rc;
+  }
+  return ring_len(r);
+}
+
+/*
+ * On an io_uring loop the loop writes sockets itself.  The queue is
+ * handed to it whenever the last write has finished, and the bytes stay
+ * queued until they are written.
+ */
+int complete_async(ring *r, evt_handler *h) {
+  int rc;
+
+  rc = evt_write_done(h);
+  if(rc < 0) {
+    ELOG(LOG_WARN, "Could not write queued data to fd %d", h->fd);
+    return -1;
+  }
+  r->head += rc;
+  return 0;
+}
+
+int submit_async(ring *r, evt_handler *h) {
+  struct iovec iov[2];
+
+  if(evt_write_busy(h))
+    return 0;
+  // a finished write has to come off the queue before the next starts
+  if(0 > complete_async(r, h))
+    return -1;
+  if(ring_len(r) == 0)
+    return 0;
+  return evt_writev(h, iov, get_iov(r, iov));
+}
+
+/*
+ * Callers stop whatever feeds a queue before it can fill (see
+ * update_flow), so data the queue has no room for is never cut short,
+ * it is refused whole and the send fails.
+ */
+int check_room(ring *r, int fd, int len) {
+  if(len <= RING_SIZE - ring_len(r))
+    return 0;
+  LOG(LOG_ERROR, "Output queue for fd %d has no room for %d bytes", fd, len);
+  errno = ENOBUFS;
+  return -1;
+}
+
+int send_async(ring *r, evt_handler *h, unsigned char *data, int len) {
+  // a finished write may make room
+  if(ring_len(r) + len > RING_SIZE && 0 > submit_async(r, h))
+    return -1;
+  if(0 > check_room(r, h->fd, len) || ring_put(r, data, len) < len)
+    return -1;
+  if(0 > submit_async(r, h))
+    return -1;
+  return len;
+}
+
+/*
+ * Writes data to fd without blocking, queueing whatever does not fit and
+ * asking the loop for a write event on h.  Never waits, and never drops
+ * any of data: it is all written or queued, or -1 is returned.
+ */
+int ring_send(ring *r, evt_handler *h, int fd, unsigned char *data, int len) {
+  int sent = 0;
+  int rc;
+
+  if(fd < 0)
+    return -1;
+  if(h->fd == fd && evt_is_async(h))
+    return send_async(r, h, data, len);
+  // the descriptor may take some of the queue now, and make room
+  if(ring_len(r) + len > RING_SIZE && 0 > ring_flush(r, fd))
+    return -1;
+  if(0 > check_room(r, fd, len))
+    return -1;
+  if(ring_len(r) == 0) {
+    // nothing queued ahead of us, so go straight to the descriptor
+    rc = write_some(fd, data, len);
+    if(rc < 0)
+      return -1;
+    sent = rc;
+  }
+  if(sent < len && ring_put(r, data + sent, len - sent) < len - sent)
+    return -1;
+  if(ring_len(r) > 0 && h->fd == fd) {
+    evt_mod(h, h->events | EVT_WRITE);
+  }
+  return len;
+}
+
+/*
+ * As ring_send, for data that has to wait behind something the caller
+ * still holds elsewhere, so it is never written straight away.
+ */
+int ring_queue(ring *r, evt_handler *h, int fd, unsigned char *data, int len) {
+  if(fd < 0)
+    return -1;
+  if(0 > check_room(r, fd, len) || ring_put(r, data, len) < len)
+    return -1;
+  if(h->fd == fd) {
+    evt_mod(h, h->events | EVT_WRITE);
+  }
+  return len;
+}
+
+/*
+ * Starts writing what ring_put left in the queue, and asks for a write
+ * event on h if fd will not take all of it.  Returns the number of bytes
+ * still queued, or -1 if the descriptor failed.
+ */
+int ring_push(ring *r, evt_handler *h, int fd) {
+  int rc;
+
+  if(fd < 0)
+    return -1;
+  if(h->fd == fd && evt_is_async(h))
+    return (0 > submit_async(r, h) ? -1 : ring_len(r));
+  rc = ring_flush(r, fd);
+  if(rc > 0 && h->fd == fd) {
+    evt_mod(h, h->events | EVT_WRITE);
+  }
+  return rc;
+}
+
+/*
+ * As ring_send, for data in slices.  The slices go out in one writev
+ * when nothing is queued.
+ */
+int ring_sendv(ring *r, evt_handler *h, int fd, struct iovec *iov, int cnt) {
+  int len = 0;
+  int rc = 0;
+  int i;
+
+  if(fd < 0)
+    return -1;
+  for(i = 0; i < cnt; i++) {
+    len += iov[i].iov_len;
+  }
+  if(h->fd == fd && evt_is_async(h)) {
+    if(ring_len(r) + len > RING_SIZE && 0 > submit_async(r, h))
+      return -1;
+    if(0 > check_room(r, fd, len))
+      return -1;
+    for(i = 0; i < cnt; i++) {
+      if(0 > send_async(r, h, iov[i].iov_base, iov[i].iov_len))
+        return -1;
+    }
+    return len;
+  }
+  if(ring_len(r) + len > RING_SIZE && 0 > ring_flush(r, fd))
+    return -1;
+  if(0 > check_room(r, fd, len))
+    return -1;
+  if(ring_len(r) == 0) {
+    do {
+      rc = writev(fd, iov, cnt);
+    } while(rc < 0 && errno == EINTR);
+    if(rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if(rc < 0)
+      rc = 0;
+  }
+  // queue whatever the descriptor did not take
+  for(i = 0; i < cnt; i++) {
+    if(rc >= (int)iov[i].iov_len) {
+      rc -= iov[i].iov_len;
+    } else {
+      if(0 > ring_send(r, h, fd, (unsigned char *)iov[i].iov_base + rc, iov[i].iov_len - rc))
+        return -1;
+      rc = 0;
+    }
+  }
+  return len;
+}
+
+/*
+ * Called when h is writable, stops write events once the queue is empty.
+ */
+int ring_drain(ring *r, evt_handler *h) {
+  int rc;
+
+  if(evt_is_async(h)) {
+    // write events are how the loop says a write finished
+    evt_mod(h, h->events & ~EVT_WRITE);
+    if(0 > submit_async(r, h))
+      return -1;
+    return ring_len(r);
+  }
+  rc = ring_flush(r, h->fd);
+  if(rc < 1) {
+    evt_mod(h, h->events & ~EVT_WRITE);
+  }
+  return rc;
+}
@@ -0,0 +1,35 @@
+#ifndef RING_H
+#define RING_H 1
+
+#include <sys/uio.h>
+
+#include "evt.h"
+
+/* Output queues hold at most RING_SIZE bytes (must be a power of two).
+ * The buffer is taken by ring_alloc, or the first time a write comes up
+ * short, and handed back by ring_release once the queue is empty.  Those
+ * handed back are kept for the next queue that needs one, rather than
+ * going back to the heap.
+ */
+#define RING_SIZE 65536
+
+typedef struct ring {
+  unsigned char *buf;
+  unsigned int head;    // free running, masked on access
+  unsigned int tail;
+} ring;
+
+void ring_init(ring *r);
+int ring_alloc(ring *r);
+void ring_release(ring *r, evt_handler *h);
+void ring_clear(ring *r);
+int ring_len(ring *r);
+int ring_put(ring *r, unsigned char *data, int len);
+int ring_flush(ring *r, int fd);
+int ring_send(ring *r, evt_handler *h, int fd, unsigned char *data, int len);
+int ring_queue(ring *r, evt_handler *h, int fd, unsigned char *data, int len);
+int ring_push(ring *r, evt_handler *h, int fd);
+int ring_sendv(ring *r, evt_handler *h, int fd, struct iovec *iov, int cnt);
+int ring_drain(ring *r, evt_handler *h);
+
+#endif
@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <errno.h>
+#include "util.h"
 #include "dce.h"
 #include "debug.h"
 
@@ -97,10 +99,6 @@ int ser_init_conn(char *tty, int speed) {
     } else {
       LOG(LOG_INFO, "Opened serial device %s at speed %d as fd %d", tty, speed, fd);
 
-      /* Make the file descriptor asynchronous (the manual page says only 
-         O_APPEND and O_NONBLOCK, will work with F_SETFL...) */
-      fcntl(fd, F_SETFL, FASYNC);
-
       tio.c_cflag = CS8 | CLOCAL | CREAD | CRTSCTS;
       tio.c_iflag = IGNBRK;
       tio.c_oflag = 0;
@@ -152,6 +150,19 @@ int ser_get_control_lines(int fd) {
          );
 }
 
+/*
+ * Sleeps until one of the modem status inputs changes.  Returns -1 if
+ * the driver (or platform) cannot wait for line changes.
+ */
+int ser_wait_control_lines(int fd) {
+#ifdef TIOCMIWAIT
+  return ioctl(fd, TIOCMIWAIT, TIOCM_DSR | TIOCM_CD | TIOCM_RNG | TIOCM_CTS);
+#else
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
 int ser_set_control_lines(int fd, int state) {
   int status;
 
@@ -172,9 +183,23 @@ int ser_set_control_lines(int fd, int state) {
   return 0;
 }
 
+int ser_get_pending(int fd) {
+  int pending = 0;
+
+#ifdef TIOCINQ
+  if(0 > ioctl(fd, TIOCINQ, &pending)) {
+#else
+  if(0 > ioctl(fd, FIONREAD, &pending)) {
+#endif
+    ELOG(LOG_WARN, "Could not obtain serial port input backlog");
+    return -1;
+  }
+  return pending;
+}
+
 int ser_write(int fd, unsigned char* data, int len) {
   log_trace(TRACE_MODEM_OUT, data, len);
-  return write(fd, data, len);
+  return writeAll(fd, data, len);
 }
 
 int ser_read(int fd, unsigned char* data, int len) {
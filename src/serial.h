@@ -10,7 +10,9 @@ int ser_get_bps_const(int speed);
 int ser_init_conn(char *tty, int speed);
 int ser_set_flow_control(int fd, int status);
 int ser_get_control_lines(int fd);
+int ser_wait_control_lines(int fd);
 int ser_set_control_lines(int fd, int state);
+int ser_get_pending(int fd);
 int ser_write(int fd, unsigned char *data,int len);
 int ser_read(int fd, unsigned char *data, int len);
 
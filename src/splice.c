@@ -0,0 +1,90 @@
+#ifdef __linux__
+#define _GNU_SOURCE       // for splice
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "splice.h"
+
+void spl_init_config(spl_pipe *p) {
+  p->fd[0] = -1;
+  p->fd[1] = -1;
+  p->len = 0;
+}
+
+int spl_init(spl_pipe *p) {
+#ifdef __linux__
+  if(-1 == pipe(p->fd)) {
+    ELOG(LOG_ERROR, "Could not create splice pipe");
+    return -1;
+  }
+  p->len = 0;
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/*
+ * Moves up to len bytes from the descriptor into the pipe.  Returns the
+ * count moved, 0 at end of file, or -1 (EAGAIN if nothing was waiting).
+ */
+int spl_fill(spl_pipe *p, int from, int len) {
+#ifdef __linux__
+  int rc;
+
+  do {
+    rc = splice(from, NULL, p->fd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  } while(rc < 0 && errno == EINTR);
+  if(rc > 0)
+    p->len += rc;
+  return rc;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/*
+ * Moves as much of the pipe as the descriptor will take.  Returns the
+ * number of bytes still in the pipe, or -1 if the descriptor failed.
+ */
+int spl_drain(spl_pipe *p, int to) {
+#ifdef __linux__
+  int rc;
+
+  while(p->len > 0) {
+    do {
+      rc = splice(p->fd[0], NULL, to, NULL, p->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while(rc < 0 && errno == EINTR);
+    if(rc < 0 && errno == EAGAIN)
+      break;
+    if(rc < 0) {
+      ELOG(LOG_WARN, "Could not write spliced data to fd %d", to);
+      return -1;
+    }
+    p->len -= rc;
+  }
+#endif
+  return p->len;
+}
+
+/*
+ * Throws away whatever is still in the pipe, but keeps the pipe.
+ */
+void spl_clear(spl_pipe *p) {
+  unsigned char buf[4096];
+  int rc;
+
+  while(p->len > 0) {
+    rc = read(p->fd[0], buf, (p->len < sizeof(buf) ? p->len : sizeof(buf)));
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc <= 0)
+      break;
+    p->len -= rc;
+  }
+  p->len = 0;
+}
@@ -0,0 +1,19 @@
+#ifndef SPLICE_H
+#define SPLICE_H 1
+
+/* Raw call data can be moved between two descriptors through a pipe with
+ * splice(), and never be copied into user space.  Only Linux has it,
+ * elsewhere spl_init fails and the caller keeps copying.
+ */
+typedef struct spl_pipe {
+  int fd[2];
+  int len;              // bytes in the pipe not yet taken by the destination
+} spl_pipe;
+
+void spl_init_config(spl_pipe *p);
+int spl_init(spl_pipe *p);
+int spl_fill(spl_pipe *p, int from, int len);
+int spl_drain(spl_pipe *p, int to);
+void spl_clear(spl_pipe *p);
+
+#endif
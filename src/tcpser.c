@@ -2,38 +2,65 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 
 #include <sys/param.h>
-#include <pthread.h>
 
+#include "banner.h"
 #include "bridge.h"
 #include "debug.h"
+#include "dns.h"
+#include "evt.h"
 #include "init.h"
 #include "ip.h"
 #include "modem_core.h"
+#include "nvt.h"
 #include "phone_book.h"
+#include "pool.h"
 #include "util.h"
+#include "worker.h"
 
-const char MDM_BUSY[] = "BUSY\n";
+int hup_pipe[2];        // SIGHUP gets to the main loop through here
 
-#define MAX_MODEMS 16
+void hangup(int sig) {
+  writePipe(hup_pipe[1], 'H');
+}
+
+void reload_handler(evt_loop *loop, void *arg, int events) {
+  unsigned char buf[16];
+
+  while(readPipe(hup_pipe[0], buf, sizeof(buf)) == sizeof(buf));
+  LOG(LOG_INFO, "Reloading phone book");
+  pb_load();
+}
+
+/*
+ * Every modem needs a few descriptors, so a big pool can use all the
+ * hard limit allows.
+ */
+void raise_fd_limit(void) {
+  struct rlimit rl;
+
+  if(0 == getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    if(0 != setrlimit(RLIMIT_NOFILE, &rl)) {
+      ELOG(LOG_WARN, "Could not raise the open file limit");
+    }
+  }
+}
 
 int main(int argc, char *argv[]) {
-  modem_config cfg[MAX_MODEMS];
+  modem_config **cfg;
   int modem_count;
   char *ip_addr = NULL;
   char default_ip[] = "6400";
 
-  char all_busy[255];
   int i;
   int rc = 0;
-  int sSocket = 0;
-  fd_set readfs;
-  int max_fd = 0;
-  int accept_pending = FALSE;
-  unsigned char buf[255];
-  int cSocket;
+  evt_loop loop;
+  evt_handler hup_evt;
 
   log_init();
 
@@ -43,98 +70,65 @@ int main(int argc, char *argv[]) {
 
   mdm_init();
 
+  nvt_init();
+
+  par_init();
+
   pb_init();
   
   signal(SIGIO, SIG_IGN); /* Some Linux variant term on SIGIO by default */
-
-  modem_count = init(argc, argv, cfg, MAX_MODEMS, &ip_addr, all_busy, sizeof(all_busy));
+  signal(SIGPIPE, SIG_IGN); /* write errors are handled where they happen */
+#ifdef ALLOC_DEBUG
+  atexit(log_alloc_report);
+  signal(SIGTERM, exit);
+#endif
+
+  cfg = init(argc, argv, &modem_count, &ip_addr);
+  raise_fd_limit();
   if(ip_addr == NULL)
     ip_addr = default_ip;
-  sSocket = ip_init_server_conn(ip_addr);
-  if(-1 == sSocket) {
-    ELOG(LOG_FATAL, "Could not listen on %s", ip_addr);
-    exit (-1);
+  if(-1 == pb_load()) {
+    exit(-1);
+  }
+  if(-1 == evt_init(&loop)) {
+    exit(-1);
+  }
+  if(-1 == wkr_init()) {
+    exit(-1);
+  }
+  dns_init(DNS_THREADS);
+  // direct connections send their banners as the modems are set up
+  if(-1 == bnr_start(&loop)) {
+    exit(-1);
+  }
+  // modems join the pool as they are set up
+  if(-1 == pool_init(cfg, modem_count, ip_addr)) {
+    exit(-1);
   }
 
   for(i = 0; i < modem_count; i++) {
     LOG(LOG_INFO, "Creating modem #%d", i);
-    if(-1 == pipe(cfg[i].mp[0])) {
-      ELOG(LOG_FATAL, "Bridge task incoming IPC pipe could not be created");
-      exit(-1);
-    }
-    if(-1 == pipe(cfg[i].mp[1])) {
-      ELOG(LOG_FATAL, "Bridge task outgoing IPC pipe could not be created");
-      exit(-1);
-    }
-    cfg[i].line_data.sfd = sSocket;
-
-    spawn_thread(*bridge_task, (void *)&cfg[i], "BRIDGE");
-
+    wkr_add_modem(cfg[i], i);
+  }
+  evt_init_handler(&hup_evt);
+  if(-1 == pipe(hup_pipe)
+     || -1 == fcntl(hup_pipe[1], F_SETFL, O_NONBLOCK)
+     || -1 == evt_add(&loop, &hup_evt, hup_pipe[0], EVT_READ, reload_handler, NULL)) {
+    ELOG(LOG_FATAL, "Phone book reload pipe could not be created");
+    exit(-1);
   }
+  signal(SIGHUP, hangup);
 
-  for(;;) {
-    FD_ZERO(&readfs);
-    max_fd = 0;
-    for(i = 0; i < modem_count; i++) {
-      FD_SET(cfg[i].mp[0][0], &readfs);
-      max_fd=MAX(max_fd, cfg[i].mp[0][0]);
-    }
-    if(accept_pending == FALSE) {
-      max_fd=MAX(max_fd, sSocket);
-      FD_SET(sSocket, &readfs); 
-    }
-    LOG(LOG_ALL, "Waiting for incoming connections and/or indicators");
-    select(max_fd+1, &readfs, NULL, NULL, NULL);
-    for(i = 0; i < modem_count; i++) {
-      if (FD_ISSET(cfg[i].mp[0][0], &readfs)) {  // child pipe
-        rc = read(cfg[i].mp[0][0], buf, sizeof(buf) -1);
-        if(rc > -1) {
-          buf[rc] = 0;
-          LOG(LOG_DEBUG, "modem core #%d sent response '%s'", i, buf);
-          accept_pending = FALSE;
-        }
-      }
-    }
-    if (FD_ISSET(sSocket, &readfs)) {  // IP traffic
-      if(!accept_pending) {
-        LOG(LOG_DEBUG, "Incoming connection pending");
-        // first try for a modem that is listening.
-        for(i = 0; i < modem_count; i++) {
-          if(cfg[i].s[0] != 0 && cfg[i].is_off_hook == FALSE) {
-            // send signal to pipe saying pick up...
-            LOG(LOG_DEBUG, "Sending incoming connection to listening modem #%d", i);
-            writePipe(cfg[i].mp[1][1], MSG_CALLING);
-            accept_pending = TRUE;
-            break;
-          }
-        }
-        // now, send to any non-active modem.
-        for(i = 0; i < modem_count; i++) {
-          if(cfg[i].is_off_hook == FALSE) {
-            // send signal to pipe saying pick up...
-            LOG(LOG_DEBUG, "Sending incoming connection to non-connected modem #%d", i);
-            writePipe(cfg[i].mp[1][1], MSG_CALLING);
-            accept_pending = TRUE;
-            break;
-          }
-        }
-        if(i == modem_count) {
-          LOG(LOG_DEBUG, "No open modem to send to, send notice and close");
-          // no connections.., accept and print error
-          cSocket = ip_accept(sSocket);
-          if(cSocket > -1) {
-            // No tracing on this data output
-            if(strlen(all_busy) < 1) {
-              ip_write(cSocket, (unsigned char *)MDM_BUSY, strlen(MDM_BUSY));
-            } else {
-              writeFile(all_busy, cSocket);
-            }
-            close(cSocket);
-          }
-        }
-      }
-    }
+  if(-1 == wkr_start()) {
+    exit(-1);
   }
+  if(-1 == pool_start(&loop)) {
+    ELOG(LOG_FATAL, "Could not listen for calls");
+    exit (-1);
+  }
+
+  LOG(LOG_ALL, "Waiting for incoming connections and/or indicators");
+  rc = evt_run(&loop);
   LOG_EXIT();
   return rc;
 }
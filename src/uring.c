@@ -0,0 +1,537 @@
+#ifdef __linux__
+#define _GNU_SOURCE       // for POLLRDHUP
+#endif
+#include "evt.h"
+
+#ifdef HAVE_IO_URING
+#include <stdlib.h>       // for malloc...
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "debug.h"
+#include "uring.h"
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+// what each request in flight is for, kept in the low bits of user_data
+enum {
+  TAG_POLL = 0,
+  TAG_READ,
+  TAG_WRITE,
+  TAG_LINK,             // waits for a socket ahead of a read or write
+  TAG_CANCEL
+};
+
+#define TO_DATA(h, tag) (((__u64)(uintptr_t)(h) << 3) | (tag))
+#define TO_HANDLER(d) ((evt_handler *)(uintptr_t)((d) >> 3))
+#define TO_TAG(d) ((int)((d) & 7))
+
+int enter(uring_ring *r, unsigned wait, unsigned flags, void *arg, size_t len) {
+  unsigned count;
+  int rc;
+
+  __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+  count = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if(wait)
+    flags |= IORING_ENTER_GETEVENTS;
+  rc = syscall(__NR_io_uring_enter, r->fd, count, wait, flags, arg, len);
+  if(rc < 0 && errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+    ELOG(LOG_ERROR, "Could not submit to io_uring");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Returns the next free submission entry(s), handing what is queued to
+ * the kernel first if there is no room.  Linked entries must be got
+ * together, or the link could be split over two submissions.
+ */
+struct io_uring_sqe *get_sqe(uring_ring *r, unsigned count) {
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+  unsigned i;
+
+  if(r->tail + count - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > r->sq_entries) {
+    enter(r, 0, 0, NULL, 0);
+    if(r->tail + count - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > r->sq_entries) {
+      LOG(LOG_ERROR, "io_uring submission queue is full");
+      return NULL;
+    }
+  }
+  sqe = NULL;
+  for(i = 0; i < count; i++) {
+    idx = r->tail & *r->sq_mask;
+    r->sq_array[idx] = idx;
+    memset(&r->sqes[idx], 0, sizeof(struct io_uring_sqe));
+    if(sqe == NULL)
+      sqe = &r->sqes[idx];
+    r->tail++;
+  }
+  return sqe;
+}
+
+struct io_uring_sqe *next_sqe(uring_ring *r, struct io_uring_sqe *sqe) {
+  return &r->sqes[(sqe - r->sqes + 1) & *r->sq_mask];
+}
+
+int uring_init(evt_loop *loop) {
+  uring_ring *r = &loop->ring;
+  struct io_uring_params p;
+  struct io_uring_rsrc_register reg;
+  size_t sq_len;
+  size_t cq_len;
+  char *sq;
+  char *cq;
+
+  r->fd = -1;
+  r->tail = 0;
+  r->bufs = 0;
+  r->max_bufs = 0;
+  r->ready = NULL;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = URING_ENTRIES * 4;
+  r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if(r->fd < 0) {
+    ELOG(LOG_WARN, "Could not create io_uring, using epoll");
+    return -1;
+  }
+  if(!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+    LOG(LOG_WARN, "This kernel's io_uring is too old, using epoll");
+    close(r->fd);
+    r->fd = -1;
+    return -1;
+  }
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if((p.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len)
+    sq_len = cq_len;
+  sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  cq = sq;
+  if(sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+    cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+    ELOG(LOG_WARN, "Could not map io_uring, using epoll");
+    close(r->fd);
+    r->fd = -1;
+    return -1;
+  }
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->sq_entries = p.sq_entries;
+  r->tail = *r->sq_tail;
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  // read buffers are registered one by one as sockets turn up
+  memset(&reg, 0, sizeof(reg));
+  reg.nr = URING_BUFS;
+  reg.flags = IORING_RSRC_REGISTER_SPARSE;
+  if(0 <= syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg))) {
+    r->max_bufs = URING_BUFS;
+  } else {
+    ELOG(LOG_INFO, "Could not register io_uring buffers, reading without them");
+  }
+  LOG(LOG_INFO, "Using io_uring event loop");
+  return 0;
+}
+
+void uring_init_handler(evt_handler *h) {
+  uring_io *io = &h->io;
+
+  memset(io, 0, sizeof(uring_io));
+  io->rbuf = NULL;
+  io->rbuf_idx = -1;
+  io->next = NULL;
+}
+
+int is_stream_socket(int fd) {
+  struct stat st;
+  socklen_t len;
+  int type;
+  int listening;
+
+  if(fstat(fd, &st) < 0 || !S_ISSOCK(st.st_mode))
+    return FALSE;
+  len = sizeof(type);
+  if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_STREAM)
+    return FALSE;
+  len = sizeof(listening);
+  if(getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || listening)
+    return FALSE;
+  return TRUE;
+}
+
+void alloc_read_buf(evt_handler *h) {
+  uring_ring *r = &h->loop->ring;
+  struct io_uring_rsrc_update2 up;
+  struct iovec iov;
+
+  h->io.rbuf = malloc(URING_READ_LEN);
+  if(h->io.rbuf == NULL || r->bufs >= r->max_bufs)
+    return;
+  iov.iov_base = h->io.rbuf;
+  iov.iov_len = URING_READ_LEN;
+  memset(&up, 0, sizeof(up));
+  up.offset = r->bufs;
+  up.data = (__u64)(uintptr_t)&iov;
+  up.nr = 1;
+  if(0 < syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up))) {
+    h->io.rbuf_idx = r->bufs++;
+  } else {
+    ELOG(LOG_DEBUG, "Could not register read buffer for fd %d", h->fd);
+  }
+}
+
+/*
+ * Old kernels hand back EAGAIN for non-blocking sockets, rather than
+ * waiting, so those get a poll linked in front of the retry.
+ */
+struct io_uring_sqe *get_io_sqe(evt_handler *h, int is_linked, int mask) {
+  uring_ring *r = &h->loop->ring;
+  struct io_uring_sqe *sqe;
+
+  sqe = get_sqe(r, (is_linked ? 2 : 1));
+  if(sqe == NULL || !is_linked)
+    return sqe;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = h->fd;
+  sqe->poll32_events = mask;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = TO_DATA(h, TAG_LINK);
+  return next_sqe(r, sqe);
+}
+
+void submit_read(evt_handler *h, int is_linked) {
+  struct io_uring_sqe *sqe;
+
+  if(h->fd < 0 || h->io.reads > 0 || h->io.rbuf == NULL)
+    return;
+  sqe = get_io_sqe(h, is_linked, POLLIN | POLLRDHUP);
+  if(sqe == NULL)
+    return;
+  if(h->io.rbuf_idx > -1) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->buf_index = h->io.rbuf_idx;
+  } else {
+    sqe->opcode = IORING_OP_READ;
+  }
+  sqe->fd = h->fd;
+  sqe->addr = (__u64)(uintptr_t)h->io.rbuf;
+  sqe->len = URING_READ_LEN;
+  sqe->user_data = TO_DATA(h, TAG_READ);
+  h->io.reads++;
+}
+
+void submit_write(evt_handler *h, int is_linked) {
+  struct io_uring_sqe *sqe;
+
+  sqe = get_io_sqe(h, is_linked, POLLOUT);
+  if(sqe == NULL) {
+    h->io.werr = ENOMEM;
+    return;
+  }
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = h->fd;
+  sqe->addr = (__u64)(uintptr_t)h->io.wiov;
+  sqe->len = h->io.wcnt;
+  sqe->user_data = TO_DATA(h, TAG_WRITE);
+  h->io.writes++;
+}
+
+void cancel(evt_handler *h, int tag) {
+  struct io_uring_sqe *sqe;
+
+  sqe = get_sqe(&h->loop->ring, 1);
+  if(sqe == NULL)
+    return;
+  if(tag == TAG_POLL) {
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+  } else {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+  }
+  sqe->fd = -1;
+  sqe->addr = TO_DATA(h, tag);
+  sqe->user_data = TO_DATA(h, TAG_CANCEL);
+}
+
+void add_poll(evt_handler *h) {
+  struct io_uring_sqe *sqe;
+
+  sqe = get_sqe(&h->loop->ring, 1);
+  if(sqe == NULL)
+    return;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = h->fd;
+  sqe->poll32_events = h->io.poll_mask;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = TO_DATA(h, TAG_POLL);
+  h->io.polls++;
+}
+
+int get_poll_mask(evt_handler *h, int events) {
+  int mask = 0;
+
+  if((events & EVT_READ) && !h->io.is_async)
+    mask |= POLLIN | POLLRDHUP;
+  if(events & EVT_WRITE)
+    mask |= POLLOUT;
+  return mask;
+}
+
+void set_poll(evt_handler *h, int mask) {
+  if(mask == h->io.poll_mask)
+    return;
+  // the remove goes in ahead of the add, so it finds the old poll
+  if(h->io.poll_mask)
+    cancel(h, TAG_POLL);
+  h->io.poll_mask = mask;
+  if(mask)
+    add_poll(h);
+}
+
+int uring_add(evt_handler *h) {
+  uring_io *io = &h->io;
+
+  io->is_async = is_stream_socket(h->fd);
+  io->rpos = 0;
+  io->rlen = 0;
+  io->rerr = 0;
+  io->is_eof = FALSE;
+  io->wdone = 0;
+  io->werr = 0;
+  if(io->is_async && io->rbuf == NULL)
+    alloc_read_buf(h);
+  if(io->is_async && io->rbuf == NULL) {
+    LOG(LOG_WARN, "No read buffer for fd %d, polling it instead", h->fd);
+    io->is_async = FALSE;
+  }
+  if(io->is_async && (h->events & EVT_READ))
+    submit_read(h, FALSE);
+  set_poll(h, get_poll_mask(h, h->events));
+  return 0;
+}
+
+int uring_mod(evt_handler *h, int events) {
+  if(h->io.is_async && (events & EVT_READ))
+    submit_read(h, FALSE);
+  set_poll(h, get_poll_mask(h, events));
+  return 0;
+}
+
+/*
+ * Anything still in flight for the descriptor is cancelled, and the
+ * cancels go to the kernel now, before the caller closes it.
+ */
+int uring_del(evt_handler *h) {
+  uring_io *io = &h->io;
+
+  set_poll(h, 0);
+  if(io->reads > 0 || io->writes > 0)
+    cancel(h, TAG_LINK);
+  if(io->reads > 0) {
+    cancel(h, TAG_READ);
+    io->is_read_stale = TRUE;
+  }
+  if(io->writes > 0) {
+    cancel(h, TAG_WRITE);
+    io->is_write_stale = TRUE;
+  }
+  io->rpos = 0;
+  io->rlen = 0;
+  io->is_async = FALSE;
+  return enter(&h->loop->ring, 0, 0, NULL, 0);
+}
+
+void set_ready(uring_ring *r, evt_handler *h, int ev) {
+  if(ev == 0)
+    return;
+  h->io.ev |= ev;
+  if(!h->io.is_ready) {
+    h->io.is_ready = TRUE;
+    h->io.next = r->ready;
+    r->ready = h;
+  }
+}
+
+void complete(uring_ring *r, struct io_uring_cqe *cqe) {
+  evt_handler *h = TO_HANDLER(cqe->user_data);
+  uring_io *io = &h->io;
+  int res = cqe->res;
+  int ev = 0;
+
+  switch(TO_TAG(cqe->user_data)) {
+    case TAG_POLL:
+      if(!(cqe->flags & IORING_CQE_F_MORE)) {
+        io->polls--;
+        if(io->polls == 0 && io->poll_mask && h->fd > -1)
+          add_poll(h);    // the kernel ended it, it is still wanted
+      }
+      if(res < 0 || h->fd < 0)
+        break;
+      if(res & (POLLIN | POLLRDHUP | POLLHUP | POLLERR))
+        ev |= EVT_READ;
+      if(res & (POLLOUT | POLLHUP | POLLERR))
+        ev |= EVT_WRITE;
+      set_ready(r, h, ev & (h->events | EVT_READ));
+      break;
+    case TAG_READ:
+      io->reads--;
+      if(io->is_read_stale) {
+        io->is_read_stale = FALSE;
+        if(io->is_async && (h->events & EVT_READ))
+          submit_read(h, FALSE);
+      } else if(res == -EAGAIN) {
+        submit_read(h, TRUE);
+      } else {
+        if(res > 0) {
+          io->rpos = 0;
+          io->rlen = res;
+        } else if(res == 0) {
+          io->is_eof = TRUE;
+        } else {
+          io->rerr = -res;
+        }
+        set_ready(r, h, EVT_READ);
+      }
+      break;
+    case TAG_WRITE:
+      io->writes--;
+      if(io->is_write_stale) {
+        io->is_write_stale = FALSE;
+        if(io->is_async)
+          set_ready(r, h, EVT_WRITE);   // its owner may have more queued
+      } else if(res == -EAGAIN) {
+        submit_write(h, TRUE);
+      } else {
+        if(res < 0) {
+          io->werr = -res;
+        } else {
+          io->wdone += res;
+        }
+        set_ready(r, h, EVT_WRITE);
+      }
+      break;
+  }
+}
+
+void reap(uring_ring *r) {
+  unsigned head = *r->cq_head;
+
+  while(head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    complete(r, &r->cqes[head & *r->cq_mask]);
+    head++;
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * One call hands the kernel everything queued since the last one, and
+ * waits up to msec (-1 for ever) for something to finish.
+ */
+int uring_wait(evt_loop *loop, int msec) {
+  uring_ring *r = &loop->ring;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  evt_handler *h;
+  int ev;
+
+  memset(&arg, 0, sizeof(arg));
+  if(msec > -1) {
+    ts.tv_sec = msec / 1000;
+    ts.tv_nsec = (msec % 1000) * 1000000L;
+    arg.ts = (__u64)(uintptr_t)&ts;
+  }
+  // completions picked up while a handler waited on a write go first
+  if(enter(r, (r->ready ? 0 : 1), IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0)
+    return -1;
+  reap(r);
+  while((h = r->ready) != NULL) {
+    r->ready = h->io.next;
+    h->io.is_ready = FALSE;
+    ev = h->io.ev;
+    h->io.ev = 0;
+    if(h->fd > -1)
+      h->func(loop, h->arg, ev);
+  }
+  return 0;
+}
+
+/*
+ * Hands out what the last read brought in, starting the next one once
+ * it has all gone.  Fails with EAGAIN if there is nothing yet.
+ */
+int uring_read(evt_handler *h, unsigned char *data, int len) {
+  uring_io *io = &h->io;
+  int n;
+
+  if(io->rpos < io->rlen) {
+    n = io->rlen - io->rpos;
+    if(n > len)
+      n = len;
+    memcpy(data, io->rbuf + io->rpos, n);
+    io->rpos += n;
+    if(io->rpos == io->rlen) {
+      io->rpos = 0;
+      io->rlen = 0;
+      submit_read(h, FALSE);
+    }
+    return n;
+  }
+  if(io->is_eof)
+    return 0;
+  errno = (io->rerr ? io->rerr : EAGAIN);
+  return -1;
+}
+
+/*
+ * Starts writing the slices (at most 2), which must stay put until
+ * uring_write_done says how far it got.
+ */
+int uring_writev(evt_handler *h, struct iovec *iov, int cnt) {
+  uring_io *io = &h->io;
+  int i;
+
+  if(io->werr) {
+    errno = io->werr;
+    return -1;
+  }
+  if(io->writes > 0 || cnt > 2) {
+    errno = EBUSY;
+    return -1;
+  }
+  for(i = 0; i < cnt; i++) {
+    io->wiov[i] = iov[i];
+  }
+  io->wcnt = cnt;
+  submit_write(h, FALSE);
+  return 0;
+}
+
+int uring_write_done(evt_handler *h) {
+  int n = h->io.wdone;
+
+  if(h->io.werr) {
+    errno = h->io.werr;
+    return -1;
+  }
+  h->io.wdone = 0;
+  return n;
+}
+#endif
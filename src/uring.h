@@ -0,0 +1,70 @@
+#ifndef URING_H
+#define URING_H 1
+
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* The io_uring loop (built with USE_IO_URING) waits for every descriptor
+ * with multishot polls, and does the reads and writes of connected stream
+ * sockets itself.  Everything queued during one pass of the loop goes to
+ * the kernel in the same io_uring_enter() call that waits for the next.
+ */
+#define URING_ENTRIES 256
+#define URING_READ_LEN 16384
+#define URING_BUFS 1024
+
+struct evt_loop;
+struct evt_handler;
+
+typedef struct uring_io {
+  int is_async;         // reads and writes go through the ring
+  int poll_mask;        // what the poll in flight is waiting for
+  int polls;
+  unsigned char *rbuf;  // filled by the read in flight, kept across calls
+  int rbuf_idx;         // registered buffer slot, or -1
+  int rpos;
+  int rlen;
+  int rerr;
+  int is_eof;
+  int reads;
+  int is_read_stale;    // the read in flight belongs to a removed descriptor
+  struct iovec wiov[2];
+  int wcnt;
+  int writes;
+  int wdone;            // bytes written since the owner last asked
+  int werr;
+  int is_write_stale;
+  int ev;               // events waiting to be handed to the handler
+  int is_ready;
+  struct evt_handler *next;
+} uring_io;
+
+typedef struct uring_ring {
+  int fd;               // -1 if the loop runs on epoll instead
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned tail;        // entries filled in, published on the next enter
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  int bufs;
+  int max_bufs;         // 0 if buffers cannot be registered
+  struct evt_handler *ready;
+} uring_ring;
+
+int uring_init(struct evt_loop *loop);
+void uring_init_handler(struct evt_handler *h);
+int uring_add(struct evt_handler *h);
+int uring_mod(struct evt_handler *h, int events);
+int uring_del(struct evt_handler *h);
+int uring_wait(struct evt_loop *loop, int msec);
+int uring_read(struct evt_handler *h, unsigned char *data, int len);
+int uring_writev(struct evt_handler *h, struct iovec *iov, int cnt);
+int uring_write_done(struct evt_handler *h);
+
+#endif
@@ -2,6 +2,7 @@
 #include <stdlib.h>       // for exit...
 #include <stdio.h>
 #include <unistd.h>
+#include <poll.h>
 
 #include "debug.h"
 #include "util.h"
@@ -18,23 +19,35 @@ int readPipe(int fd, unsigned char *buf, int len) {
   return read(fd, buf, len);
 }
 
-int writeFile(char *name, int fd) {
-  FILE *file;
-  unsigned char buf[255];
-  size_t res;
-  size_t size = 1;
-  size_t max = sizeof(buf);
-
-  if(NULL != (file = fopen(name, "rb"))) {
-    do {
-      res = fread(buf, size, max, file);
-      if(res > 0)
-        res = write(fd, buf, res);
-    } while (res > 0);
-    fclose(file);
-    return 0;
+/*
+ * For blocking-style writes outside the event loops.  Non-blocking
+ * descriptors are waited on for room, but never for more than
+ * WRITE_TIMEOUT at a time, so a peer that stopped reading gets -1.
+ */
+int writeAll(int fd, unsigned char *data, int len) {
+  struct pollfd pfd;
+  int rc;
+  int sent = 0;
+
+  while(sent < len) {
+    rc = write(fd, data + sent, len - sent);
+    if(rc > 0) {
+      sent += rc;
+    } else if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      rc = poll(&pfd, 1, WRITE_TIMEOUT);
+      if(rc == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+      }
+    } else if(rc < 0 && errno == EINTR) {
+      continue;
+    } else {
+      return -1;
+    }
   }
-  return -1;
+  return sent;
 }
 
 void spawn_thread(void * thread, void *arg, char *name) {
@@ -5,11 +5,13 @@
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #endif
 
+#define WRITE_TIMEOUT 5000    // ms writeAll waits for a descriptor to take more
+
 
 
 int writePipe(int fd, char msg);
 int readPipe(int fd, unsigned char *buf, int len);
-int writeFile(char *name, int fd);
+int writeAll(int fd, unsigned char *data, int len);
 void spawn_thread(void * thread, void *arg, char *name);
 
 #endif
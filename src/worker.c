@@ -0,0 +1,265 @@
+#ifdef __linux__
+#define _GNU_SOURCE       // for CPU_SET and pthread_setaffinity_np
+#endif
+#include <pthread.h>
+#include <stdlib.h>       // for exit...
+#include <unistd.h>
+#include <string.h>
+#include <netdb.h>        // for NI_MAXHOST
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "util.h"
+#include "debug.h"
+#include "bridge.h"
+#include "dns.h"
+#include "ip.h"
+#include "worker.h"
+
+worker workers[MAX_WORKERS];
+int worker_count = 1;
+int worker_pin = FALSE;
+
+void wkr_set_count(int count) {
+  if(count < 1) {
+    count = 1;
+  } else if(count > MAX_WORKERS) {
+    LOG(LOG_WARN, "Limiting worker threads to %d", MAX_WORKERS);
+    count = MAX_WORKERS;
+  }
+  worker_count = count;
+}
+
+int wkr_get_count(void) {
+  return worker_count;
+}
+
+void wkr_set_pinning(int pin) {
+  worker_pin = pin;
+}
+
+/*
+ * Answers every call queued for this worker.
+ */
+void take_calls(worker *w) {
+  unsigned int head = w->call_head;
+  wkr_caller *c;
+  char name[NI_MAXHOST];
+
+  // anything queued after this gets a wake up of its own
+  __atomic_store_n(&w->is_woken, FALSE, __ATOMIC_SEQ_CST);
+  for(;;) {
+    c = &w->calls[head & w->call_mask];
+    if(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != head + 1)
+      break;
+    LOG(LOG_DEBUG,
+        "Worker %d answering call from %s, %lld ms after it came in",
+        w->id,
+        ip_get_name((struct sockaddr *)&c->addr, c->addr_len, name, sizeof(name)),
+        evt_now() - c->accepted
+       );
+    accept_connection(c->cfg, c->fd);
+    // the modem is marked busy now, the accept threads may use it again
+    __atomic_store_n(&c->cfg->is_call_pending, FALSE, __ATOMIC_RELEASE);
+    bridge_update(c->cfg, TRUE);
+    __atomic_store_n(&c->seq, head + w->call_mask + 1, __ATOMIC_RELEASE);
+    w->call_head = ++head;
+  }
+}
+
+void call_handler(evt_loop *loop, void *arg, int events) {
+  worker *w = (worker *)arg;
+  wkr_msg msgs[16];
+  int res;
+  int i;
+
+  do {
+    res = read(w->mp[0], msgs, sizeof(msgs));
+    for(i = 0; i < res / (int)sizeof(wkr_msg); i++) {
+      switch(msgs[i].type) {
+        case MSG_CALLING:       // answer queued calls
+          take_calls(w);
+          break;
+        case MSG_RESOLVED:      // carry on dialing
+          mdm_resolved(msgs[i].cfg);
+          bridge_update(msgs[i].cfg, FALSE);
+          break;
+      }
+    }
+  } while(res == sizeof(msgs));
+}
+
+int wkr_init(void) {
+  worker *w;
+  int i;
+
+  LOG_ENTER();
+  for(i = 0; i < worker_count; i++) {
+    w = &workers[i];
+    w->id = i;
+    w->calls = NULL;
+    w->call_mask = 0;
+    w->modem_count = 0;
+    w->call_head = 0;
+    w->call_tail = 0;
+    w->is_woken = FALSE;
+    w->dial_spare = NULL;
+    if(-1 == evt_init(&w->loop)) {
+      LOG(LOG_FATAL, "Worker %d event loop could not be created", i);
+      return -1;
+    }
+    if(-1 == pipe(w->mp)) {
+      ELOG(LOG_FATAL, "Worker %d incoming IPC pipe could not be created", i);
+      return -1;
+    }
+    evt_init_handler(&w->mp_evt);
+    if(-1 == evt_add(&w->loop, &w->mp_evt, w->mp[0], EVT_READ, call_handler, w)) {
+      return -1;
+    }
+  }
+  LOG(LOG_INFO, "Created %d worker(s)", worker_count);
+  LOG_EXIT();
+  return 0;
+}
+
+/*
+ * Called on a resolver thread when a modem's name lookup is done.
+ */
+void wkr_resolved(void *arg) {
+  modem_config *cfg = (modem_config *)arg;
+  wkr_msg msg;
+
+  msg.type = MSG_RESOLVED;
+  msg.cfg = cfg;
+  if(sizeof(msg) != write(workers[cfg->worker_id].mp[1], &msg, sizeof(msg))) {
+    ELOG(LOG_ERROR, "Could not pass a lookup result to worker %d", cfg->worker_id);
+  }
+}
+
+/*
+ * modems are dealt out to workers in turn, and stay with that worker
+ */
+int wkr_add_modem(modem_config *cfg, int idx) {
+  worker *w;
+
+  cfg->id = idx;
+  cfg->worker_id = idx % worker_count;
+  w = &workers[cfg->worker_id];
+  w->modem_count++;
+  cfg->data_buf = w->read_buf;
+  cfg->dce_data.parity_buf = w->parity_buf;
+  cfg->line_data.spare = &w->dial_spare;
+  cfg->line_data.resolved = wkr_resolved;
+  cfg->line_data.resolved_arg = cfg;
+  LOG(LOG_DEBUG, "Modem #%d belongs to worker %d", idx, cfg->worker_id);
+  return bridge_init(&w->loop, cfg);
+}
+
+void pin_worker(worker *w) {
+#ifdef __linux__
+  cpu_set_t cpus;
+  int count = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if(count < 1)
+    return;
+  CPU_ZERO(&cpus);
+  CPU_SET(w->id % count, &cpus);
+  if(0 != pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+    LOG(LOG_WARN, "Could not pin worker %d to CPU %d", w->id, w->id % count);
+  } else {
+    LOG(LOG_INFO, "Pinned worker %d to CPU %d", w->id, w->id % count);
+  }
+#else
+  LOG(LOG_WARN, "CPU pinning is not supported on this platform");
+#endif
+}
+
+void *worker_thread(void *arg) {
+  worker *w = (worker *)arg;
+
+  LOG_ENTER();
+  if(worker_pin) {
+    pin_worker(w);
+  }
+  evt_run(&w->loop);
+  LOG_EXIT();
+  // the loop only returns if it cannot wait for events.
+  exit(-1);
+}
+
+/*
+ * Sets aside each worker's call queue, now that its modems are known.
+ * One more slot covers a modem freed while its last call is being taken.
+ */
+int alloc_calls(worker *w) {
+  unsigned int len = WKR_QUEUE_LEN;
+  unsigned int i;
+
+  while(len < (unsigned int)w->modem_count + 1) {
+    len <<= 1;
+  }
+  w->calls = calloc(len, sizeof(wkr_caller));
+  if(w->calls == NULL)
+    return -1;
+  for(i = 0; i < len; i++) {
+    w->calls[i].seq = i;
+  }
+  w->call_mask = len - 1;
+  return 0;
+}
+
+int wkr_start(void) {
+  int i;
+
+  for(i = 0; i < worker_count; i++) {
+    if(-1 == alloc_calls(&workers[i])) {
+      LOG(LOG_FATAL, "Worker %d call queue could not be allocated", i);
+      return -1;
+    }
+  }
+  for(i = 0; i < worker_count; i++) {
+    spawn_thread(worker_thread, (void *)&workers[i], "WORKER");
+  }
+  return 0;
+}
+
+/*
+ * Queues a call an accept thread has accepted for cfg, which the thread
+ * has marked is_call_pending.  Returns -1 if the worker has too many
+ * calls waiting.
+ */
+int wkr_call(modem_config *cfg, int fd, struct sockaddr_storage *addr, socklen_t addr_len, long long accepted) {
+  worker *w = &workers[cfg->worker_id];
+  unsigned int tail = __atomic_load_n(&w->call_tail, __ATOMIC_RELAXED);
+  wkr_caller *c;
+  wkr_msg msg;
+  int diff;
+
+  for(;;) {
+    c = &w->calls[tail & w->call_mask];
+    diff = (int)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - tail);
+    if(diff < 0)
+      return -1;        // the worker has not taken this slot's last call
+    if(diff == 0
+       && __atomic_compare_exchange_n(&w->call_tail, &tail, tail + 1, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+    if(diff > 0)
+      tail = __atomic_load_n(&w->call_tail, __ATOMIC_RELAXED);
+  }
+  c->cfg = cfg;
+  c->fd = fd;
+  memcpy(&c->addr, addr, addr_len);
+  c->addr_len = addr_len;
+  c->accepted = accepted;
+  __atomic_store_n(&c->seq, tail + 1, __ATOMIC_RELEASE);
+  if(!__atomic_exchange_n(&w->is_woken, TRUE, __ATOMIC_SEQ_CST)) {
+    msg.type = MSG_CALLING;
+    msg.cfg = NULL;
+    // one message is far smaller than PIPE_BUF, so the write is atomic.
+    if(sizeof(msg) != write(w->mp[1], &msg, sizeof(msg))) {
+      ELOG(LOG_ERROR, "Could not wake worker %d", w->id);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef WORKER_H
+#define WORKER_H 1
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "evt.h"
+#include "modem_core.h"
+
+#define MSG_CALLING       'C'
+#define MSG_RESOLVED      'R'
+
+#define MAX_WORKERS 64
+#define WKR_QUEUE_LEN 256     // least room for calls handed over and not yet taken
+
+/* The accept threads accept each call themselves and queue it for the
+ * worker that owns the modem they picked.  The queue takes calls from
+ * any accept thread without a lock: a thread claims a slot by moving
+ * call_tail on, and the slot's seq says when it is filled in (and, once
+ * the worker is done with it, free again).  The worker's pipe only wakes
+ * it up, once for however many calls are waiting.  A modem is handed one
+ * call at a time, so a queue with room for all of the worker's modems
+ * never turns a call away.
+ */
+typedef struct wkr_caller {
+  unsigned int seq;
+  modem_config *cfg;
+  int fd;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  long long accepted;   // ms, see evt_now
+} wkr_caller;
+
+typedef struct wkr_msg {
+  int type;
+  modem_config *cfg;
+} wkr_msg;
+
+typedef struct worker {
+  int id;
+  pthread_t thread;
+  evt_loop loop;
+  int mp[2];            // wake ups, and lookups that are done
+  evt_handler mp_evt;
+  wkr_caller *calls;
+  unsigned int call_mask;   // queue length less one, a power of two
+  int modem_count;
+  unsigned int call_head;   // moved on by the worker
+  unsigned int call_tail;   // moved on by the accept threads
+  int is_woken;         // a wake up is in the pipe
+  // only one of the worker's modems is handled at a time, so they share
+  line_dial *dial_spare;    // dial state left by finished calls
+  unsigned char read_buf[DCE_MAX_READ_LEN];   // serial reads
+  unsigned char parity_buf[DCE_PARITY_LEN];   // serial writes with parity
+} worker;
+
+void wkr_set_count(int count);
+int wkr_get_count(void);
+void wkr_set_pinning(int pin);
+int wkr_init(void);
+int wkr_add_modem(modem_config *cfg, int idx);
+int wkr_start(void);
+int wkr_call(modem_config *cfg, int fd, struct sockaddr_storage *addr, socklen_t addr_len, long long accepted);
+
+#endif
@@ -0,0 +1,161 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "harness.h"
+
+/* Runs calls through a tcpser built with make DEF=-DALLOC_DEBUG: connect,
+ * data both ways, and hang up.  The bridge aborts if a connected call
+ * allocates, and the allocation counts it logs at exit must come out the
+ * same with one call as with several, so once the first call had set up
+ * its queues nothing touched the heap.
+ */
+
+#define CALLS 3
+#define DATA_LEN 8192
+#define BLOCKS 32
+#define REPORT "Allocations at "
+
+char data[DATA_LEN];
+char buf[DATA_LEN];
+
+/*
+ * Sends a block at a time, so neither side has to hold much.
+ */
+int pass_data(int from, int to, int len) {
+  int i;
+
+  for(i = 0; i < BLOCKS; i++) {
+    if(0 > th_send(from, data, len)
+       || len != th_read(to, buf, len, TH_WAIT)
+       || 0 != memcmp(data, buf, len))
+      return -1;
+  }
+  return 0;
+}
+
+int run_call(int dte, int port) {
+  int caller;
+  int rc = -1;
+
+  caller = th_connect(port);
+  if(caller < 0
+     || 0 != th_expect(dte, "CONNECT", TH_WAIT)
+     || 0 != th_expect(dte, "\n", TH_WAIT)) {
+    fprintf(stderr, "call was not answered\n");
+  } else if(0 != pass_data(caller, dte, DATA_LEN)) {
+    fprintf(stderr, "data to the DTE did not arrive\n");
+  } else if(0 != pass_data(dte, caller, DATA_LEN / 8)) {
+    fprintf(stderr, "data to the caller did not arrive\n");
+  } else {
+    close(caller);
+    caller = -1;
+    if(0 != th_expect(dte, "NO CARRIER", TH_WAIT)) {
+      fprintf(stderr, "hang up was not reported\n");
+    } else {
+      rc = 0;
+    }
+  }
+  if(caller > -1)
+    close(caller);
+  return rc;
+}
+
+/*
+ * Returns the allocation report tcpser logs at exit, in a string the
+ * caller frees, or NULL if a session failed.
+ */
+char *run_session(char *tcpser, int calls) {
+  char log[64];
+  char port[16];
+  char vport[16];
+  char line[512];
+  char *argv[] = { tcpser, "-l", "4", "-L", log, "-p", port, "-v", vport, NULL };
+  char *report;
+  char *p;
+  FILE *f;
+  pid_t pid;
+  int status;
+  int dte;
+  int i;
+  int rc = 0;
+
+  snprintf(log, sizeof(log), "/tmp/tcpser_alloc_%d.log", (int)getpid());
+  snprintf(port, sizeof(port), "%d", TH_PORT);
+  snprintf(vport, sizeof(vport), "%d", TH_PORT + 1);
+  pid = th_start(argv);
+  if(pid < 0)
+    return NULL;
+  dte = th_dte_open(TH_PORT + 1);
+  if(dte < 0) {
+    fprintf(stderr, "could not set up the modem\n");
+    rc = -1;
+  }
+  for(i = 0; rc == 0 && i < calls; i++) {
+    rc = run_call(dte, TH_PORT);
+  }
+  if(dte > -1)
+    close(dte);
+  status = th_stop(pid);
+  // an ALLOC_DEBUG build exits on SIGTERM, to write its report
+  if(!WIFEXITED(status)) {
+    fprintf(stderr, "tcpser did not exit cleanly, signal %d\n",
+            WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    rc = -1;
+  }
+
+  report = calloc(1, 1);
+  f = fopen(log, "r");
+  while(report != NULL && f != NULL && fgets(line, sizeof(line), f) != NULL) {
+    if(strstr(line, "FATAL") != NULL) {
+      fprintf(stderr, "%s", line);
+      rc = -1;
+    }
+    p = strstr(line, REPORT);
+    if(p != NULL) {
+      report = realloc(report, strlen(report) + strlen(p) + 1);
+      if(report != NULL)
+        strcat(report, p);
+    }
+  }
+  if(f != NULL)
+    fclose(f);
+  unlink(log);
+  if(report != NULL && report[0] == 0) {
+    fprintf(stderr, "no allocation report, is tcpser built with make DEF=-DALLOC_DEBUG?\n");
+    rc = -1;
+  }
+  if(rc != 0) {
+    free(report);
+    return NULL;
+  }
+  return report;
+}
+
+int main(int argc, char *argv[]) {
+  char *once;
+  char *busy;
+  int i;
+
+  if(argc != 2) {
+    fprintf(stderr, "Usage: %s path/to/tcpser\n", argv[0]);
+    return 2;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  for(i = 0; i < DATA_LEN; i++) {
+    data[i] = 'a' + i % 26;
+  }
+  once = run_session(argv[1], 1);
+  busy = run_session(argv[1], CALLS);
+  if(once == NULL || busy == NULL)
+    return 1;
+  if(0 != strcmp(once, busy)) {
+    fprintf(stderr, "with one call:\n%swith %d calls:\n%s", once, CALLS, busy);
+    return 1;
+  }
+  printf("alloc_test: %d calls made no allocations after the first\n", CALLS);
+  return 0;
+}
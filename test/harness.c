@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "harness.h"
+
+long long th_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Returns the open file limit, raised as far as it goes.
+ */
+int th_raise_fd_limit(void) {
+  struct rlimit rl;
+
+  if(0 != getrlimit(RLIMIT_NOFILE, &rl))
+    return -1;
+  if(rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    if(0 != setrlimit(RLIMIT_NOFILE, &rl))
+      getrlimit(RLIMIT_NOFILE, &rl);
+  }
+  return (rl.rlim_cur > 1 << 30 ? 1 << 30 : (int)rl.rlim_cur);
+}
+
+pid_t th_start(char **argv) {
+  pid_t pid = fork();
+
+  if(pid == 0) {
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+  return pid;
+}
+
+/*
+ * Says whether tcpser is still up, rather than having quit at startup,
+ * say because a port was in use.
+ */
+int th_is_running(pid_t pid) {
+  int status;
+
+  return (0 == waitpid(pid, &status, WNOHANG));
+}
+
+/*
+ * Returns the wait status of tcpser after asking it to quit.
+ */
+int th_stop(pid_t pid) {
+  int status = -1;
+
+  kill(pid, SIGTERM);
+  waitpid(pid, &status, 0);
+  return status;
+}
+
+/*
+ * Keeps trying for TH_WAIT, as tcpser may still be starting up.
+ */
+int th_connect(int port) {
+  struct sockaddr_in sa;
+  long long end = th_now() + TH_WAIT;
+  int on = 1;
+  int fd;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  do {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0)
+      return -1;
+    if(0 == connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      return fd;
+    }
+    close(fd);
+    usleep(50000);
+  } while(errno == ECONNREFUSED && th_now() < end);
+  return -1;
+}
+
+/*
+ * Listens on a loopback port, for modems to dial.
+ */
+int th_listen(int port) {
+  struct sockaddr_in sa;
+  int on = 1;
+  int fd;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd < 0)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if(0 != bind(fd, (struct sockaddr *)&sa, sizeof(sa)) || 0 != listen(fd, SOMAXCONN)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int th_accept(int sfd, int ms) {
+  struct pollfd pfd;
+  int on = 1;
+  int fd;
+
+  pfd.fd = sfd;
+  pfd.events = POLLIN;
+  if(1 != poll(&pfd, 1, ms))
+    return -1;
+  fd = accept(sfd, NULL, NULL);
+  if(fd > -1)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return fd;
+}
+
+int th_send(int fd, char *data, int len) {
+  int rc;
+  int sent = 0;
+
+  while(sent < len) {
+    rc = write(fd, data + sent, len - sent);
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc <= 0)
+      return -1;
+    sent += rc;
+  }
+  return sent;
+}
+
+/*
+ * Reads exactly len bytes, or returns what came before ms ran out or the
+ * peer closed.
+ */
+int th_read(int fd, char *buf, int len, int ms) {
+  struct pollfd pfd;
+  long long end = th_now() + ms;
+  int got = 0;
+  int rc;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while(got < len) {
+    rc = poll(&pfd, 1, (int)(end - th_now()));
+    if(rc < 0 && errno == EINTR)
+      continue;
+    if(rc <= 0)
+      break;
+    rc = read(fd, buf + got, len - got);
+    if(rc <= 0)
+      break;
+    got += rc;
+  }
+  return got;
+}
+
+/*
+ * Reads a byte at a time until text has come in, so nothing after it is
+ * taken.  Returns 0 when it has, or -1.
+ */
+int th_expect(int fd, char *text, int ms) {
+  char last[256];
+  int len = strlen(text);
+  int n = 0;
+  long long end = th_now() + ms;
+
+  if(len >= sizeof(last))
+    return -1;
+  while(th_now() < end) {
+    if(1 != th_read(fd, last + (n < len ? n : len), 1, (int)(end - th_now())))
+      return -1;
+    if(n < len) {
+      n++;
+    } else {
+      memmove(last, last + 1, len);
+    }
+    if(n == len && 0 == memcmp(last, text, len))
+      return 0;
+  }
+  return -1;
+}
+
+/*
+ * Connects to an ip232 modem, raises DTR and has it answer on the first
+ * ring.  The second OK means S0 is set, whatever the modem said on DTR.
+ */
+int th_dte_open(int port) {
+  int fd = th_connect(port);
+
+  if(fd < 0)
+    return -1;
+  if(0 > th_send(fd, TH_DTR_UP, 2)
+     || 0 > th_send(fd, "ATS0=1\rAT\r", 10)
+     || 0 != th_expect(fd, "OK", TH_WAIT)
+     || 0 != th_expect(fd, "OK", TH_WAIT)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
@@ -0,0 +1,31 @@
+#ifndef HARNESS_H
+#define HARNESS_H 1
+
+#include <sys/types.h>
+
+/* Helpers for the tests in this directory, and the benchmarks in bench/.
+ * Each starts the tcpser binary named on its command line, talks to it
+ * over loopback sockets as both the DTE (an ip232 modem) and the caller,
+ * and stops it again.
+ */
+
+#define TH_PORT 25400           // first loopback port the tests use
+#define TH_WAIT 5000            // ms to wait for anything tcpser sends
+
+// ip232 framing, see ip232.c
+#define TH_DTR_UP "\xff\x01"
+
+long long th_now(void);
+int th_raise_fd_limit(void);
+pid_t th_start(char **argv);
+int th_is_running(pid_t pid);
+int th_stop(pid_t pid);
+int th_connect(int port);
+int th_listen(int port);
+int th_accept(int sfd, int ms);
+int th_send(int fd, char *data, int len);
+int th_read(int fd, char *buf, int len, int ms);
+int th_expect(int fd, char *text, int ms);
+int th_dte_open(int port);
+
+#endif
@@ -0,0 +1,167 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "harness.h"
+
+/* Starts tcpser with many ip232 modems answering one port, places a call
+ * to each of them at once, and checks that every call was answered by
+ * exactly one modem and every modem took exactly one call.  Each side
+ * then names itself to the other, to show the bytes go to the right
+ * place, and the calls are hung up.
+ */
+
+#define MODEMS 2000
+#define FDS_PER_MODEM 3             // tcpser's ip232 listener and link, and the call
+#define STRESS_WAIT (TH_WAIT * 4)   // ms, calls queue up behind each other
+
+int main(int argc, char *argv[]) {
+  char **args;
+  char text[32];
+  int *dte;
+  int *caller;
+  int *owner;      // modem that answered each call
+  int *answered;   // calls each modem answered
+  int modems = MODEMS;
+  int limit;
+  int errors = 0;
+  int status;
+  long long start;
+  pid_t pid;
+  int i;
+  int n;
+
+  if(argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s path/to/tcpser [modems]\n", argv[0]);
+    return 2;
+  }
+  if(argc == 3)
+    modems = atoi(argv[2]);
+  signal(SIGPIPE, SIG_IGN);
+  // tcpser raises its limit the same way
+  limit = (th_raise_fd_limit() - 64) / FDS_PER_MODEM;
+  if(limit > 0 && modems > limit) {
+    printf("stress_test: the open file limit allows %d modems\n", limit);
+    modems = limit;
+  }
+
+  args = calloc(modems * 2 + 4, sizeof(char *));
+  dte = calloc(modems, sizeof(int));
+  caller = calloc(modems, sizeof(int));
+  owner = calloc(modems, sizeof(int));
+  answered = calloc(modems, sizeof(int));
+  if(args == NULL || dte == NULL || caller == NULL || owner == NULL || answered == NULL)
+    return 1;
+  n = 0;
+  args[n++] = argv[1];
+  args[n++] = "-p";
+  args[n++] = malloc(16);
+  snprintf(args[n - 1], 16, "%d", TH_PORT);
+  for(i = 0; i < modems; i++) {
+    args[n++] = "-v";
+    args[n++] = malloc(16);
+    snprintf(args[n - 1], 16, "%d", TH_PORT + 1 + i);
+  }
+  pid = th_start(args);
+  if(pid < 0)
+    return 1;
+
+  for(i = 0; i < modems; i++) {
+    dte[i] = th_dte_open(TH_PORT + 1 + i);
+    if(dte[i] < 0) {
+      fprintf(stderr, "could not set up modem %d\n", i);
+      th_stop(pid);
+      return 1;
+    }
+  }
+  if(!th_is_running(pid)) {
+    fprintf(stderr, "tcpser did not start\n");
+    return 1;
+  }
+
+  start = th_now();
+  for(i = 0; i < modems; i++) {
+    caller[i] = th_connect(TH_PORT);
+    if(caller[i] < 0) {
+      fprintf(stderr, "call %d could not connect\n", i);
+      errors++;
+    }
+  }
+  for(i = 0; i < modems; i++) {
+    if(0 != th_expect(dte[i], "CONNECT", STRESS_WAIT)
+       || 0 != th_expect(dte[i], "\n", TH_WAIT)) {
+      fprintf(stderr, "modem %d did not answer\n", i);
+      errors++;
+      continue;
+    }
+    snprintf(text, sizeof(text), "modem %05d\n", i);
+    th_send(dte[i], text, strlen(text));
+  }
+
+  // the caller finds out who answered, and says who it is
+  for(i = 0; i < modems; i++) {
+    owner[i] = -1;
+    if(caller[i] < 0)
+      continue;
+    memset(text, 0, sizeof(text));
+    if(0 != th_expect(caller[i], "modem ", TH_WAIT)
+       || 6 != th_read(caller[i], text, 6, TH_WAIT)) {
+      fprintf(stderr, "call %d was lost\n", i);
+      errors++;
+      continue;
+    }
+    owner[i] = atoi(text);
+    if(owner[i] < 0 || owner[i] >= modems) {
+      fprintf(stderr, "call %d got an unknown modem %s\n", i, text);
+      errors++;
+      owner[i] = -1;
+      continue;
+    }
+    answered[owner[i]]++;
+    snprintf(text, sizeof(text), "call %05d\n", i);
+    th_send(caller[i], text, strlen(text));
+  }
+  for(i = 0; i < modems; i++) {
+    if(answered[i] != 1) {
+      fprintf(stderr, "modem %d answered %d calls\n", i, answered[i]);
+      errors++;
+    }
+  }
+  for(i = 0; i < modems; i++) {
+    snprintf(text, sizeof(text), "call %05d\n", i);
+    if(owner[i] > -1 && 0 != th_expect(dte[owner[i]], text, TH_WAIT)) {
+      fprintf(stderr, "modem %d did not hear from call %d\n", owner[i], i);
+      errors++;
+    }
+  }
+  printf("stress_test: %d calls up in %lld ms\n", modems, th_now() - start);
+
+  for(i = 0; i < modems; i++) {
+    if(caller[i] > -1)
+      close(caller[i]);
+  }
+  for(i = 0; i < modems; i++) {
+    if(0 != th_expect(dte[i], "NO CARRIER", STRESS_WAIT)) {
+      fprintf(stderr, "modem %d did not hang up\n", i);
+      errors++;
+    }
+    close(dte[i]);
+  }
+
+  status = th_stop(pid);
+  // a DEF=-DALLOC_DEBUG build exits on SIGTERM
+  if(!(WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM)
+     && !(WIFEXITED(status) && WEXITSTATUS(status) == SIGTERM)) {
+    fprintf(stderr, "tcpser did not exit cleanly\n");
+    errors++;
+  }
+  if(errors > 0) {
+    fprintf(stderr, "stress_test: %d errors\n", errors);
+    return 1;
+  }
+  printf("stress_test: %d calls, each answered once\n", modems);
+  return 0;
+}